@@ -0,0 +1,339 @@
+/*
+ * Load and latency benchmark.  Runs N linenoise sessions, each in its
+ * own process on its own pty, types a scripted keystroke stream into
+ * all of them at a fixed rate and measures the time from writing a key
+ * to the first byte of the editor's echo.  Only what changes on screen
+ * is written, so a key that changes nothing has no echo and is counted
+ * as lost; the script avoids those.
+ *
+ *   bench_pty [-n sessions] [-k keys per session] [-r keys/sec] [-s script]
+ *
+ * See license.txt
+ */
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "linenoise.h"
+
+using namespace std;
+
+#define BENCH_PROMPT	"bench> "
+#define KEY_TIMEOUT_US	1000000		/* give up on an echo after this */
+
+/* Default keystrokes, cycled: typing, completion, motion and editing */
+static const char *default_script =
+    "show ver\t\x1b[D\x1b[D\x7f\x7fsi\x01\x05\x1b" "b\x1b" "f\r"
+    "hell\t\t?lo world\x17\x17\r";
+
+static const char *commands[] = {
+    "show", "show version", "show interfaces", "hello", "helo", "quit",
+};
+
+struct bench_session_s {
+    int bs_fd;			/* pty master */
+    pid_t bs_pid;
+    size_t bs_next;		/* index of the next key in the script */
+    unsigned bs_sent;		/* keys sent so far */
+    uint64_t bs_due;		/* usec when the next key may go */
+    uint64_t bs_wait;		/* usec the last key went, 0 if echoed */
+    struct rusage bs_usage;
+};
+
+static uint64_t
+nowUsec (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Split the script into keys, escape sequences are kept together so
+ * each one is a single write, like a terminal would send it.
+ */
+static vector<string>
+splitKeys (const char *script)
+{
+    vector<string> keys;
+    const char *p = script;
+
+    while (*p) {
+	const char *start = p++;
+
+	if (*start == '\x1b' && (*p == '[' || *p == 'O')) {
+	    p++;
+	    while (*p && !(*p >= '@' && *p <= '~'))
+		p++;
+	    if (*p) p++;
+	} else if (*start == '\x1b' && *p) {
+	    p++;
+	}
+	keys.push_back(string(start, p - start));
+    }
+    return keys;
+}
+
+static void
+completion (const char *buf, linenoiseCompletions *lc)
+{
+    for (auto cmd : commands) {
+	if (strncmp(cmd, buf, strlen(buf)) == 0)
+	    linenoiseAddCompletion(lc, cmd, "help for command");
+    }
+}
+
+/*
+ * The child side, the same loop as linenoise_example.
+ */
+static void
+runEditor (void)
+{
+    char *line;
+
+    linenoiseSetCompletionCallback(completion);
+
+    while ((line = linenoise(BENCH_PROMPT)) != NULL) {
+	if (strlen(line))
+	    linenoiseHistoryAdd(line);
+	free(line);
+    }
+    exit(0);
+}
+
+static int
+startSession (bench_session_s &bs)
+{
+    struct winsize ws = { 24, 80, 0, 0 };
+    int slave;
+
+    if (openpty(&bs.bs_fd, &slave, NULL, NULL, &ws) == -1) {
+	perror("openpty");
+	return -1;
+    }
+
+    bs.bs_pid = fork();
+    if (bs.bs_pid == -1) {
+	perror("fork");
+	return -1;
+    }
+
+    if (bs.bs_pid == 0) {
+	close(bs.bs_fd);
+	setsid();
+	ioctl(slave, TIOCSCTTY, 0);
+	dup2(slave, 0);
+	dup2(slave, 1);
+	dup2(slave, 2);
+	if (slave > 2) close(slave);
+	setenv("TERM", "xterm", 1);
+	runEditor();
+    }
+
+    close(slave);
+    fcntl(bs.bs_fd, F_SETFL, fcntl(bs.bs_fd, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+/*
+ * Wait for the first prompt so start up isn't counted as latency.
+ */
+static int
+waitPrompt (bench_session_s &bs)
+{
+    string seen;
+    uint64_t end = nowUsec() + 5 * 1000000;
+
+    while (seen.find(BENCH_PROMPT) == string::npos) {
+	struct pollfd pfd = { bs.bs_fd, POLLIN, 0 };
+	char buf[512];
+	int n;
+
+	if (nowUsec() > end)
+	    return -1;
+	if (poll(&pfd, 1, 100) <= 0)
+	    continue;
+	n = read(bs.bs_fd, buf, sizeof(buf));
+	if (n > 0)
+	    seen.append(buf, n);
+    }
+    return 0;
+}
+
+static uint64_t
+percentile (vector<uint64_t> &v, double p)
+{
+    if (v.empty()) return 0;
+
+    size_t i = (size_t) (p * (v.size() - 1) + 0.5);
+    return v[i];
+}
+
+static void
+usage (void)
+{
+    fprintf(stderr,
+	    "usage: bench_pty [-n sessions] [-k keys] [-r keys/sec] [-s script]\n"
+	    "  -n  concurrent sessions (16)\n"
+	    "  -k  keystrokes per session (2000)\n"
+	    "  -r  keystrokes per second per session, 0 for as fast as\n"
+	    "      echoes come back (50)\n"
+	    "  -s  keystroke script, cycled (typing, TAB, motion, edits)\n");
+    exit(1);
+}
+
+int
+main (int argc, char **argv)
+{
+    int n_sessions = 16;
+    unsigned n_keys = 2000;
+    int rate = 50;
+    const char *script = default_script;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:k:r:s:")) != -1) {
+	switch (opt) {
+	case 'n': n_sessions = atoi(optarg); break;
+	case 'k': n_keys = atoi(optarg); break;
+	case 'r': rate = atoi(optarg); break;
+	case 's': script = optarg; break;
+	default: usage();
+	}
+    }
+    if (n_sessions < 1 || n_keys < 1 || rate < 0 || !*script)
+	usage();
+
+    vector<string> keys = splitKeys(script);
+    vector<bench_session_s> sessions(n_sessions);
+    vector<struct pollfd> pfds(n_sessions);
+    vector<uint64_t> latency;
+    uint64_t interval = rate ? 1000000 / rate : 0;
+    unsigned long long bytes_out = 0;
+    unsigned long lost = 0;
+    int active = n_sessions;
+
+    signal(SIGPIPE, SIG_IGN);
+    latency.reserve((size_t) n_sessions * n_keys);
+
+    for (auto &bs : sessions) {
+	memset(&bs, 0, sizeof(bs));
+	if (startSession(bs) == -1 || waitPrompt(bs) == -1) {
+	    fprintf(stderr, "session failed to start\n");
+	    return 1;
+	}
+    }
+
+    /* Spread the sessions over one interval so they don't type in step */
+    uint64_t start = nowUsec();
+    for (int i = 0; i < n_sessions; i++)
+	sessions[i].bs_due = start + interval * i / n_sessions;
+
+    while (active) {
+	uint64_t now = nowUsec();
+	int timeout = 100;
+
+	for (int i = 0; i < n_sessions; i++) {
+	    bench_session_s &bs = sessions[i];
+
+	    pfds[i].fd = bs.bs_fd;
+	    pfds[i].events = POLLIN;
+	    pfds[i].revents = 0;
+
+	    if (bs.bs_wait && now - bs.bs_wait > KEY_TIMEOUT_US) {
+		lost++;
+		bs.bs_wait = 0;
+	    }
+	    if (bs.bs_wait || bs.bs_sent >= n_keys)
+		continue;
+
+	    if (now >= bs.bs_due) {
+		const string &key = keys[bs.bs_next];
+
+		if (write(bs.bs_fd, key.data(), key.size()) == (ssize_t) key.size()) {
+		    bs.bs_wait = now;
+		    bs.bs_sent++;
+		    bs.bs_next = (bs.bs_next + 1) % keys.size();
+		    bs.bs_due = (bs.bs_due + interval > now) ? bs.bs_due + interval : now;
+		}
+	    } else if ((int) ((bs.bs_due - now) / 1000) < timeout) {
+		timeout = (bs.bs_due - now) / 1000;
+	    }
+	}
+
+	if (poll(pfds.data(), n_sessions, timeout) < 0 && errno != EINTR) {
+	    perror("poll");
+	    return 1;
+	}
+
+	now = nowUsec();
+	active = 0;
+	for (int i = 0; i < n_sessions; i++) {
+	    bench_session_s &bs = sessions[i];
+
+	    if (pfds[i].revents & POLLIN) {
+		char buf[4096];
+		int n;
+
+		while ((n = read(bs.bs_fd, buf, sizeof(buf))) > 0) {
+		    bytes_out += n;
+		    if (bs.bs_wait) {
+			latency.push_back(now - bs.bs_wait);
+			bs.bs_wait = 0;
+		    }
+		}
+	    }
+	    if (bs.bs_sent < n_keys || bs.bs_wait)
+		active++;
+	}
+    }
+    uint64_t elapsed = nowUsec() - start;
+
+    /* Collect the CPU each editor used */
+    double cpu_total = 0, cpu_max = 0;
+    for (auto &bs : sessions) {
+	int status;
+
+	kill(bs.bs_pid, SIGTERM);
+	wait4(bs.bs_pid, &status, 0, &bs.bs_usage);
+	close(bs.bs_fd);
+
+	double cpu = bs.bs_usage.ru_utime.tv_sec + bs.bs_usage.ru_stime.tv_sec +
+	    (bs.bs_usage.ru_utime.tv_usec + bs.bs_usage.ru_stime.tv_usec) / 1e6;
+	cpu_total += cpu;
+	if (cpu > cpu_max) cpu_max = cpu;
+    }
+
+    sort(latency.begin(), latency.end());
+
+    unsigned long long total_keys = (unsigned long long) n_sessions * n_keys;
+
+    printf("sessions %d, keys/session %u, rate %d/s, elapsed %.2fs\n",
+	   n_sessions, n_keys, rate, elapsed / 1e6);
+    printf("latency usec: p50 %llu  p99 %llu  p999 %llu  max %llu  (%lu lost)\n",
+	   (unsigned long long) percentile(latency, 0.50),
+	   (unsigned long long) percentile(latency, 0.99),
+	   (unsigned long long) percentile(latency, 0.999),
+	   (unsigned long long) (latency.empty() ? 0 : latency.back()), lost);
+    printf("bytes written per keystroke: %.1f\n",
+	   (double) bytes_out / total_keys);
+    printf("cpu per session: mean %.3fs  max %.3fs  (%.1f usec/keystroke)\n",
+	   cpu_total / n_sessions, cpu_max, cpu_total * 1e6 / total_keys);
+
+    return 0;
+}
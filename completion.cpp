@@ -0,0 +1,706 @@
+/*
+ * Copyright (c) 2015, Wing Eng
+ * All rights reserved.
+ */
+#include <algorithm>
+
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "completion.h"
+#include "pool.h"
+
+#define COMPLETE_POOL_MAX	2	/* worker threads, callbacks may block */
+
+using namespace std;
+
+/* ========================= Set =========================================== */
+
+void completion_set_c::
+add (string_view tok, string_view help)
+{
+    cs_item_s ci;
+
+    ci.ci_off = cs_arena.size();
+    ci.ci_token_len = tok.size();
+    ci.ci_help_len = help.size();
+    cs_arena.append(tok).push_back('\0');
+    cs_arena.append(help).push_back('\0');
+    cs_items.push_back(ci);
+}
+
+void completion_set_c::
+swap (completion_set_c &set)
+{
+    cs_arena.swap(set.cs_arena);
+    cs_items.swap(set.cs_items);
+}
+
+/* ========================= Cache ========================================= */
+
+/*
+ * Make buf's completions the current level if they can be had from the
+ * cache.  Returns false on a miss, when the caller gets them from the
+ * application and hands them to fill().
+ */
+bool completion_cache_c::
+find (const char *buf)
+{
+    size_t len = strlen(buf);
+
+    while (cc_depth) {
+	const string &prefix = cc_levels[cc_depth - 1].cl_prefix;
+
+	if (prefix.size() <= len && prefix.compare(0, prefix.size(), buf, prefix.size()) == 0)
+	    break;
+	cc_depth--;
+    }
+    if (!cc_depth) {
+	cc_misses++;
+	return false;
+    }
+
+    cc_hits++;
+    if (cc_levels[cc_depth - 1].cl_prefix.size() == len)
+	return true;
+
+    /* Popped levels keep their capacity for the next narrowing */
+    if (cc_depth == cc_levels.size())
+	cc_levels.emplace_back();
+
+    /* Everything in the level starts with its prefix, check the rest */
+    const cc_level_s &level = cc_levels[cc_depth - 1];
+    cc_level_s &next = cc_levels[cc_depth];
+    size_t from = level.cl_prefix.size();
+
+    next.cl_prefix.assign(buf, len);
+    next.cl_items.clear();
+    for (auto i : level.cl_items) {
+	string_view tok = cc_base[i].lnc_token;
+
+	if (tok.size() >= len && tok.compare(from, len - from, buf + from) == 0)
+	    next.cl_items.push_back(i);
+    }
+    cc_depth++;
+    return true;
+}
+
+/* Whether find() would hit for buf, without counting or narrowing. */
+bool completion_cache_c::
+covers (const char *buf) const
+{
+    if (!cc_depth)
+	return false;
+
+    const string &prefix = cc_levels[0].cl_prefix;
+
+    return strncmp(prefix.c_str(), buf, prefix.size()) == 0;
+}
+
+/*
+ * The application's completions for buf, after find() missed.  They're
+ * swapped in, set is left with the old ones for the caller to reuse.
+ */
+void completion_cache_c::
+fill (const char *buf, completion_set_c &set)
+{
+    cc_base.swap(set);
+    if (cc_levels.empty())
+	cc_levels.emplace_back();
+    cc_depth = 1;
+
+    cc_level_s &level = cc_levels[0];
+
+    level.cl_prefix = buf;
+    level.cl_items.clear();
+    for (uint32_t i = 0; i < cc_base.size(); i++)
+	level.cl_items.push_back(i);
+}
+
+void completion_cache_c::
+clear (void)
+{
+    cc_base.clear();
+    cc_depth = 0;
+}
+
+/* ========================= Async ========================================= */
+
+/* Apart from the fuzzy finder's, a slow callback mustn't hold up scans */
+static work_pool_c *
+completePool (void)
+{
+    static work_pool_c *pool = new work_pool_c(COMPLETE_POOL_MAX);
+
+    return pool;
+}
+
+completion_async_c::
+completion_async_c (int wake_fd) :
+    ca_gen(0), ca_tasks(0), ca_active(false), ca_done(false), ca_wake(wake_fd)
+{
+}
+
+/* Waits for a callback still running, it holds a pointer to us. */
+completion_async_c::
+~completion_async_c ()
+{
+    cancel();
+
+    unique_lock<mutex> lock(ca_lock);
+    ca_idle.wait(lock, [this] { return ca_tasks == 0; });
+}
+
+/*
+ * Ask for buf's completions in the background, unless they already
+ * have been.
+ */
+void completion_async_c::
+start (complete_func *fn, const char *buf)
+{
+    uint64_t gen;
+
+    {
+	lock_guard<mutex> lock(ca_lock);
+
+	if (ca_active && ca_buf == buf)
+	    return;
+	gen = ++ca_gen;
+	ca_active = true;
+	ca_done = false;
+	ca_buf = buf;
+	ca_comps.clear();
+	ca_tasks++;
+    }
+
+    string copy(buf);
+
+    completePool()->submit([this, fn, copy, gen] { run(fn, copy, gen); });
+}
+
+void completion_async_c::
+run (complete_func *fn, const string &buf, uint64_t gen)
+{
+    completion_req_s req;
+    completion_set_c set;
+
+    {
+	lock_guard<mutex> lock(ca_lock);
+
+	if (!ca_spare.empty()) {
+	    set.swap(ca_spare.back());
+	    ca_spare.pop_back();
+	}
+    }
+    set.clear();
+    req.cr_set = &set;
+    req.cr_async = this;
+    req.cr_gen = gen;
+    req.cr_offset = req.cr_limit = req.cr_seen = 0;
+
+    /* Cancelled while it was queued, don't bother */
+    if (gen == ca_gen)
+	fn(buf.c_str(), (void **) &req);
+
+    lock_guard<mutex> lock(ca_lock);
+
+    if (gen == ca_gen) {
+	ca_comps.swap(set);
+	ca_done = true;
+	if (write(ca_wake, "", 1) == -1) {} /* full means already woken */
+    }
+    ca_spare.push_back(std::move(set));
+    ca_tasks--;
+    ca_idle.notify_all();
+}
+
+/* Drop the request in flight, or the results for a buffer gone by. */
+void completion_async_c::
+cancel (void)
+{
+    lock_guard<mutex> lock(ca_lock);
+
+    if (!ca_active)
+	return;
+    ca_gen++;
+    ca_active = false;
+    ca_done = false;
+    ca_comps.clear();
+}
+
+/* Copy out buf's completions if they're in. */
+bool completion_async_c::
+results (const char *buf, completion_set_c &set)
+{
+    lock_guard<mutex> lock(ca_lock);
+
+    if (!ca_done || ca_buf != buf)
+	return false;
+    set = ca_comps;
+    return true;
+}
+
+/* Whether results() would have buf's completions. */
+bool completion_async_c::
+ready (const char *buf)
+{
+    lock_guard<mutex> lock(ca_lock);
+
+    return ca_done && ca_buf == buf;
+}
+
+/* Whether buf's completions are asked for, or in. */
+bool completion_async_c::
+wanted (const char *buf)
+{
+    lock_guard<mutex> lock(ca_lock);
+
+    return ca_active && ca_buf == buf;
+}
+
+/* ========================= Trie ========================================== */
+
+completion_trie_c::
+completion_trie_c () :
+    ct_nodes(1)
+{
+    ct_nodes[0].tn_token = false;
+    ct_nodes[0].tn_count = 0;
+}
+
+static bool
+charLess (char a, char b)
+{
+    return (unsigned char) a < (unsigned char) b;
+}
+
+/* Index of node's child whose edge starts with ch, or npos. */
+size_t completion_trie_c::
+child (uint32_t node, char ch) const
+{
+    const string &first = ct_nodes[node].tn_first;
+    auto it = lower_bound(first.begin(), first.end(), ch, charLess);
+
+    if (it == first.end() || *it != ch)
+	return string::npos;
+    return it - first.begin();
+}
+
+/* Add token, or replace its help if it's already there. */
+void completion_trie_c::
+add (string_view token, string_view help)
+{
+    uint32_t node = 0;
+    size_t pos = 0;
+    string path;
+
+    /* A new token counts in every node on its way down */
+    bool fresh = !descend(token, node, path) || path.size() != token.size() ||
+	!ct_nodes[node].tn_token;
+
+    node = 0;
+    ct_nodes[0].tn_count += fresh;
+    while (pos < token.size()) {
+	size_t k = child(node, token[pos]);
+
+	if (k == string::npos) {
+	    trie_node_s leaf;
+	    uint32_t id = ct_nodes.size();
+
+	    leaf.tn_edge = token.substr(pos);
+	    leaf.tn_help = help;
+	    leaf.tn_token = true;
+	    leaf.tn_count = 1;
+	    ct_nodes.push_back(std::move(leaf));
+
+	    trie_node_s &tn = ct_nodes[node];
+	    auto it = lower_bound(tn.tn_first.begin(), tn.tn_first.end(), token[pos], charLess);
+
+	    tn.tn_children.insert(tn.tn_children.begin() + (it - tn.tn_first.begin()), id);
+	    tn.tn_first.insert(it, token[pos]);
+	    return;
+	}
+
+	uint32_t c = ct_nodes[node].tn_children[k];
+	const string &edge = ct_nodes[c].tn_edge;
+	size_t n = 0;
+
+	while (n < edge.size() && pos + n < token.size() && edge[n] == token[pos + n])
+	    n++;
+	pos += n;
+	if (n == edge.size()) {
+	    node = c;
+	    ct_nodes[node].tn_count += fresh;
+	    continue;
+	}
+
+	/* token leaves the edge part way, split it there */
+	trie_node_s mid;
+	uint32_t id = ct_nodes.size();
+
+	mid.tn_edge = edge.substr(0, n);
+	mid.tn_token = false;
+	mid.tn_count = ct_nodes[c].tn_count + 1;
+	mid.tn_first = edge[n];
+	mid.tn_children.push_back(c);
+	ct_nodes[c].tn_edge.erase(0, n);
+	ct_nodes.push_back(std::move(mid));
+	ct_nodes[node].tn_children[k] = id;
+	node = id;
+    }
+
+    ct_nodes[node].tn_token = true;
+    ct_nodes[node].tn_help = help;
+}
+
+void completion_trie_c::
+clear (void)
+{
+    ct_nodes.resize(1);
+    ct_nodes[0] = trie_node_s();
+    ct_nodes[0].tn_token = false;
+    ct_nodes[0].tn_count = 0;
+}
+
+/*
+ * Find the node whose subtree is the tokens starting with prefix.  path
+ * is set to all of its chars, prefix may end part way into its edge.
+ */
+bool completion_trie_c::
+descend (string_view prefix, uint32_t &node, string &path) const
+{
+    size_t pos = 0, start = 0;
+
+    node = 0;
+    while (pos < prefix.size()) {
+	size_t k = child(node, prefix[pos]);
+
+	if (k == string::npos)
+	    return false;
+	node = ct_nodes[node].tn_children[k];
+
+	const string &edge = ct_nodes[node].tn_edge;
+	size_t n = min(edge.size(), prefix.size() - pos);
+
+	if (edge.compare(0, n, prefix.data() + pos, n) != 0)
+	    return false;
+	start = pos;
+	pos += n;
+    }
+
+    /* The last edge may go on past the prefix */
+    path.assign(prefix.data(), start);
+    if (node != 0)
+	path += ct_nodes[node].tn_edge;
+    return true;
+}
+
+/* The longest common prefix of the tokens starting with prefix. */
+bool completion_trie_c::
+longest (string_view prefix, string &lcp) const
+{
+    uint32_t node;
+
+    if (!descend(prefix, node, lcp) || ct_nodes[node].tn_count == 0)
+	return false;
+
+    for (;;) {
+	const trie_node_s &tn = ct_nodes[node];
+
+	if (tn.tn_token || tn.tn_children.size() != 1)
+	    return true;
+	node = tn.tn_children[0];
+	lcp += ct_nodes[node].tn_edge;
+    }
+}
+
+/* Subtrees wholly inside the skip are stepped over by their count */
+bool completion_trie_c::
+walk (uint32_t node, string &path, const trie_walk_f &fn, size_t &skip, size_t &n) const
+{
+    const trie_node_s &tn = ct_nodes[node];
+
+    if (skip >= tn.tn_count) {
+	skip -= tn.tn_count;
+	return true;
+    }
+    if (tn.tn_token) {
+	if (skip) {
+	    skip--;
+	} else {
+	    n++;
+	    if (!fn(path, tn.tn_help))
+		return false;
+	}
+    }
+    for (auto c : tn.tn_children) {
+	size_t len = path.size();
+
+	path += ct_nodes[c].tn_edge;
+	if (!walk(c, path, fn, skip, n))
+	    return false;
+	path.resize(len);
+    }
+    return true;
+}
+
+/*
+ * Call fn with each token starting with prefix, in sorted order from
+ * the offset'th, until it returns false.  Returns the number of calls.
+ */
+size_t completion_trie_c::
+find (string_view prefix, const trie_walk_f &fn, size_t offset) const
+{
+    uint32_t node;
+    size_t n = 0;
+
+    if (descend(prefix, node, ct_path))
+	walk(node, ct_path, fn, offset, n);
+    return n;
+}
+
+/* How many tokens start with prefix, O(L). */
+size_t completion_trie_c::
+count (string_view prefix) const
+{
+    uint32_t node;
+
+    return descend(prefix, node, ct_path) ? ct_nodes[node].tn_count : 0;
+}
+
+#ifdef _TEST
+
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+
+#define TEST(x) if (!(x)) assert(0)
+
+/* Every allocation is counted, to check the steady state makes none */
+static atomic<unsigned long> allocs;
+
+void *
+operator new (size_t size)
+{
+    void *p;
+
+    allocs++;
+    if (!(p = malloc(size ? size : 1)))
+	throw bad_alloc();
+    return p;
+}
+
+void
+operator delete (void *p) noexcept
+{
+    free(p);
+}
+
+void
+operator delete (void *p, size_t) noexcept
+{
+    free(p);
+}
+
+static const char *cmds[] = { "show version", "show interfaces", "set", "shutdown", NULL };
+static int calls;
+
+static void
+complete (completion_cache_c &cc, const char *buf)
+{
+    if (cc.find(buf))
+	return;
+
+    static completion_set_c lc;
+
+    calls++;
+    lc.clear();
+    for (int i = 0; cmds[i]; i++)
+	if (strncmp(cmds[i], buf, strlen(buf)) == 0)
+	    lc.add(cmds[i], "");
+    cc.fill(buf, lc);
+}
+
+/* What a TAB then '?' do with the cache off: ask, narrow, list. */
+static void
+complete_cycle (completion_cache_c &cc, completion_set_c &set, int n)
+{
+    char tok[32];
+    size_t len = 0;
+
+    cc.clear();
+    TEST(!cc.find("cmd"));
+    set.clear();
+    for (int i = 0; i < n; i++) {
+	snprintf(tok, sizeof(tok), "cmd%d", i);
+	set.add(tok, "a longer help string than fits in a short string");
+    }
+    cc.fill("cmd", set);
+    TEST(cc.find("cmd1") && cc.find("cmd12") && cc.find("cmd"));
+    for (size_t i = 0; i < cc.size(); i++)
+	len += cc[i].lnc_token.size() + cc[i].lnc_help.size();
+    TEST(cc.size() == (size_t) n && len > 0);
+}
+
+int
+main ()
+{
+    completion_cache_c cc;
+
+    complete(cc, "s");
+    TEST(calls == 1 && cc.size() == 4);
+
+    /* Narrowed from the cached set */
+    complete(cc, "sh");
+    TEST(calls == 1 && cc.size() == 3);
+    complete(cc, "show v");
+    TEST(calls == 1 && cc.size() == 1 && cc[0].lnc_token == "show version");
+    complete(cc, "show vx");
+    TEST(calls == 1 && cc.size() == 0);
+
+    /* Backspace falls back to a shorter level */
+    complete(cc, "show ");
+    TEST(calls == 1 && cc.size() == 2 && cc[1].lnc_token == "show interfaces");
+    complete(cc, "s");
+    TEST(calls == 1 && cc.size() == 4);
+    TEST(cc.cc_hits == 5 && cc.cc_misses == 1);
+
+    /* Not an extension of anything cached */
+    complete(cc, "");
+    TEST(calls == 2 && cc.size() == 4);
+    complete(cc, "x");
+    TEST(calls == 2 && cc.size() == 0);
+
+    cc.clear();
+    complete(cc, "x");
+    TEST(calls == 3 && cc.cc_misses == 3);
+    TEST(!cc.covers("y") && cc.covers("xy"));
+
+    /* Once the arenas and levels have grown, no more allocations */
+    {
+	completion_cache_c cc;
+	completion_set_c set;
+
+	complete_cycle(cc, set, 1000);
+	complete_cycle(cc, set, 1000);
+
+	unsigned long before = allocs;
+
+	for (int i = 0; i < 100; i++)
+	    complete_cycle(cc, set, 1 + i * 10);
+	TEST(allocs == before);
+    }
+
+    /* Async, the slow request for "s" is cancelled by the one for "sh" */
+    static atomic<int> started, saw_cancel;
+    completion_set_c got;
+    int wake[2];
+
+    TEST(pipe(wake) == 0);
+    {
+	completion_async_c async(wake[1]);
+	complete_func *slow = [] (const char *buf, void **lc) {
+	    auto req = (completion_req_s *) lc;
+
+	    if (strcmp(buf, "s") == 0) {
+		started = 1;
+		while (!req->cr_async->cancelled(req))
+		    usleep(1000);
+		saw_cancel = 1;
+		return;
+	    }
+	    req->cr_set->add(buf, "done");
+	};
+
+	async.start(slow, "s");
+	TEST(async.wanted("s") && !async.results("s", got) && !async.ready("s"));
+	while (!started)
+	    usleep(1000);
+	async.start(slow, "sh");
+
+	struct pollfd pfd = { wake[0], POLLIN, 0 };
+	TEST(poll(&pfd, 1, 5000) == 1);
+	TEST(async.ready("sh") && async.results("sh", got));
+	TEST(got.size() == 1 && got[0].lnc_token == "sh" && got[0].lnc_help == "done");
+	TEST(!async.results("s", got) && !async.wanted("s"));
+
+	async.cancel();
+	TEST(!async.results("sh", got) && !async.wanted("sh"));
+    }
+    TEST(saw_cancel);
+    close(wake[0]);
+    close(wake[1]);
+
+    /* The trie against a sorted list of the same tokens */
+    completion_trie_c trie;
+    vector<string> toks;
+    string lcp;
+
+    TEST(!trie.longest("", lcp));
+    srand(1);
+    for (int i = 0; i < 5000; i++) {
+	string tok;
+
+	for (int n = rand() % 8; n >= 0; n--)
+	    tok += "ab\xc3z "[rand() % 5];
+	toks.push_back(tok);
+	trie.add(tok, "help " + tok);
+    }
+    sort(toks.begin(), toks.end());
+    toks.erase(unique(toks.begin(), toks.end()), toks.end());
+    TEST(trie.size() == toks.size());
+
+    for (int i = 0; i < 2000; i++) {
+	string prefix = toks[rand() % toks.size()].substr(0, rand() % 5);
+	vector<string> want, got;
+
+	if (i % 3 == 0)
+	    prefix += "ab\xc3z "[rand() % 5];
+	for (auto &tok : toks)
+	    if (tok.compare(0, prefix.size(), prefix) == 0)
+		want.push_back(tok);
+
+	size_t n = trie.find(prefix, [&] (const string &tok, const string &help) {
+		TEST(help == "help " + tok);
+		got.push_back(tok);
+		return true;
+	    });
+	TEST(n == want.size() && got == want && trie.count(prefix) == n);
+
+	/* A page from part way in */
+	size_t off = rand() % (want.size() + 2);
+	got.clear();
+	trie.find(prefix, [&] (const string &tok, const string &) {
+		got.push_back(tok);
+		return got.size() < 3;
+	    }, off);
+	TEST(equal(got.begin(), got.end(), want.begin() + min(off, want.size())));
+	TEST(got.size() == min((size_t) 3, want.size() - min(off, want.size())));
+
+	if (!trie.longest(prefix, lcp)) {
+	    TEST(want.empty());
+	    continue;
+	}
+	size_t len = want[0].size();
+	for (auto &tok : want)
+	    while (tok.compare(0, len, want[0], 0, len) != 0)
+		len--;
+	TEST(lcp == want[0].substr(0, len));
+    }
+
+    /* find() stops when fn says so */
+    TEST(trie.find("", [] (const string &, const string &) { return false; }) == 1);
+    trie.add("a", "new");
+    trie.find("a", [] (const string &tok, const string &help) {
+	    TEST(tok == "a" && help == "new");
+	    return false;
+	});
+    trie.clear();
+    TEST(trie.size() == 0 && trie.find("", [] (const string &, const string &) { return true; }) == 0);
+
+    printf("all test passed\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2015, Wing Eng
+ * All rights reserved.
+ */
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+
+/* One completion, viewing a completion_set_c's arena. */
+struct lnCompletion {
+    std::string_view lnc_token;
+    std::string_view lnc_help;
+};
+
+/*
+ * The completions for one request.  Tokens and help are packed NUL
+ * terminated in one arena, so adding them is a copy into spare capacity
+ * rather than two strings each, and clear() keeps the capacity for the
+ * next request.  Once a set has held the largest request it's reused
+ * for, filling it again doesn't allocate.
+ *
+ * The views operator[] hands out are good until the next add().
+ */
+class completion_set_c {
+public:
+    void add (std::string_view tok, std::string_view help);
+    void clear (void) { cs_arena.clear(); cs_items.clear(); }
+    void swap (completion_set_c &set);
+
+    size_t size (void) const { return cs_items.size(); }
+    lnCompletion operator[] (size_t i) const {
+	const cs_item_s &ci = cs_items[i];
+	const char *p = cs_arena.data() + ci.ci_off;
+
+	return { std::string_view(p, ci.ci_token_len),
+		 std::string_view(p + ci.ci_token_len + 1, ci.ci_help_len) };
+    }
+
+private:
+    struct cs_item_s {
+	uint32_t ci_off;		/* token, then help, in cs_arena */
+	uint32_t ci_token_len;
+	uint32_t ci_help_len;
+    };
+
+    std::string cs_arena;
+    std::vector<cs_item_s> cs_items;
+};
+
+/*
+ * The completions for the buffer, remembered by the prefix they were
+ * asked for.  When the buffer extends a cached prefix, the completions
+ * are the cached ones that start with the whole buffer, filtered from
+ * the longest such prefix without calling the application back.
+ *
+ * The callback's results are the bottom level, each filter pushes a
+ * level of indices into it keyed by a longer prefix.  A buffer that is
+ * no longer an extension of a level pops it, so backspacing falls back
+ * to the shorter prefix, and only a buffer that doesn't extend the
+ * bottom one misses.
+ *
+ * That's only right when the callback's completions all start with the
+ * buffer, so the cache is optional, and the application clears it when
+ * its completions change.
+ */
+class completion_cache_c {
+public:
+    completion_cache_c () : cc_hits(0), cc_misses(0), cc_depth(0) {};
+
+    bool find (const char *buf);
+    bool covers (const char *buf) const;
+    void fill (const char *buf, completion_set_c &set);
+    void clear (void);
+
+    size_t size (void) const { return cc_levels[cc_depth - 1].cl_items.size(); }
+    lnCompletion operator[] (size_t i) const {
+	return cc_base[cc_levels[cc_depth - 1].cl_items[i]];
+    }
+
+    unsigned long cc_hits;	/* find()s served from the cache */
+    unsigned long cc_misses;	/* ... and those that need fill() */
+
+private:
+    struct cc_level_s {
+	std::string cl_prefix;
+	std::vector<uint32_t> cl_items;	/* indices into cc_base */
+    };
+
+    completion_set_c cc_base;
+    size_t cc_depth;			/* levels in use, the rest are spare */
+    std::vector<cc_level_s> cc_levels;
+};
+
+/*
+ * Runs the completion callback on worker threads, for callbacks that
+ * are slow to answer.  start() cancels the request in flight: its
+ * results are dropped, and the callback can see it's been cancelled
+ * with cancelled() and give up early.  When the results for the newest
+ * request are in, a byte is written to the wake fd and results() hands
+ * them out for as long as the buffer is the same.
+ *
+ * The callback gets a completion_req_s as its linenoiseCompletions.
+ * The sets it fills are recycled from one request to the next.
+ */
+class completion_async_c;
+
+struct completion_req_s {
+    completion_set_c *cr_set;
+    const completion_async_c *cr_async;	/* NULL when called inline */
+    uint64_t cr_gen;
+    size_t cr_offset;			/* adds skipped before the page */
+    size_t cr_limit;			/* page size, 0 for all */
+    size_t cr_seen;			/* adds so far */
+};
+
+typedef void (complete_func)(const char *buf, void **lc);
+
+class completion_async_c {
+public:
+    completion_async_c (int wake_fd);
+    ~completion_async_c ();
+
+    void start (complete_func *fn, const char *buf);
+    void cancel (void);
+    bool results (const char *buf, completion_set_c &set);
+    bool ready (const char *buf);
+    bool wanted (const char *buf);
+    bool cancelled (const completion_req_s *req) const { return req->cr_gen != ca_gen; }
+
+private:
+    void run (complete_func *fn, const std::string &buf, uint64_t gen);
+
+    std::mutex ca_lock;
+    std::condition_variable ca_idle;
+    std::atomic<uint64_t> ca_gen;	/* bumped to cancel a request */
+    int ca_tasks;			/* requests queued or running */
+    bool ca_active;			/* ca_buf is asked for, or done */
+    bool ca_done;			/* ca_comps are ca_buf's */
+    std::string ca_buf;
+    completion_set_c ca_comps;
+    std::vector<completion_set_c> ca_spare;	/* for the next run() */
+    int ca_wake;
+};
+
+/*
+ * A dictionary of completion tokens registered up front, so the
+ * completion callback isn't needed.  It's a compressed radix trie: an
+ * edge holds the chars its subtree shares, and a node's children are
+ * kept sorted by their first char.  Finding the node for the buffer is
+ * O(L), the longest common prefix of its completions is the path down
+ * to the first node that ends a token or branches, and listing them is
+ * O(L + matches) in sorted order.  Each node counts the tokens below
+ * it, so counting the matches is O(L) and a listing can start part way
+ * in by skipping whole subtrees.
+ *
+ * find() and count() build the path in a scratch string kept by the
+ * trie, so once it has held the longest token they don't allocate; pass
+ * find() a lambda with std::ref() for the same, the function is made
+ * around the reference.  Neither is safe to call from two threads.
+ */
+typedef std::function<bool (const std::string &token, const std::string &help)> trie_walk_f;
+
+class completion_trie_c {
+public:
+    completion_trie_c ();
+
+    void add (std::string_view token, std::string_view help);
+    void clear (void);
+    size_t size (void) const { return ct_nodes[0].tn_count; }
+    bool longest (std::string_view prefix, std::string &lcp) const;
+    size_t find (std::string_view prefix, const trie_walk_f &fn, size_t offset = 0) const;
+    size_t count (std::string_view prefix) const;
+
+private:
+    struct trie_node_s {
+	std::string tn_edge;		/* chars from the parent */
+	std::string tn_help;
+	bool tn_token;			/* a token ends here */
+	size_t tn_count;		/* tokens here and below */
+	std::string tn_first;		/* first char of each child's edge */
+	std::vector<uint32_t> tn_children;
+    };
+
+    size_t child (uint32_t node, char ch) const;
+    bool descend (std::string_view prefix, uint32_t &node, std::string &path) const;
+    bool walk (uint32_t node, std::string &path, const trie_walk_f &fn,
+	       size_t &skip, size_t &n) const;
+
+    std::vector<trie_node_s> ct_nodes;	/* [0] is the root */
+    mutable std::string ct_path;	/* for find() and count() */
+};
+
+#endif
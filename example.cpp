@@ -2,7 +2,9 @@
  * Copyright (c) 2015, Wing Eng
  * All rights reserved.
  */
+#include <algorithm>
 #include <functional>
+#include <string>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -105,17 +107,71 @@ call_command (const char *buf)
     }
 }
 
+/*
+ * The first word is bold when it's a command, red when it isn't, the
+ * rest of the line plain.  The state is whether the first word is done.
+ */
+static void
+highlight (const char *text, size_t len, int state, linenoiseHighlights hl)
+{
+    size_t i = 0, n;
+
+    if (state == 0) {
+	const char *style = "31";
+	std::string word;
+
+	while (i < len && text[i] != ' ')
+	    i++;
+	word.assign(text, i);
+	for (auto &cmd : cmds) {
+	    if (word == cmd.c_token)
+		style = "1";
+	}
+	/* Unfinished at the end of the line, it's still in state 0 */
+	if (linenoiseAddHighlight(hl, i, style, i < len))
+	    return;
+    }
+    for (; i < len; i += n) {
+	n = std::min(len - i, (size_t) 64);
+	if (linenoiseAddHighlight(hl, n, NULL, 1))
+	    return;
+    }
+}
+
+/* The help of the one command the line is a prefix of. */
+static const char *
+hint (const char *line, const char **style UNUSED)
+{
+    static std::string help;
+    int n_commands = 0;
+
+    if (!*line || strchr(line, ' '))
+	return NULL;
+    command_match(line, [&] (command_t &cmd) {
+	    help = std::string("  ") + cmd.c_help;
+	    n_commands++;
+	});
+    return n_commands == 1 ? help.c_str() : NULL;
+}
+
 int
-main ()
+main (int argc, char **argv)
 {
     char *line;
 
+    /* --multiline wraps long lines instead of scrolling them */
+    if (argc > 1 && !strcmp(argv[1], "--multiline"))
+	linenoiseSetMultiLine(1);
+
     linenoiseSetCompletionCallback([] (const char *buf, linenoiseCompletions *lc) {
 	    command_match(buf, [lc] (command_t &cmd) {
 		    linenoiseAddCompletion(lc, cmd.c_token, cmd.c_help);
 		});
 	});
-    linenoiseHistoryLoad("history.txt");
+    linenoiseSetCompletionCache(1);
+    linenoiseSetHighlightCallback(highlight);
+    linenoiseSetHintCallback(hint);
+    linenoiseHistoryShare("history.txt");
 
     /*
      * Now this is the main loop of the typical linenoise-based application.
@@ -130,7 +186,6 @@ main ()
 	    call_command(line);
 
 	    linenoiseHistoryAdd(line);
-	    linenoiseHistorySave("history.txt");
 	}
 
 
@@ -0,0 +1,461 @@
+/*
+ * Copyright (c) 2015, Wing Eng
+ * All rights reserved.
+ */
+#include <algorithm>
+
+#include <assert.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "fuzzy.h"
+#include "pool.h"
+
+using namespace std;
+
+/* Scoring, in the spirit of fzf's v1 algorithm */
+#define SCORE_MATCH		16
+#define SCORE_GAP_START		3
+#define SCORE_GAP_EXTEND	1
+#define BONUS_BOUNDARY		8	/* match at the start of a word */
+#define BONUS_CONSECUTIVE	4	/* match right after another one */
+
+#define FUZZY_BLOCK		4096	/* masks prefiltered at a time */
+#define FUZZY_POOL_MAX		4	/* worker threads */
+
+static inline char
+fold (char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static inline int
+isWordChar (char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+static inline int
+isBoundary (string_view text, size_t i)
+{
+    if (i == 0)
+	return 1;
+
+    char prev = text[i - 1], c = text[i];
+
+    return !isWordChar(prev) || (prev >= 'a' && prev <= 'z' && c >= 'A' && c <= 'Z');
+}
+
+/*
+ * Score text against pattern, -1 if the pattern's chars don't all
+ * appear in order.  Case is ignored.  The first match found scanning
+ * forward is shrunk by scanning back from its end, so the score is for
+ * the tightest window ending there.
+ */
+int
+fuzzyScore (string_view pattern, string_view text)
+{
+    size_t pi = 0, start, end = 0;
+
+    if (pattern.empty())
+	return 0;
+
+    for (size_t i = 0; i < text.size(); i++) {
+	if (fold(text[i]) == fold(pattern[pi]) && ++pi == pattern.size()) {
+	    end = i + 1;
+	    break;
+	}
+    }
+    if (pi < pattern.size())
+	return -1;
+
+    for (start = end; pi > 0; ) {
+	start--;
+	if (fold(text[start]) == fold(pattern[pi - 1]))
+	    pi--;
+    }
+
+    int score = 0;
+    int consecutive = 0;
+    int chunk_bonus = 0;
+    int gap = 0;
+
+    /* A run of matches keeps the bonus of its first char */
+    for (size_t i = start; i < end; i++) {
+	if (pi < pattern.size() && fold(text[i]) == fold(pattern[pi])) {
+	    int bonus = isBoundary(text, i) ? BONUS_BOUNDARY : 0;
+
+	    if (consecutive) {
+		if (bonus < chunk_bonus) bonus = chunk_bonus;
+		if (bonus < BONUS_CONSECUTIVE) bonus = BONUS_CONSECUTIVE;
+	    } else {
+		chunk_bonus = bonus;
+	    }
+	    score += SCORE_MATCH + bonus;
+	    consecutive = 1;
+	    gap = 0;
+	    pi++;
+	} else {
+	    score -= gap ? SCORE_GAP_EXTEND : SCORE_GAP_START;
+	    consecutive = 0;
+	    gap = 1;
+	}
+    }
+    return score;
+}
+
+/* ========================= Prefilter ===================================== */
+
+/*
+ * Write to out the index of every mask from i on that has all the bits
+ * of need, returning how many there were.  The index is stored
+ * unconditionally and the count bumped by the test, so there are no
+ * branches to miss.
+ */
+static size_t
+prefilterScalar (const uint64_t *masks, size_t i, size_t n, uint64_t need, uint32_t *out)
+{
+    size_t k = 0;
+
+    for (; i < n; i++) {
+	out[k] = i;
+	k += (masks[i] & need) == need;
+    }
+    return k;
+}
+
+#ifdef __SSE2__
+/* SSE2 has no 64 bit compare, a mask passes when both halves match */
+static size_t
+prefilterSSE2 (const uint64_t *masks, size_t n, uint64_t need, uint32_t *out)
+{
+    __m128i want = _mm_set1_epi64x(need);
+    size_t i, k = 0;
+
+    for (i = 0; i + 2 <= n; i += 2) {
+	__m128i m = _mm_loadu_si128((const __m128i *) (masks + i));
+	__m128i eq = _mm_cmpeq_epi32(_mm_and_si128(m, want), want);
+	int bits = _mm_movemask_ps(_mm_castsi128_ps(eq));
+
+	out[k] = i;
+	k += (bits & 3) == 3;
+	out[k] = i + 1;
+	k += (bits & 12) == 12;
+    }
+    return k + prefilterScalar(masks, i, n, need, out + k);
+}
+#endif
+
+#ifdef __x86_64__
+__attribute__((target("avx2"))) static size_t
+prefilterAVX2 (const uint64_t *masks, size_t n, uint64_t need, uint32_t *out)
+{
+    __m256i want = _mm256_set1_epi64x(need);
+    size_t i, k = 0;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+	__m256i m = _mm256_loadu_si256((const __m256i *) (masks + i));
+	__m256i eq = _mm256_cmpeq_epi64(_mm256_and_si256(m, want), want);
+	int bits = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+
+	while (bits) {
+	    out[k++] = i + __builtin_ctz(bits);
+	    bits &= bits - 1;
+	}
+    }
+    return k + prefilterScalar(masks, i, n, need, out + k);
+}
+#endif
+
+typedef size_t (prefilter_func)(const uint64_t *, size_t, uint64_t, uint32_t *);
+
+#ifndef __SSE2__
+static size_t
+prefilterPortable (const uint64_t *masks, size_t n, uint64_t need, uint32_t *out)
+{
+    return prefilterScalar(masks, 0, n, need, out);
+}
+#endif
+
+static prefilter_func *
+prefilterSelect (void)
+{
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("avx2"))
+	return prefilterAVX2;
+#endif
+#ifdef __SSE2__
+    return prefilterSSE2;
+#else
+    return prefilterPortable;
+#endif
+}
+
+/*
+ * The indexes of the masks containing need, out has room for n.  Uses
+ * AVX2 when the CPU has it, else SSE2 where it's part of the ABI.
+ */
+size_t
+fuzzyPrefilter (const uint64_t *masks, size_t n, uint64_t need, uint32_t *out)
+{
+    static prefilter_func *func = prefilterSelect();
+
+    return func(masks, n, need, out);
+}
+
+/* ========================= Worker pool =================================== */
+
+/* Threads shared by the finders of all sessions */
+static work_pool_c *
+fuzzyPool (void)
+{
+    static work_pool_c *pool = new work_pool_c(FUZZY_POOL_MAX);
+
+    return pool;
+}
+
+/* ========================= Finder ======================================== */
+
+/* Better score first, newer entry first on a tie */
+static void
+topInsert (vector<fuzzy_hit_s> &top, const fuzzy_hit_s &hit)
+{
+    auto better = [] (const fuzzy_hit_s &a, const fuzzy_hit_s &b) {
+	return a.fh_score > b.fh_score || (a.fh_score == b.fh_score && a.fh_seq > b.fh_seq);
+    };
+
+    if (top.size() == FUZZY_TOP_K && !better(hit, top.back()))
+	return;
+
+    auto it = top.begin();
+    while (it != top.end() && better(*it, hit))
+	++it;
+    top.insert(it, hit);
+    if (top.size() > FUZZY_TOP_K)
+	top.pop_back();
+}
+
+/* Without a wake_fd to write to, everything is scored inline. */
+fuzzy_finder_c::
+fuzzy_finder_c (int wake_fd) :
+    fz_gen(0), fz_tasks(0), fz_running(0), fz_pending(0), fz_done(false),
+    fz_hist(NULL), fz_masks(NULL), fz_masks_first(0), fz_need(0),
+    fz_wake(wake_fd)
+{
+}
+
+fuzzy_finder_c::
+~fuzzy_finder_c ()
+{
+    cancel();
+
+    /* Chunks still queued hold a pointer to us */
+    unique_lock<mutex> lock(fz_lock);
+    fz_idle.wait(lock, [this] { return fz_tasks == 0; });
+}
+
+/*
+ * Score the entries of masks [begin, end) into top.  Returns false if
+ * the scan was cancelled part way.
+ */
+bool fuzzy_finder_c::
+scan (uint64_t gen, size_t begin, size_t end, vector<fuzzy_hit_s> &top)
+{
+    history_c &hist = *fz_hist;
+    uint64_t first = hist.seq(0);
+    uint32_t idx[FUZZY_BLOCK];
+
+    for (size_t b = begin; b < end; b += FUZZY_BLOCK) {
+	size_t n = end - b < FUZZY_BLOCK ? end - b : FUZZY_BLOCK;
+
+	if (fz_gen.load(memory_order_relaxed) != gen)
+	    return false;
+
+	size_t k = fuzzyPrefilter(fz_masks + b, n, fz_need, idx);
+	for (size_t j = 0; j < k; j++) {
+	    uint64_t s = fz_masks_first + b + idx[j];
+	    int score;
+
+	    if (s < first || !hist.live(s - first))
+		continue;
+	    score = fuzzyScore(fz_pattern, hist[s - first]);
+	    if (score >= 0)
+		topInsert(top, { score, s });
+	}
+    }
+    return true;
+}
+
+/* One chunk of a background scan, run on the pool */
+void fuzzy_finder_c::
+scan_chunk (uint64_t gen, size_t begin, size_t end)
+{
+    vector<fuzzy_hit_s> top;
+
+    {
+	lock_guard<mutex> lock(fz_lock);
+
+	if (gen != fz_gen) {
+	    fz_tasks--;
+	    fz_idle.notify_all();
+	    return;
+	}
+	fz_running++;
+    }
+
+    bool complete = scan(gen, begin, end, top);
+
+    lock_guard<mutex> lock(fz_lock);
+
+    if (complete && gen == fz_gen) {
+	for (auto &hit : top)
+	    topInsert(fz_hits, hit);
+	if (--fz_pending == 0) {
+	    fz_done = true;
+	    if (write(fz_wake, "", 1) == -1) {} /* full means already woken */
+	}
+    }
+    fz_running--;
+    fz_tasks--;
+    fz_idle.notify_all();
+}
+
+/*
+ * Start matching pattern against the history, cancelling the scan for
+ * the previous pattern.  Small histories are scored before returning.
+ */
+void fuzzy_finder_c::
+start (history_c &hist, history_search_c &index, string_view pattern)
+{
+    cancel();
+
+    const vector<uint64_t> &masks = index.masks(hist);
+    size_t n = masks.size();
+
+    unique_lock<mutex> lock(fz_lock);
+    uint64_t gen = fz_gen;
+
+    fz_hist = &hist;
+    fz_masks = masks.data();
+    fz_masks_first = index.masks_first();
+    fz_pattern = pattern;
+    fz_need = history_search_c::char_mask(pattern);
+    fz_hits.clear();
+    fz_done = false;
+
+    if (n <= FUZZY_SYNC_MAX || fz_wake == -1) {
+	scan(gen, 0, n, fz_hits);
+	fz_done = true;
+	return;
+    }
+
+    work_pool_c *pool = fuzzyPool();
+    size_t chunk = (n / (pool->size() * 4) + FUZZY_BLOCK) & ~(size_t) (FUZZY_BLOCK - 1);
+    vector<pair<size_t, size_t>> chunks;
+
+    for (size_t b = 0; b < n; b += chunk)
+	chunks.push_back({ b, b + chunk < n ? b + chunk : n });
+
+    fz_pending = chunks.size();
+    fz_tasks += chunks.size();
+    lock.unlock();
+
+    for (auto &c : chunks)
+	pool->submit([this, gen, c] { scan_chunk(gen, c.first, c.second); });
+}
+
+/*
+ * Stop the scan in progress.  Once this returns no worker is reading
+ * the history, chunks not started yet see the new generation and quit.
+ */
+void fuzzy_finder_c::
+cancel (void)
+{
+    unique_lock<mutex> lock(fz_lock);
+
+    fz_gen++;
+    fz_pending = 0;
+    fz_done = false;
+    fz_idle.wait(lock, [this] { return fz_running == 0; });
+}
+
+/* Copy out the hits, best first, if the scan has finished. */
+bool fuzzy_finder_c::
+results (vector<fuzzy_hit_s> &hits)
+{
+    lock_guard<mutex> lock(fz_lock);
+
+    if (!fz_done)
+	return false;
+    hits = fz_hits;
+    return true;
+}
+
+#ifdef _TEST
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+
+#define TEST(x) if (!(x)) assert(0)
+
+int
+main ()
+{
+    /* Every prefilter agrees with the plain loop */
+    vector<uint64_t> masks(1003);
+    vector<uint32_t> a(masks.size()), b(masks.size());
+
+    srand(1);
+    for (auto &m : masks)
+	m = ((uint64_t) rand() << 32 | rand()) | (rand() % 3 ? 0x5 : 0);
+    size_t n = prefilterScalar(masks.data(), 0, masks.size(), 0x5, a.data());
+    TEST(n > 0 && n < masks.size());
+    TEST(fuzzyPrefilter(masks.data(), masks.size(), 0x5, b.data()) == n);
+    TEST(equal(a.begin(), a.begin() + n, b.begin()));
+#ifdef __SSE2__
+    TEST(prefilterSSE2(masks.data(), masks.size(), 0x5, b.data()) == n);
+    TEST(equal(a.begin(), a.begin() + n, b.begin()));
+#endif
+
+    /* Tighter matches and word starts score higher */
+    TEST(fuzzyScore("gco", "git co") > fuzzyScore("gco", "grep -c foo"));
+    TEST(fuzzyScore("make", "make test") > fuzzyScore("make", "m a k e"));
+    TEST(fuzzyScore("xyz", "make test") == -1);
+    TEST(fuzzyScore("MT", "make test") > 0);
+
+    /* A history big enough to go to the pool finds the same hits */
+    history_c hist(100000);
+    history_search_c index;
+    int wake[2];
+    TEST(pipe(wake) == 0);
+    fuzzy_finder_c finder(wake[1]);
+    vector<fuzzy_hit_s> hits;
+
+    for (int i = 0; i < 100000; i++)
+	hist.push_back("cmd " + to_string(i * 7919 % 100000));
+    hist.push_back("");
+
+    /* The scan for "c 424" is cancelled by the next keystroke */
+    finder.start(hist, index, "c 424");
+    finder.start(hist, index, "c 4242");
+    struct pollfd pfd = { wake[0], POLLIN, 0 };
+    TEST(poll(&pfd, 1, 5000) == 1);
+    TEST(finder.results(hits) && !hits.empty());
+    TEST(any_of(hits.begin(), hits.end(), [&] (const fuzzy_hit_s &hit) {
+		return hist[hit.fh_seq - hist.seq(0)] == "cmd 4242"; }));
+
+    int best = -1;
+    for (size_t i = 0; i + 1 < hist.size(); i++) {
+	int score = fuzzyScore("c 4242", hist[i]);
+	if (score > best) best = score;
+    }
+    TEST(hits[0].fh_score == best);
+
+    printf("all test passed\n");
+    return 0;
+}
+#endif
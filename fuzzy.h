@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2015, Wing Eng
+ * All rights reserved.
+ */
+#ifndef FUZZY_H
+#define FUZZY_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+
+#include "history.h"
+
+#define FUZZY_TOP_K	8	/* best matches kept, and shown */
+#define FUZZY_SYNC_MAX	16384	/* smaller histories are scored inline */
+
+struct fuzzy_hit_s {
+    int fh_score;
+    uint64_t fh_seq;		/* history seq of the entry */
+};
+
+int fuzzyScore(std::string_view pattern, std::string_view text);
+size_t fuzzyPrefilter(const uint64_t *masks, size_t n, uint64_t need, uint32_t *out);
+
+/*
+ * fzf style matching over the history: the pattern's chars have to
+ * appear in order, and matches with fewer gaps and more chars at word
+ * starts score higher.
+ *
+ * Large histories are split into chunks scored on a worker pool shared
+ * by all sessions.  start() cancels the scan in progress, if any, so the
+ * scan for the previous keystroke stops as soon as the next one is
+ * handled.  When a scan finishes in the background a byte is written to
+ * the wake fd it was given; results() then hands back the hits.
+ *
+ * Workers read the history, so it must not change between start() and
+ * cancel().
+ */
+class fuzzy_finder_c {
+public:
+    fuzzy_finder_c (int wake_fd = -1);
+    ~fuzzy_finder_c ();
+
+    void start (history_c &hist, history_search_c &index, std::string_view pattern);
+    void cancel (void);
+    bool results (std::vector<fuzzy_hit_s> &hits);
+
+private:
+    bool scan (uint64_t gen, size_t begin, size_t end, std::vector<fuzzy_hit_s> &top);
+    void scan_chunk (uint64_t gen, size_t begin, size_t end);
+
+    std::mutex fz_lock;
+    std::condition_variable fz_idle;
+    std::atomic<uint64_t> fz_gen;	/* bumped to cancel a scan */
+    int fz_tasks;			/* chunks queued or running */
+    int fz_running;			/* chunks reading the history */
+    int fz_pending;			/* chunks of fz_gen not finished */
+    bool fz_done;			/* fz_hits is complete for fz_gen */
+    std::vector<fuzzy_hit_s> fz_hits;
+
+    /* What the scan of fz_gen works on */
+    history_c *fz_hist;
+    const uint64_t *fz_masks;
+    uint64_t fz_masks_first;
+    std::string fz_pattern;
+    uint64_t fz_need;
+
+    int fz_wake;			/* written when a scan finishes */
+};
+
+#endif
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2015, Wing Eng
+ * All rights reserved.
+ */
+#include <assert.h>
+#include <string.h>
+
+#include "gap_buffer.h"
+
+#define GAP_MIN		64	/* gap of an empty buffer */
+
+using namespace std;
+
+gap_buffer_c::
+gap_buffer_c () :
+    gb_moved(0), gb_buf(GAP_MIN, '\0'), gb_gap(0), gb_gap_len(GAP_MIN),
+    gb_high(0)
+{
+}
+
+static size_t
+countHigh (string_view s)
+{
+    size_t n = 0;
+
+    for (unsigned char c : s)
+	n += c >> 7;
+    return n;
+}
+
+/* Move the gap to start at pos, moving the text in between across it. */
+void gap_buffer_c::
+move_gap (size_t pos)
+{
+    char *p = &gb_buf[0];
+
+    if (pos < gb_gap) {
+	memmove(p + pos + gb_gap_len, p + pos, gb_gap - pos);
+	gb_moved += gb_gap - pos;
+    } else if (pos > gb_gap) {
+	memmove(p + gb_gap, p + gb_gap + gb_gap_len, pos - gb_gap);
+	gb_moved += pos - gb_gap;
+    }
+    gb_gap = pos;
+}
+
+/* Make the gap at least n long, doubling the buffer. */
+void gap_buffer_c::
+reserve (size_t n)
+{
+    if (gb_gap_len >= n)
+	return;
+
+    size_t after = gb_buf.size() - gb_gap - gb_gap_len;
+    size_t grow = max(gb_buf.size(), n - gb_gap_len);
+
+    gb_buf.resize(gb_buf.size() + grow);
+
+    char *p = &gb_buf[0];
+
+    memmove(p + gb_buf.size() - after, p + gb_gap + gb_gap_len, after);
+    gb_gap_len += grow;
+}
+
+void gap_buffer_c::
+insert (size_t pos, string_view s)
+{
+    assert(pos <= size());
+    reserve(s.size());
+    move_gap(pos);
+    memcpy(&gb_buf[gb_gap], s.data(), s.size());
+    gb_gap += s.size();
+    gb_gap_len -= s.size();
+    gb_high += countHigh(s);
+}
+
+void gap_buffer_c::
+erase (size_t pos, size_t n)
+{
+    assert(pos + n <= size());
+
+    for (size_t i = pos; gb_high && i < pos + n; i++)
+	gb_high -= (unsigned char) (*this)[i] >> 7;
+
+    if (pos + n <= gb_gap) {
+	move_gap(pos + n);
+	gb_gap = pos;
+    } else if (pos >= gb_gap) {
+	move_gap(pos);
+    } else {
+	gb_gap = pos;		/* spans the gap, nothing to move */
+    }
+    gb_gap_len += n;
+}
+
+/* Replace the text, the gap is left at the end. */
+void gap_buffer_c::
+assign (string_view s)
+{
+    size_t len = s.size() + max((size_t) GAP_MIN, s.size());
+
+    if (gb_buf.size() < len)
+	gb_buf.resize(len);
+    memcpy(&gb_buf[0], s.data(), s.size());
+    gb_gap = s.size();
+    gb_gap_len = gb_buf.size() - s.size();
+    gb_high = countHigh(s);
+}
+
+/* Append n chars from pos to out, either side of the gap. */
+void gap_buffer_c::
+copy (size_t pos, size_t n, string &out) const
+{
+    assert(pos + n <= size());
+
+    if (pos < gb_gap) {
+	size_t k = min(n, gb_gap - pos);
+
+	out.append(gb_buf, pos, k);
+	pos += k;
+	n -= k;
+    }
+    if (n)
+	out.append(gb_buf, pos + gb_gap_len, n);
+}
+
+/* The text NUL terminated, after moving the gap to the end. */
+const char *gap_buffer_c::
+c_str (void)
+{
+    reserve(1);
+    move_gap(size());
+    gb_buf[gb_gap] = '\0';
+    return gb_buf.data();
+}
+
+/*
+ * The text from pos to the end, after moving the gap to pos.  Cheap
+ * when pos is near the last edit, unlike c_str().
+ */
+string_view gap_buffer_c::
+tail (size_t pos)
+{
+    assert(pos <= size());
+    move_gap(pos);
+    return string_view(gb_buf.data() + gb_gap + gb_gap_len, size() - pos);
+}
+
+#ifdef _TEST
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST(x) if (!(x)) assert(0)
+
+static string
+text (const gap_buffer_c &gb)
+{
+    string s;
+
+    gb.copy(0, gb.size(), s);
+    return s;
+}
+
+int
+main ()
+{
+    gap_buffer_c gb;
+    string want;
+
+    /* Random edits against a plain string */
+    srand(1);
+    for (int i = 0; i < 100000; i++) {
+	size_t pos = want.empty() ? 0 : rand() % (want.size() + 1);
+	int op = rand() % 10;
+
+	if (op < 6) {
+	    string s(1 + rand() % (op == 0 ? 200 : 3), rand() % 50 ? 'a' + rand() % 26 : 0xC3);
+
+	    gb.insert(pos, s);
+	    want.insert(pos, s);
+	} else if (op < 9) {
+	    size_t n = pos < want.size() ? rand() % min((size_t) 5, want.size() - pos + 1) : 0;
+
+	    gb.erase(pos, n);
+	    want.erase(pos, n);
+	} else if (rand() % 100 == 0) {
+	    want = want.substr(0, rand() % 100);
+	    gb.assign(want);
+	}
+	TEST(gb.size() == want.size());
+	if (i % 1000 == 0) {
+	    TEST(gb.ascii() == (countHigh(want) == 0));
+	    TEST(text(gb) == want && gb.c_str() == want);
+	    TEST(gb.tail(pos) == string_view(want).substr(pos));
+	    for (size_t j = 0; j < want.size(); j += 7)
+		TEST(gb[j] == want[j]);
+	}
+    }
+    TEST(text(gb) == want);
+
+    /* No limit on the length */
+    string big(1 << 20, 'x');
+
+    gb.assign(big);
+    gb.insert(1 << 19, "y");
+    TEST(gb.size() == big.size() + 1 && gb[1 << 19] == 'y');
+
+    /* Typing at the front of a long line only moves it once */
+    unsigned long moved;
+
+    gb.assign(big);
+    gb.insert(0, "a");
+    moved = gb.gb_moved;
+    for (int i = 1; i < 1000; i++)
+	gb.insert(i, "b");
+    for (int i = 0; i < 500; i++)
+	gb.erase(999 - i, 1);
+    TEST(gb.gb_moved == moved);
+
+    printf("all test passed\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2015, Wing Eng
+ * All rights reserved.
+ */
+#ifndef GAP_BUFFER_H
+#define GAP_BUFFER_H
+
+#include <string>
+#include <string_view>
+
+/*
+ * The line being edited.  The text is kept in one allocation with a gap
+ * in it, the text before the gap at the start and the text after it at
+ * the end.  Edits are made at the gap, so insert() and erase() only
+ * move the text between the last edit and this one, and typing or
+ * deleting at the cursor is O(1) amortized however long the line is.
+ * The allocation doubles when the gap fills up, so there's no limit on
+ * the line's length.
+ *
+ * c_str() moves the gap to the end to hand out the text contiguously;
+ * it's meant for when the line is returned or given to a callback, the
+ * editor itself reads it with operator[] and copy().
+ *
+ * The bytes that aren't ASCII are counted as they come and go, so
+ * ascii() tells in O(1) whether the line needs any UTF-8 decoding.
+ */
+class gap_buffer_c {
+public:
+    gap_buffer_c ();
+
+    size_t size (void) const { return gb_buf.size() - gb_gap_len; }
+    bool ascii (void) const { return gb_high == 0; }
+    char operator[] (size_t i) const {
+	return gb_buf[i < gb_gap ? i : i + gb_gap_len];
+    }
+
+    void insert (size_t pos, std::string_view s);
+    void erase (size_t pos, size_t n);
+    void assign (std::string_view s);
+    void clear (void) { assign(""); }
+    void copy (size_t pos, size_t n, std::string &out) const;
+    const char *c_str (void);
+    std::string_view tail (size_t pos);
+
+    unsigned long gb_moved;	/* bytes moved across the gap */
+
+private:
+    void move_gap (size_t pos);
+    void reserve (size_t n);
+
+    std::string gb_buf;		/* text, gap, text */
+    size_t gb_gap;		/* where the gap starts */
+    size_t gb_gap_len;
+    size_t gb_high;		/* bytes of the text >= 0x80 */
+};
+
+#endif
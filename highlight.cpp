@@ -0,0 +1,378 @@
+/*
+ * Copyright (c) 2015, Wing Eng
+ * All rights reserved.
+ */
+#include <algorithm>
+
+#include "highlight.h"
+
+using namespace std;
+
+highlight_cache_c::
+highlight_cache_c () :
+    hc_tokenized(0), hc_moved(0), hc_line(0), hc_styles(1), hc_dirty(false),
+    hc_lo(0), hc_hi(0), hc_at(0), hc_state(0), hc_done(false)
+{
+}
+
+/* Span i, its start from the start of the line either side of the gap. */
+hl_span_s highlight_cache_c::
+operator[] (size_t i) const
+{
+    if (i < hc_before.size())
+	return hc_before[i];
+
+    hl_span_s hs = hc_after[hc_after.size() - 1 - (i - hc_before.size())];
+
+    hs.hs_start = hc_line - hs.hs_start;
+    return hs;
+}
+
+/* Index of the first span that ends after pos. */
+size_t highlight_cache_c::
+first_after (size_t pos) const
+{
+    size_t lo = 0, hi = size();
+
+    while (lo < hi) {
+	size_t mid = (lo + hi) / 2;
+	hl_span_s hs = (*this)[mid];
+
+	if (hs.hs_start + hs.hs_len <= pos)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/* Move the gap to before span i. */
+void highlight_cache_c::
+move_gap (size_t i)
+{
+    while (hc_before.size() > i) {
+	hc_after.push_back(hc_before.back());
+	hc_after.back().hs_start = hc_line - hc_after.back().hs_start;
+	hc_before.pop_back();
+	hc_moved++;
+    }
+    while (hc_before.size() < i) {
+	hc_before.push_back(hc_after.back());
+	hc_before.back().hs_start = hc_line - hc_before.back().hs_start;
+	hc_after.pop_back();
+	hc_moved++;
+    }
+}
+
+/*
+ * erased bytes at pos were replaced by inserted ones.  The spans with
+ * bytes erased, or the insert inside them, go and become dirty.
+ */
+void highlight_cache_c::
+edit (size_t pos, size_t erased, size_t inserted)
+{
+    size_t end = pos + erased;
+    size_t lo = pos, hi = pos + inserted;
+    auto map = [=] (size_t x) {
+	return x < pos ? x : x >= end ? x - erased + inserted : pos;
+    };
+
+    if (!erased && !inserted)
+	return;
+
+    move_gap(first_after(pos));
+    while (!hc_after.empty() && hc_line - hc_after.back().hs_start < end) {
+	const hl_span_s &hs = hc_after.back();
+	size_t start = hc_line - hs.hs_start;
+
+	lo = min(lo, start);
+	hi = max(hi, map(start + hs.hs_len));
+	hc_after.pop_back();
+    }
+    hc_line = hc_line - erased + inserted;
+
+    if (hc_dirty) {
+	lo = min(lo, map(hc_lo));
+	hi = max(hi, map(hc_hi));
+    }
+    hc_dirty = true;
+    hc_lo = lo;
+    hc_hi = hi;
+}
+
+/* The line is now len long and all of it is dirty. */
+void highlight_cache_c::
+reset (size_t len)
+{
+    hc_before.clear();
+    hc_after.clear();
+    hc_line = len;
+    hc_dirty = true;
+    hc_lo = 0;
+    hc_hi = len;
+}
+
+/* Where to tokenize the line from, and in what *state. */
+size_t highlight_cache_c::
+restart (int *state)
+{
+    size_t k = first_after(hc_lo);
+
+    if (k) k--;
+    move_gap(k);
+    hc_at = k ? (*this)[k].hs_start : 0;
+    hc_state = k ? hc_before.back().hs_state : 0;
+    hc_done = false;
+
+    *state = hc_state;
+    return hc_at;
+}
+
+/*
+ * The next token, len bytes in style, after which the tokenizer is in
+ * state.  Returns 1 when there's no need for more: the old spans hold
+ * from here, or the line is done.
+ */
+int highlight_cache_c::
+add (size_t len, const char *sgr, int state)
+{
+    if (hc_done)
+	return 1;
+
+    len = min(len, hc_line - hc_at);
+    if (len) {
+	hc_before.push_back({ hc_at, len, state, style(sgr) });
+	hc_at += len;
+	hc_state = state;
+	hc_tokenized += len;
+    }
+
+    /* The old spans it covers go, unless it ends with one in step */
+    while (!hc_after.empty()) {
+	const hl_span_s &hs = hc_after.back();
+	size_t end = hc_line - hs.hs_start + hs.hs_len;
+
+	if (end > hc_at)
+	    break;
+	/*
+	 * Past the dirty range, not at its end: spans may have been
+	 * erased there, and the old span ending there wasn't followed
+	 * by the rest.
+	 */
+	if (end == hc_at && hc_at > hc_hi && hs.hs_state == state)
+	    hc_done = true;
+	hc_after.pop_back();
+	if (hc_done)
+	    return 1;
+    }
+    return hc_at == hc_line;
+}
+
+/*
+ * The tokenizer is done.  Unless it caught up with the old spans, they
+ * are replaced to the end, whatever it didn't cover plain.
+ */
+void highlight_cache_c::
+end (void)
+{
+    if (!hc_done) {
+	hc_after.clear();
+	if (hc_at < hc_line)
+	    hc_before.push_back({ hc_at, hc_line - hc_at, hc_state, 0 });
+    }
+    hc_dirty = false;
+}
+
+/* The index of an SGR style, 0 for none or once there are too many. */
+unsigned char highlight_cache_c::
+style (const char *sgr)
+{
+    if (!sgr || !*sgr)
+	return 0;
+    for (size_t i = 1; i < hc_styles.size(); i++) {
+	if (hc_styles[i] == sgr)
+	    return i;
+    }
+    if (hc_styles.size() > 255)
+	return 0;
+    hc_styles.push_back(sgr);
+    return hc_styles.size() - 1;
+}
+
+/* Append the style of each of n bytes from pos to out. */
+void highlight_cache_c::
+attrs (size_t pos, size_t n, string &out) const
+{
+    size_t i = first_after(pos), stop = pos + n;
+
+    while (pos < stop) {
+	size_t end = stop;
+	char style = 0;
+
+	if (i < size()) {
+	    hl_span_s hs = (*this)[i];
+
+	    if (hs.hs_start <= pos) {
+		end = min(stop, hs.hs_start + hs.hs_len);
+		style = hs.hs_style;
+		i++;
+	    } else {
+		end = min(stop, hs.hs_start);
+	    }
+	}
+	out.append(end - pos, style);
+	pos = end;
+    }
+}
+
+#ifdef _TEST
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST(x) if (!(x)) assert(0)
+
+/*
+ * A shell-ish tokenizer: the first word of a command is bold, the rest
+ * plain, strings green.  The state is whether the command was seen.
+ */
+static void
+tokenize (const char *text, size_t len, int state, highlight_cache_c &hc)
+{
+    for (size_t i = 0, j; i < len; i = j) {
+	const char *style = NULL;
+	int next = state;
+
+	j = i + 1;
+	if (text[i] == '"') {
+	    while (j < len && text[j] != '"') j++;
+	    if (j < len) j++;
+	    style = "32";
+	} else if (isalnum(text[i])) {
+	    while (j < len && isalnum(text[j])) j++;
+	    style = state ? NULL : "1";
+	    next = 1;
+	} else if (text[i] == ';') {
+	    next = 0;
+	}
+	if (hc.add(j - i, style, next))
+	    return;
+	state = next;
+    }
+}
+
+static void
+refresh (highlight_cache_c &hc, const string &line)
+{
+    int state;
+    size_t from;
+
+    if (!hc.dirty())
+	return;
+    from = hc.restart(&state);
+    tokenize(line.data() + from, line.size() - from, state, hc);
+    hc.end();
+}
+
+static bool
+same (const highlight_cache_c &a, const highlight_cache_c &b)
+{
+    if (a.size() != b.size())
+	return false;
+    for (size_t i = 0; i < a.size(); i++) {
+	hl_span_s x = a[i], y = b[i];
+
+	if (x.hs_start != y.hs_start || x.hs_len != y.hs_len ||
+	    x.hs_state != y.hs_state || a.sgr(x.hs_style) != b.sgr(y.hs_style))
+	    return false;
+    }
+    return true;
+}
+
+int
+main ()
+{
+    highlight_cache_c hc;
+    string line, attr;
+    const char chars[] = "ab1 ;\"";
+
+    /* Random edits, some refreshed together, against a fresh tokenize */
+    srand(1);
+    for (int i = 0; i < 50000; i++) {
+	size_t pos = rand() % (line.size() + 1);
+
+	if (rand() % 3 && line.size() < 60) {
+	    string s(1 + rand() % 3, chars[rand() % 6]);
+
+	    line.insert(pos, s);
+	    hc.edit(pos, 0, s.size());
+	} else if (pos < line.size()) {
+	    size_t n = 1 + rand() % min((size_t) 4, line.size() - pos);
+	    string s(rand() % 2, chars[rand() % 6]);
+
+	    line.replace(pos, n, s);
+	    hc.edit(pos, n, s.size());
+	}
+	if (rand() % 100 == 0) {
+	    line.clear();
+	    hc.reset(0);
+	}
+	if (rand() % 3)
+	    continue;
+	refresh(hc, line);
+
+	highlight_cache_c full;
+
+	full.reset(line.size());
+	refresh(full, line);
+	TEST(same(hc, full));
+
+	attr.clear();
+	hc.attrs(0, line.size(), attr);
+	TEST(attr.size() == line.size());
+	for (size_t k = 0; k < hc.size(); k++) {
+	    for (size_t j = 0; j < hc[k].hs_len; j++)
+		TEST(attr[hc[k].hs_start + j] == hc[k].hs_style);
+	}
+    }
+
+    /*
+     * Typing in the middle of a long line tokenizes a word or so, and
+     * only moves the spans across the gap once
+     */
+    unsigned long moved;
+
+    line.clear();
+    for (int i = 0; i < 20000; i++)
+	line += "ls -l \"x y\"; ";
+    hc.reset(line.size());
+    refresh(hc, line);
+    moved = hc.hc_moved;
+    for (int i = 0; i < 100; i++) {
+	size_t before = hc.hc_tokenized, pos = line.size() / 2 + i;
+
+	line.insert(pos, "z");
+	hc.edit(pos, 0, 1);
+	refresh(hc, line);
+	TEST(hc.hc_tokenized - before < 20);
+    }
+    TEST(hc.hc_moved - moved < 200000 / 2);
+    moved = hc.hc_moved;
+    for (int i = 0; i < 100; i++) {
+	size_t pos = line.size() / 2 + 100 + i;
+
+	line.insert(pos, "z");
+	hc.edit(pos, 0, 1);
+	refresh(hc, line);
+    }
+    TEST(hc.hc_moved - moved < 1000);
+    attr.clear();
+    hc.attrs(line.size() / 2 - 100, 200, attr);
+    TEST(attr.size() == 200);
+
+    printf("all test passed\n");
+    return 0;
+}
+#endif
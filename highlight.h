@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2015, Wing Eng
+ * All rights reserved.
+ */
+#ifndef HIGHLIGHT_H
+#define HIGHLIGHT_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stddef.h>
+
+/* A token the highlighter reported, and its state at the end. */
+struct hl_span_s {
+    size_t hs_start;
+    size_t hs_len;
+    int hs_state;
+    unsigned char hs_style;	/* index into hc_styles, 0 is plain */
+};
+
+/*
+ * The application's highlighter is a tokenizer that can be restarted
+ * anywhere from a state it returned.  The spans it reported are kept,
+ * each with its state, tiling the line.  edit() drops the spans an
+ * edit touches and widens the dirty range.
+ *
+ * To highlight again, restart() says where: at the span before the
+ * first dirty byte, as the edit may have joined that token, in the
+ * state the span before it ended in.  The tokens are then add()ed in
+ * order.  Once one ends past the dirty range, where an old span
+ * ended in the same state, the old spans after it still hold and
+ * add() returns 1 for the callback to stop.  So typing re-tokenizes a
+ * token or two, not the whole line.
+ *
+ * The spans have a gap at the last edit, like the line's gap_buffer_c.
+ * The ones after it count their start back from the end of the line,
+ * so an edit doesn't shift them, and only the spans between the last
+ * edit and this one move across the gap.
+ *
+ * Styles are SGR parameters ("1;34"), kept once each and referred to
+ * by index, up to 255 of them.
+ */
+class highlight_cache_c {
+public:
+    highlight_cache_c ();
+
+    void edit (size_t pos, size_t erased, size_t inserted);
+    void reset (size_t len);
+    bool dirty (void) const { return hc_dirty; }
+
+    size_t restart (int *state);
+    int add (size_t len, const char *style, int state);
+    void end (void);
+
+    size_t size (void) const { return hc_before.size() + hc_after.size(); }
+    hl_span_s operator[] (size_t i) const;
+
+    unsigned char style (const char *sgr);
+    const std::string &sgr (unsigned char style) const { return hc_styles[style]; }
+    void attrs (size_t pos, size_t n, std::string &out) const;
+
+    size_t hc_tokenized;	/* bytes add()ed, for the stats */
+    unsigned long hc_moved;	/* spans moved across the gap */
+
+private:
+    size_t first_after (size_t pos) const;
+    void move_gap (size_t i);
+
+    std::vector<hl_span_s> hc_before;	/* spans before the gap */
+    std::vector<hl_span_s> hc_after;	/* ... after it, last first */
+    size_t hc_line;		/* length of the line */
+    std::vector<std::string> hc_styles;
+    bool hc_dirty;
+    size_t hc_lo, hc_hi;	/* dirty bytes, may be none */
+
+    /* Between restart() and end() */
+    size_t hc_at;		/* end of the last token */
+    int hc_state;
+    bool hc_done;
+};
+
+#endif
@@ -0,0 +1,828 @@
+/*
+ * Copyright (c) 2015, Wing Eng
+ * All rights reserved.
+ */
+#include <algorithm>
+#include <unordered_set>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "history.h"
+
+using namespace std;
+
+/* Don't bother compacting arenas smaller than this */
+#define HIST_ARENA_MIN 4096
+
+history_c::
+history_c (size_t max_len) :
+    hist_dups(0), hist_dup_bytes(0), hist_gen(0), hist_mod_seq(UINT64_MAX),
+    hist_first(0), hist_count(0), hist_live(0), hist_max_len(max_len),
+    hist_dead(0), hist_map(NULL), hist_map_size(0), hist_mapped(0),
+    hist_erase_dups(false), hist_seq_first(0)
+{
+}
+
+history_c::
+~history_c ()
+{
+    if (hist_map)
+	munmap((void *) hist_map, hist_map_size);
+}
+
+string_view history_c::
+operator[] (size_t i) const
+{
+    const hist_slot_s &hs = hist_slots[slot(i)];
+
+    if (hs.hs_len == HS_DEAD)
+	return string_view();
+    if (hs.hs_off & HS_MAPPED)
+	return string_view(hist_map + (hs.hs_off & ~HS_MAPPED), hs.hs_len);
+    return string_view(hist_arena.data() + hs.hs_off, hs.hs_len);
+}
+
+/*
+ * Offsets in a slot have 31 bits, the top one is HS_MAPPED.  An arena
+ * that would grow past that is compacted first, and a line that still
+ * doesn't fit is stored empty rather than at an offset that wraps.
+ */
+history_c::hist_slot_s history_c::
+store (string_view line)
+{
+    if (hist_arena.size() + line.size() >= HS_MAPPED) {
+	compact(true);
+	if (hist_arena.size() + line.size() >= HS_MAPPED)
+	    line = string_view();
+    }
+
+    hist_slot_s hs = { (uint32_t) hist_arena.size(), (uint32_t) line.size() };
+
+    hist_arena.append(line.data(), line.size());
+    return hs;
+}
+
+void history_c::
+release (const hist_slot_s &hs)
+{
+    if (hs.hs_len == HS_DEAD)
+	return;
+    if (!(hs.hs_off & HS_MAPPED)) {
+	hist_dead += hs.hs_len;
+	return;
+    }
+
+    /* The last entry in the mapping is gone */
+    if (--hist_mapped == 0) {
+	munmap((void *) hist_map, hist_map_size);
+	hist_map = NULL;
+    }
+}
+
+/*
+ * Copy the live entries to a fresh arena, oldest first.  Only done when
+ * at least half the arena is dead, so the copy is paid for by the adds
+ * that made it dead, or when forced by store() running out of offsets.
+ */
+void history_c::
+compact (bool force)
+{
+    if (!force &&
+	(hist_arena.size() < HIST_ARENA_MIN || hist_dead * 2 < hist_arena.size()))
+	return;
+
+    string arena;
+
+    arena.reserve(min((hist_arena.size() - hist_dead) * 2, (size_t) HS_MAPPED));
+    for (size_t i = 0; i < hist_count; i++) {
+	hist_slot_s &hs = hist_slots[slot(i)];
+	uint32_t off = arena.size();
+
+	if (hs.hs_len == HS_DEAD || (hs.hs_off & HS_MAPPED))
+	    continue;
+	arena.append(hist_arena, hs.hs_off, hs.hs_len);
+	hs.hs_off = off;
+    }
+
+    hist_arena.swap(arena);
+    hist_dead = 0;
+}
+
+/*
+ * Squeeze the dead slots out of the ring.  It's only full of slots when
+ * a third of them are dead, so this is paid for by the adds that killed
+ * them.  Entries move, so the index is rebuilt.
+ */
+void history_c::
+compact_ring (void)
+{
+    vector<hist_slot_s> slots(hist_slots.size());
+    size_t n = 0;
+
+    for (size_t i = 0; i < hist_count; i++) {
+	if (live(i))
+	    slots[n++] = hist_slots[slot(i)];
+    }
+
+    hist_slots.swap(slots);
+    hist_first = 0;
+    hist_count = n;
+    index_rebuild();
+}
+
+/*
+ * Add a slot after the newest entry.  The ring only grows while it has
+ * fewer than ring_max() slots, doubling so the copy is amortized.
+ */
+void history_c::
+append (const hist_slot_s &hs)
+{
+    if (hist_count == hist_slots.size()) {
+	size_t size = hist_slots.size() * 2;
+
+	if (size < 16) size = 16;
+	if (size > ring_max()) size = ring_max();
+
+	if (size > hist_slots.size()) {
+	    vector<hist_slot_s> slots(size);
+
+	    for (size_t i = 0; i < hist_count; i++)
+		slots[i] = hist_slots[slot(i)];
+	    hist_slots.swap(slots);
+	    hist_first = 0;
+	} else {
+	    compact_ring();
+	}
+	assert(hist_count < hist_slots.size());
+    }
+
+    hist_slots[slot(hist_count)] = hs;
+    hist_count++;
+    if (hs.hs_len != HS_DEAD)
+	hist_live++;
+}
+
+/*
+ * Drop the oldest live entry, and any dead slots in front of the new
+ * oldest one.
+ */
+void history_c::
+evict (void)
+{
+    bool dropped = false;
+
+    while (hist_count && (!dropped || !live(0))) {
+	if (live(0)) {
+	    index_remove(0);
+	    release(hist_slots[hist_first]);
+	    hist_live--;
+	    dropped = true;
+	}
+	hist_first = slot(1);
+	hist_count--;
+	hist_seq_first++;
+    }
+}
+
+/*
+ * Add line as the newest entry, evicting the oldest when full.
+ */
+void history_c::
+push_back (string_view line)
+{
+    if (hist_max_len == 0)
+	return;
+
+    if (hist_live == hist_max_len)
+	evict();
+
+    append(store(line));
+    index_add(hist_count - 1);
+
+    compact();
+}
+
+/*
+ * Add a line typed by the user.  A repeat of the newest entry is
+ * dropped, and with erase_dups an older copy is moved to the newest
+ * position.  Returns 1 if the history changed.
+ */
+int history_c::
+add (string_view line)
+{
+    if (hist_max_len == 0)
+	return 0;
+    if (hist_count && back() == line)
+	return 0;
+
+    long i = hist_erase_dups ? index_find(line) : -1;
+    if (i < 0) {
+	push_back(line);
+	return 1;
+    }
+
+    /* The new slot takes over the text, nothing is released */
+    hist_slot_s hs = hist_slots[slot(i)];
+
+    index_remove(i);
+    hist_slots[slot(i)].hs_len = HS_DEAD;
+    hist_live--;
+    hist_dups++;
+    hist_dup_bytes += line.size();
+
+    append(hs);
+    index_add(hist_count - 1);
+
+    while (hist_count && !live(0)) {
+	hist_first = slot(1);
+	hist_count--;
+	hist_seq_first++;
+    }
+    return 1;
+}
+
+/*
+ * add() for an entry whose text is already in hs, from load().  Returns
+ * false if it wasn't added.
+ */
+bool history_c::
+add_slot (string_view line, const hist_slot_s &hs)
+{
+    if (hist_count && back() == line)
+	return false;
+
+    long i = hist_erase_dups ? index_find(line) : -1;
+    if (i >= 0) {
+	index_remove(i);
+	release(hist_slots[slot(i)]);
+	hist_slots[slot(i)].hs_len = HS_DEAD;
+	hist_live--;
+	hist_dups++;
+	hist_dup_bytes += line.size();
+	while (hist_count && !live(0)) {
+	    hist_first = slot(1);
+	    hist_count--;
+	    hist_seq_first++;
+	}
+    }
+
+    if (hist_live == hist_max_len)
+	evict();
+
+    append(hs);
+    index_add(hist_count - 1);
+    return true;
+}
+
+/*
+ * Add the lines of the file at path, as add() would.  Only the newest
+ * max_len are looked at: the file is mapped and its newlines found
+ * walking back from the end with memrchr(), which glibc vectorizes.
+ * The entries point into the mapping, see the class comment.  Returns
+ * -1 if the file can't be read.
+ */
+int history_c::
+load (const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+	return -1;
+    if (fstat(fd, &st) == -1) {
+	close(fd);
+	return -1;
+    }
+    if (st.st_size == 0 || hist_max_len == 0) {
+	close(fd);
+	return 0;
+    }
+
+    size_t size = st.st_size;
+    const char *data = (const char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+    if (data == MAP_FAILED)
+	return -1;
+
+    /* Newest first, dropping what add() would drop anyway */
+    vector<string_view> lines;
+    unordered_set<string_view> seen;
+    size_t end = size;
+
+    while (end > 0 && lines.size() < hist_max_len) {
+	const char *nl = end > 1 ? (const char *) memrchr(data, '\n', end - 1) : NULL;
+	size_t start = nl ? nl - data + 1 : 0;
+	size_t len = end - start;
+
+	if (len && data[start + len - 1] == '\n') len--;
+	if (len && data[start + len - 1] == '\r') len--;
+	end = start;
+
+	string_view line(data + start, len);
+
+	/* A journal's compaction record, left by one that died before
+	 * its rename(); history lines never start with a NUL */
+	if (len && line[0] == '\0')
+	    continue;
+	if (!lines.empty() && lines.back() == line)
+	    continue;
+	if (hist_erase_dups && !seen.insert(line).second)
+	    continue;
+	lines.push_back(line);
+    }
+
+    /* Offsets in a slot have 31 bits, and one file is mapped at a time */
+    if (hist_map || size >= HS_MAPPED) {
+	for (auto it = lines.rbegin(); it != lines.rend(); ++it)
+	    add(*it);
+	munmap((void *) data, size);
+	return 0;
+    }
+
+    hist_map = data;
+    hist_map_size = size;
+
+    /* Counted before it's added, so evicting the others can't unmap */
+    for (auto it = lines.rbegin(); it != lines.rend(); ++it) {
+	hist_slot_s hs = { (uint32_t) (it->data() - data) | HS_MAPPED, (uint32_t) it->size() };
+
+	hist_mapped++;
+	if (!add_slot(*it, hs))
+	    hist_mapped--;
+    }
+
+    if (hist_mapped == 0) {
+	munmap((void *) hist_map, hist_map_size);
+	hist_map = NULL;
+    }
+    compact();
+    return 0;
+}
+
+void history_c::
+pop_back (void)
+{
+    if (hist_count == 0)
+	return;
+
+    index_remove(hist_count - 1);
+    release(hist_slots[slot(hist_count - 1)]);
+    hist_live--;
+    hist_count--;
+
+    /* The newest entry is always live */
+    while (hist_count && !live(hist_count - 1))
+	hist_count--;
+
+    if (seq(hist_count) < hist_mod_seq)
+	hist_mod_seq = seq(hist_count);
+}
+
+/*
+ * Replace entry i, the old text becomes dead.
+ */
+void history_c::
+set (size_t i, string_view line)
+{
+    hist_slot_s &hs = hist_slots[slot(i)];
+
+    if (!live(i) || line == (*this)[i])
+	return;
+
+    index_remove(i);
+    release(hs);
+    hs = store(line);
+    index_add(i);
+
+    if (seq(i) < hist_mod_seq)
+	hist_mod_seq = seq(i);
+
+    compact();
+}
+
+/*
+ * Keep the newest len live entries.  The ring is laid out again from
+ * slot 0, which is O(n) but only happens when the limit changes.
+ */
+void history_c::
+set_max_len (size_t len)
+{
+    vector<hist_slot_s> slots;
+    size_t keep = hist_live < len ? hist_live : len;
+    size_t skip = hist_live - keep;
+
+    slots.reserve(keep);
+    for (size_t i = 0; i < hist_count; i++) {
+	if (!live(i))
+	    continue;
+	if (skip) {
+	    release(hist_slots[slot(i)]);
+	    skip--;
+	} else {
+	    slots.push_back(hist_slots[slot(i)]);
+	}
+    }
+
+    hist_slots.swap(slots);
+    hist_first = 0;
+    hist_count = hist_live = keep;
+    hist_max_len = len;
+
+    index_rebuild();
+    compact();
+}
+
+/*
+ * Turn erase_dups on or off.  Turning it on drops the older copies of
+ * any line that's in the history more than once.
+ */
+void history_c::
+set_erase_dups (bool on)
+{
+    hist_erase_dups = on;
+    hist_index.clear();
+    if (!on)
+	return;
+
+    for (size_t n = hist_count; n > 0; n--) {
+	size_t i = n - 1;
+
+	if (!live(i))
+	    continue;
+	if (index_find((*this)[i]) < 0) {
+	    index_add(i);
+	    continue;
+	}
+
+	hist_slot_s &hs = hist_slots[slot(i)];
+
+	hist_dups++;
+	hist_dup_bytes += hs.hs_len;
+	release(hs);
+	hs.hs_len = HS_DEAD;
+	hist_live--;
+    }
+
+    while (hist_count && !live(0)) {
+	hist_first = slot(1);
+	hist_count--;
+	hist_seq_first++;
+    }
+    compact();
+}
+
+void history_c::
+clear (void)
+{
+    if (hist_map) {
+	munmap((void *) hist_map, hist_map_size);
+	hist_map = NULL;
+	hist_mapped = 0;
+    }
+    hist_slots.clear();
+    hist_arena.clear();
+    hist_index.clear();
+    hist_first = 0;
+    hist_count = 0;
+    hist_live = 0;
+    hist_dead = 0;
+    hist_seq_first = 0;
+    hist_gen++;
+}
+
+/* ========================= erase_dups index ============================== */
+
+void history_c::
+index_add (size_t i)
+{
+    if (!hist_erase_dups)
+	return;
+
+    hist_index.emplace(hash<string_view>()((*this)[i]), hist_seq_first + i);
+}
+
+void history_c::
+index_remove (size_t i)
+{
+    if (!hist_erase_dups)
+	return;
+
+    auto range = hist_index.equal_range(hash<string_view>()((*this)[i]));
+    for (auto it = range.first; it != range.second; ++it) {
+	if (it->second == hist_seq_first + i) {
+	    hist_index.erase(it);
+	    return;
+	}
+    }
+}
+
+/* Returns the index of the live entry equal to line, -1 if none. */
+long history_c::
+index_find (string_view line) const
+{
+    auto range = hist_index.equal_range(hash<string_view>()(line));
+
+    for (auto it = range.first; it != range.second; ++it) {
+	size_t i = it->second - hist_seq_first;
+
+	if (i < hist_count && live(i) && (*this)[i] == line)
+	    return i;
+    }
+    return -1;
+}
+
+void history_c::
+index_rebuild (void)
+{
+    hist_index.clear();
+    hist_seq_first = 0;
+    hist_gen++;
+    if (!hist_erase_dups)
+	return;
+
+    for (size_t i = 0; i < hist_count; i++) {
+	if (live(i))
+	    index_add(i);
+    }
+}
+
+/* ========================= Incremental search ============================ */
+
+static inline uint32_t
+trigram (const char *p)
+{
+    return (uint8_t) p[0] << 16 | (uint8_t) p[1] << 8 | (uint8_t) p[2];
+}
+
+/*
+ * Bring sr_index up to date with the history.  New entries are added,
+ * entries changed in place are dropped from the index and added again,
+ * and when the entries were renumbered, or more of the index is evicted
+ * entries than live ones, it is built again from scratch.  Any change
+ * drops the candidate stack.
+ */
+void history_search_c::
+sync (history_c &hist)
+{
+    uint64_t first = hist.seq(0);
+    uint64_t end = hist.size() ? hist.seq(hist.size() - 1) : first;
+
+    if (hist.hist_gen != sr_gen || first - sr_first > hist.size() ||
+	hist.hist_mod_seq < sr_first) {
+	sr_index.clear();
+	sr_masks.clear();
+	sr_stack.clear();
+	sr_gen = hist.hist_gen;
+	sr_first = sr_end = first;
+	hist.hist_mod_seq = UINT64_MAX;
+    }
+
+    /* Postings are in seq order, so the changed ones are at the back */
+    if (hist.hist_mod_seq < sr_end) {
+	for (auto &posting : sr_index) {
+	    auto &seqs = posting.second;
+
+	    while (!seqs.empty() && seqs.back() >= hist.hist_mod_seq)
+		seqs.pop_back();
+	}
+	sr_end = hist.hist_mod_seq;
+	sr_masks.resize(sr_end - sr_first);
+	sr_stack.clear();
+    }
+    hist.hist_mod_seq = UINT64_MAX;
+
+    /* Entries evicted before they were indexed keep an empty mask */
+    if (sr_end < first) {
+	sr_end = first;
+	sr_masks.resize(sr_end - sr_first);
+    }
+    if (sr_end >= end)
+	return;
+
+    for (uint64_t s = sr_end; s < end; s++) {
+	size_t i = s - first;
+	string_view line = hist[i];
+
+	sr_masks.push_back(hist.live(i) ? char_mask(line) : 0);
+	if (!hist.live(i))
+	    continue;
+	for (size_t j = 0; j + 3 <= line.size(); j++) {
+	    auto &seqs = sr_index[trigram(line.data() + j)];
+
+	    if (seqs.empty() || seqs.back() != s)
+		seqs.push_back(s);
+	}
+    }
+    sr_end = end;
+    sr_stack.clear();
+}
+
+/*
+ * One bit per letter, ignoring case, and per digit; other bytes share
+ * the remaining bits.  An entry can only match a pattern whose mask is
+ * a subset of its own.
+ */
+uint64_t history_search_c::
+char_mask (string_view s)
+{
+    uint64_t mask = 0;
+
+    for (unsigned char c : s) {
+	if (c >= 'A' && c <= 'Z')
+	    c += 'a' - 'A';
+	if (c >= 'a' && c <= 'z')
+	    mask |= 1ULL << (c - 'a');
+	else if (c >= '0' && c <= '9')
+	    mask |= 1ULL << (c - '0' + 26);
+	else
+	    mask |= 1ULL << (c % 28 + 36);
+    }
+    return mask;
+}
+
+/*
+ * Push the candidates for query.  They come from whichever is shorter,
+ * the list on top of the stack or the rarest trigram of the query, and
+ * every one is checked against the text.  Short queries with nothing
+ * to narrow scan the history once.
+ */
+void history_search_c::
+push_level (history_c &hist, string_view query)
+{
+    const vector<uint64_t> *prev = sr_stack.empty() ? NULL : &sr_stack.back().sl_seqs;
+    const vector<uint64_t> *posting = NULL;
+    static const vector<uint64_t> none;
+    sr_level_s level;
+    uint64_t first = hist.seq(0);
+
+    for (size_t j = 0; j + 3 <= query.size(); j++) {
+	auto it = sr_index.find(trigram(query.data() + j));
+	const vector<uint64_t> *seqs = it == sr_index.end() ? &none : &it->second;
+
+	if (!posting || seqs->size() < posting->size())
+	    posting = seqs;
+    }
+
+    auto match = [&] (uint64_t s) {
+	size_t i = s - first;
+
+	if (s >= first && hist.live(i) && hist[i].find(query) != string_view::npos)
+	    level.sl_seqs.push_back(s);
+    };
+
+    level.sl_len = query.size();
+    if (posting && (!prev || posting->size() < prev->size())) {
+	for (auto it = posting->rbegin(); it != posting->rend(); ++it)
+	    match(*it);
+    } else if (prev) {
+	for (auto s : *prev)
+	    match(s);
+    } else {
+	for (uint64_t s = sr_end; s > first; s--)
+	    match(s - 1);
+    }
+
+    sr_stack.push_back(std::move(level));
+}
+
+/*
+ * Returns the index of the newest entry older than before that
+ * contains query, -1 if there isn't one.
+ */
+long history_search_c::
+find (history_c &hist, string_view query, size_t before)
+{
+    sync(hist);
+
+    /* Drop the levels query doesn't start with */
+    while (!sr_stack.empty()) {
+	size_t len = sr_stack.back().sl_len;
+
+	if (len <= query.size() && query.substr(0, len) == string_view(sr_query).substr(0, len))
+	    break;
+	sr_stack.pop_back();
+    }
+    if (sr_stack.empty() || sr_stack.back().sl_len < query.size()) {
+	push_level(hist, query);
+	sr_query = query;
+    }
+
+    /* Candidates are newest first */
+    for (auto s : sr_stack.back().sl_seqs) {
+	if (s < hist.seq(before))
+	    return s - hist.seq(0);
+    }
+    return -1;
+}
+
+#ifdef _TEST
+
+#include <stdio.h>
+
+#define TEST(x) if (!(x)) assert(0)
+
+int
+main ()
+{
+    history_c h(3);
+
+    h.push_back("one");
+    h.push_back("two");
+    h.push_back("three");
+    h.push_back("four");
+    TEST(h.size() == 3);
+    TEST(h[0] == "two" && h.back() == "four");
+
+    h.set(0, "TWO");
+    h.pop_back();
+    TEST(h.size() == 2 && h[0] == "TWO" && h[1] == "three");
+
+    /* Churn enough to force compaction, the ring keeps the newest */
+    for (int i = 0; i < 10000; i++)
+	h.push_back(std::to_string(i));
+    TEST(h[0] == "9997" && h[2] == "9999");
+
+    h.set_max_len(2);
+    TEST(h.size() == 2 && h[0] == "9998");
+
+    /* load() keeps the newest lines as views into the file */
+    char path[] = "/tmp/history_test_XXXXXX";
+    int fd = mkstemp(path);
+    std::string text;
+
+    for (int i = 0; i < 1000; i++)
+	text += "line " + std::to_string(i) + "\n";
+    text += std::string(5000, 'x') + "\r\n";
+    text += "last\nlast";
+    TEST(write(fd, text.data(), text.size()) == (ssize_t) text.size());
+    close(fd);
+
+    history_c m(100);
+
+    TEST(m.load(path) == 0);
+    TEST(m.size() == 100 && m.back() == "last" && m[98].size() == 5000);
+    TEST(m[0] == "line 902" && m.mapped());
+    m.set(98, "edited");
+    for (int i = 0; i < 98; i++)
+	m.push_back("new");
+    TEST(m[0] == "edited" && m[1] == "last" && m.mapped());
+    m.push_back("new");
+    m.push_back("new");
+    TEST(!m.mapped());
+    unlink(path);
+
+    /* A journal's compaction record in the file isn't an entry */
+    static const char rec[] = "a\nb\n\0" "1234 5678\nc\n";
+    char rec_path[] = "/tmp/history_test_XXXXXX";
+    history_c r(100);
+
+    fd = mkstemp(rec_path);
+    TEST(write(fd, rec, sizeof(rec) - 1) == (ssize_t) sizeof(rec) - 1);
+    close(fd);
+    TEST(r.load(rec_path) == 0);
+    TEST(r.size() == 3 && r[0] == "a" && r[1] == "b" && r[2] == "c");
+    unlink(rec_path);
+
+    /* erase_dups moves a repeat to the newest position */
+    history_c d(3);
+
+    d.push_back("a");
+    d.push_back("b");
+    d.push_back("a");
+    d.set_erase_dups(true);
+    TEST(d.size() == 2 && d[0] == "b" && d[1] == "a");
+    TEST(d.add("c") && d.add("b") && !d.add("b"));
+    TEST(d.back() == "b" && d.hist_dups == 2);
+
+    for (int i = 0; i < 10000; i++)
+	d.add(std::to_string(i % 5));
+    TEST(d.back() == "4" && d[d.size() - 1 - 2] != d.back());
+
+    /* Search narrows and backs up over the same lines as find() */
+    history_c s(100);
+    history_search_c sr;
+
+    for (int i = 0; i < 50; i++)
+	s.push_back("line " + std::to_string(i));
+    s.push_back("");
+    TEST(sr.find(s, "line 4", s.size() - 1) == 49);
+    TEST(sr.find(s, "line 4", 49) == 48);
+    TEST(sr.find(s, "line 42", s.size() - 1) == 42);
+    TEST(sr.find(s, "line 42x", s.size() - 1) == -1);
+    TEST(sr.find(s, "ne 1", s.size() - 1) == 19);
+    TEST(sr.find(s, "e", 1) == 0);
+
+    s.set(10, "changed");
+    TEST(sr.find(s, "changed", s.size() - 1) == 10);
+    TEST(sr.find(s, "line 10", s.size() - 1) == -1);
+
+    printf("all test passed\n");
+    return 0;
+}
+#endif
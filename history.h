@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2015, Wing Eng
+ * All rights reserved.
+ */
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+/*
+ * Command history.  Entries live in a ring of slots, so adding to a
+ * full history evicts the oldest entry in O(1).  The text of the
+ * entries is packed in an arena that is compacted once more than half
+ * of it belongs to evicted or replaced entries.
+ *
+ * Indexing is oldest first, like the vector it replaces; history_index
+ * in the editor counts back from the newest, size() - 1 - index.
+ *
+ * load() maps the history file and only reads its newest max_len lines,
+ * walking back from the end.  Those entries stay views into the
+ * mapping, saving the copy, until they are replaced or evicted; the
+ * last one going unmaps the file.  So the file must not be truncated
+ * meanwhile, linenoiseHistorySave() and the journal replace it with
+ * rename() instead.
+ *
+ * With erase_dups set, adding a line that is already in the history
+ * moves it to the newest position instead of storing it again.  The old
+ * slot is left dead, live() is false and it reads back empty; dead slots
+ * don't count against max_len and are squeezed out of the ring once
+ * there are enough of them.  A hash index from line to slot finds the
+ * old copy in O(1).
+ */
+class history_c {
+public:
+    history_c (size_t max_len);
+    ~history_c ();
+    history_c (const history_c &) = delete;
+    history_c &operator= (const history_c &) = delete;
+
+    size_t size (void) const { return hist_count; }
+    size_t max_len (void) const { return hist_max_len; }
+    bool erase_dups (void) const { return hist_erase_dups; }
+    bool mapped (void) const { return hist_map != NULL; }
+    bool live (size_t i) const { return hist_slots[slot(i)].hs_len != HS_DEAD; }
+    uint64_t seq (size_t i) const { return hist_seq_first + i; }
+
+    std::string_view operator[] (size_t i) const;
+    std::string_view back (void) const { return (*this)[hist_count - 1]; }
+
+    int add (std::string_view line);
+    int load (const char *path);
+    void push_back (std::string_view line);
+    void pop_back (void);
+    void set (size_t i, std::string_view line);
+    void set_max_len (size_t len);
+    void set_erase_dups (bool on);
+    void clear (void);
+
+    unsigned long hist_dups;		/* adds that moved an old copy */
+    unsigned long long hist_dup_bytes;	/* text not stored again for them */
+
+    /*
+     * For history_search_c.  seq(i) of an entry is stable until hist_gen
+     * changes; hist_mod_seq is the lowest seq changed by set() or
+     * pop_back() since the searcher last looked.
+     */
+    uint64_t hist_gen;
+    uint64_t hist_mod_seq;
+
+private:
+    struct hist_slot_s {
+	uint32_t hs_off;	/* offset in hist_arena, or hist_map if HS_MAPPED */
+	uint32_t hs_len;	/* HS_DEAD once moved by erase_dups */
+    };
+    static const uint32_t HS_DEAD = UINT32_MAX;
+    static const uint32_t HS_MAPPED = 0x80000000;
+
+    size_t slot (size_t i) const {
+	size_t s = hist_first + i;
+	return s >= hist_slots.size() ? s - hist_slots.size() : s;
+    }
+    size_t ring_max (void) const { return hist_max_len + hist_max_len / 2 + 1; }
+    void release (const hist_slot_s &hs);
+    hist_slot_s store (std::string_view line);
+    void append (const hist_slot_s &hs);
+    void evict (void);
+    bool add_slot (std::string_view line, const hist_slot_s &hs);
+    void compact (bool force = false);
+    void compact_ring (void);
+
+    /* erase_dups index, keyed by line hash, seq is size()-1 at add time
+     * plus hist_seq_first */
+    void index_rebuild (void);
+    void index_add (size_t i);
+    void index_remove (size_t i);
+    long index_find (std::string_view line) const;
+
+    std::vector<hist_slot_s> hist_slots;	/* ring, grows to ring_max() */
+    size_t hist_first;			/* slot of the oldest entry */
+    size_t hist_count;			/* entries, live or dead */
+    size_t hist_live;
+    size_t hist_max_len;		/* limit on live entries */
+
+    std::string hist_arena;
+    size_t hist_dead;			/* arena bytes no entry uses */
+
+    const char *hist_map;		/* load()ed file, NULL if none */
+    size_t hist_map_size;
+    size_t hist_mapped;			/* entries still in hist_map */
+
+    bool hist_erase_dups;
+    uint64_t hist_seq_first;		/* seq of entry 0 */
+    std::unordered_multimap<size_t, uint64_t> hist_index;
+};
+
+/*
+ * Incremental search for Ctrl-R.  Entries are indexed lazily by the
+ * trigrams they contain, the first time a search needs them.  Each
+ * query length matched so far keeps its candidate list on a stack:
+ * typing another char only filters the list on top, and backspace pops
+ * back to a list that was already computed.
+ *
+ * Alongside the trigrams each entry gets a char_mask(), for the fuzzy
+ * finder to rule out entries that lack one of the pattern's chars.
+ *
+ * The newest entry is the line being edited and is never searched.
+ */
+class history_search_c {
+public:
+    history_search_c () : sr_gen(0), sr_first(0), sr_end(0) {};
+
+    long find (history_c &hist, std::string_view query, size_t before);
+    void reset (void) { sr_stack.clear(); }
+
+    /* masks(hist)[j] is the char_mask() of entry seq masks_first() + j */
+    const std::vector<uint64_t> &masks (history_c &hist) { sync(hist); return sr_masks; }
+    uint64_t masks_first (void) const { return sr_first; }
+    static uint64_t char_mask (std::string_view s);
+
+private:
+    struct sr_level_s {
+	size_t sl_len;			/* chars of sr_query matched */
+	std::vector<uint64_t> sl_seqs;	/* matching entries, newest first */
+    };
+
+    void sync (history_c &hist);
+    void push_level (history_c &hist, std::string_view query);
+
+    std::unordered_map<uint32_t, std::vector<uint64_t>> sr_index;
+    uint64_t sr_gen;			/* hist_gen sr_index was built for */
+    uint64_t sr_first;			/* seq range in sr_index */
+    uint64_t sr_end;
+    std::vector<uint64_t> sr_masks;
+
+    std::string sr_query;		/* the query sr_stack matches */
+    std::vector<sr_level_s> sr_stack;
+};
+
+#endif
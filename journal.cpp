@@ -0,0 +1,688 @@
+/*
+ * Copyright (c) 2015, Wing Eng
+ * All rights reserved.
+ */
+#include <algorithm>
+#include <unordered_set>
+#include <vector>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+
+using namespace std;
+
+history_journal_c::
+history_journal_c () :
+    jn_appends(0), jn_syncs(0), jn_compactions(0), jn_reads(0), jn_stop(false),
+    jn_fd(-1), jn_size(0), jn_dirty(false), jn_opens(0),
+    jn_shared(false), jn_read(0), jn_reload(false),
+    jn_sync_ms(JOURNAL_SYNC_MS), jn_compact_size(JOURNAL_COMPACT_SIZE),
+    jn_compact_at(JOURNAL_COMPACT_SIZE), jn_max_len(0), jn_erase_dups(false)
+{
+}
+
+history_journal_c::
+~history_journal_c ()
+{
+    close();
+}
+
+static int
+flockRetry (int fd, int op)
+{
+    int ret;
+
+    do {
+	ret = flock(fd, op);
+    } while (ret == -1 && errno == EINTR);
+    return ret;
+}
+
+static int
+openJournal (const char *path)
+{
+    return ::open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+}
+
+/*
+ * Open path for appending, creating it if needed, and start the
+ * journal thread.  Returns -1 with errno set if it can't be opened.
+ *
+ * With shared, the journal is shared with other processes and shared
+ * is loaded from it.
+ */
+int history_journal_c::
+open (const char *path, history_c *shared)
+{
+    struct stat st;
+
+    close();
+
+    for (;;) {
+	jn_fd = openJournal(path);
+	if (jn_fd == -1)
+	    return -1;
+	if (!shared) {
+	    if (fstat(jn_fd, &st) == 0)
+		break;
+	} else if (flockRetry(jn_fd, LOCK_SH) == 0 && fstat(jn_fd, &st) == 0) {
+	    /* Compacted and renamed over while we waited for the lock */
+	    if (st.st_nlink > 0)
+		break;
+	    ::close(jn_fd);
+	    continue;
+	}
+	::close(jn_fd);
+	jn_fd = -1;
+	return -1;
+    }
+
+    /* Appends wait for the flock, so what's loaded ends at st_size */
+    if (shared) {
+	shared->load(path);
+	flock(jn_fd, LOCK_UN);
+    }
+
+    jn_path = path;
+    jn_shared = shared != NULL;
+    jn_read = st.st_size;
+    jn_own.clear();
+    jn_pending.clear();
+    jn_reload = false;
+    jn_size = st.st_size;
+    jn_compact_at = jn_size > (off_t) jn_compact_size ? jn_size * 2 : jn_compact_size;
+    jn_dirty = false;
+    jn_stop = false;
+    jn_thread = thread(&history_journal_c::run, this);
+    return 0;
+}
+
+/* Stop the thread, sync what's pending and close the file. */
+void history_journal_c::
+close (void)
+{
+    if (jn_fd == -1)
+	return;
+
+    {
+	lock_guard<mutex> lock(jn_lock);
+
+	jn_stop = true;
+	jn_cond.notify_all();
+    }
+    jn_thread.join();
+
+    if (jn_dirty && jn_sync_ms >= 0)
+	sync();
+    ::close(jn_fd);
+    jn_fd = -1;
+}
+
+/*
+ * Append one line.  max_len and erase_dups are the history's, they say
+ * what the next compaction keeps.
+ */
+int history_journal_c::
+append (string_view line, size_t max_len, bool erase_dups)
+{
+    struct stat st;
+    string rec;
+    ssize_t n;
+
+    rec.reserve(line.size() + 1);
+    rec.append(line);
+    rec += '\n';
+
+    unique_lock<mutex> lock(jn_lock);
+
+    if (jn_fd == -1)
+	return -1;
+    if (jn_shared && lock_file(LOCK_EX, &st) == -1)
+	return -1;
+    do {
+	n = write(jn_fd, rec.data(), rec.size());
+    } while (n == -1 && errno == EINTR);
+
+    if (jn_shared) {
+	flock(jn_fd, LOCK_UN);
+	if (n > 0)
+	    jn_size = st.st_size + n;
+
+	/* Our own line, read() mustn't add it again */
+	if (n == (ssize_t) rec.size() && !jn_reload) {
+	    if (st.st_size == jn_read)
+		jn_read += n;
+	    else
+		jn_own.push_back(st.st_size);
+	}
+    } else if (n > 0) {
+	jn_size += n;
+    }
+    if (n != (ssize_t) rec.size())
+	return -1;
+
+    jn_appends++;
+    jn_dirty = true;
+    jn_max_len = max_len;
+    jn_erase_dups = erase_dups;
+
+    if (jn_size >= jn_compact_at)
+	jn_cond.notify_all();
+
+    if (jn_sync_ms == 0) {
+	lock.unlock();
+	return sync();
+    }
+    return 0;
+}
+
+/* fsync the journal now. */
+int history_journal_c::
+sync (void)
+{
+    lock_guard<mutex> lock(jn_lock);
+
+    if (jn_fd == -1)
+	return -1;
+
+    jn_dirty = false;
+    jn_syncs++;
+    return fdatasync(jn_fd);
+}
+
+/*
+ * sync() for the journal thread.  It syncs a dup of jn_fd, so appends
+ * can carry on while it waits for the disk.
+ */
+int history_journal_c::
+flush (void)
+{
+    int fd, ret;
+
+    {
+	lock_guard<mutex> lock(jn_lock);
+
+	jn_dirty = false;
+	jn_syncs++;
+	fd = dup(jn_fd);
+    }
+    if (fd == -1)
+	return -1;
+    ret = fdatasync(fd);
+    ::close(fd);
+    return ret;
+}
+
+/*
+ * flock() a shared journal, first following it to the new file if it
+ * was compacted.  Called with jn_lock held, fills in st for the file
+ * that's locked.
+ */
+int history_journal_c::
+lock_file (int op, struct stat *st)
+{
+    for (;;) {
+	if (flockRetry(jn_fd, op) == -1)
+	    return -1;
+	if (fstat(jn_fd, st) == -1) {
+	    flock(jn_fd, LOCK_UN);
+	    return -1;
+	}
+	if (st->st_nlink > 0)
+	    return 0;
+	flock(jn_fd, LOCK_UN);
+	if (follow() == -1)
+	    return -1;
+    }
+}
+
+/*
+ * Split text, the journal from offset base, into lines.  Our own lines
+ * are skipped, and the record compact() leaves at the end of a replaced
+ * file sets next and next_ino.  Returns the bytes of whole lines.
+ */
+size_t history_journal_c::
+scan (string_view text, off_t base, vector<string_view> &lines,
+      off_t *next, ino_t *next_ino)
+{
+    auto own = lower_bound(jn_own.begin(), jn_own.end(), base);
+    size_t pos = 0, nl;
+
+    while ((nl = text.find('\n', pos)) != string_view::npos) {
+	string_view line = text.substr(pos, nl - pos);
+	off_t off = base + pos;
+
+	pos = nl + 1;
+	while (own != jn_own.end() && *own < off)
+	    ++own;
+	if (own != jn_own.end() && *own == off)
+	    continue;
+
+	/* History lines are C strings, so they never start with a NUL */
+	if (!line.empty() && line[0] == '\0') {
+	    string rec(line.substr(1));
+	    char *end;
+
+	    *next = strtoll(rec.c_str(), &end, 10);
+	    *next_ino = strtoull(end, NULL, 10);
+	    continue;
+	}
+	if (!line.empty() && line.back() == '\r')
+	    line.remove_suffix(1);
+	lines.push_back(line);
+    }
+    return pos;
+}
+
+/*
+ * The shared journal was renamed over by a compaction, so nothing more
+ * is appended to the old file.  Keep the lines in it that haven't been
+ * read yet and carry on in the new file, from where the compaction
+ * left it.  Called with jn_lock held.
+ */
+int history_journal_c::
+follow (void)
+{
+    struct stat st;
+    string text;
+    vector<string_view> lines;
+    off_t next = -1;
+    ino_t next_ino = 0;
+    int fd;
+
+    if (fstat(jn_fd, &st) == -1)
+	return -1;
+    if (st.st_size > jn_read) {
+	text.resize(st.st_size - jn_read);
+	if (pread(jn_fd, &text[0], text.size(), jn_read) != (ssize_t) text.size())
+	    return -1;
+    }
+    scan(text, jn_read, lines, &next, &next_ino);
+
+    fd = openJournal(jn_path.c_str());
+    if (fd == -1)
+	return -1;
+    if (fstat(fd, &st) == -1) {
+	::close(fd);
+	return -1;
+    }
+    ::close(jn_fd);
+    jn_fd = fd;
+    jn_opens++;
+    jn_own.clear();
+    jn_size = st.st_size;
+    jn_compact_at = jn_size > (off_t) jn_compact_size ? jn_size * 2 : jn_compact_size;
+
+    if (next >= 0 && st.st_ino == next_ino && !jn_reload) {
+	for (auto line : lines) {
+	    jn_pending.append(line);
+	    jn_pending += '\n';
+	}
+	jn_read = next;
+    } else {
+	/* Replaced some other way, or compacted twice: read it all */
+	jn_pending.clear();
+	jn_read = 0;
+	jn_reload = true;
+    }
+    return 0;
+}
+
+/*
+ * Add the lines other processes appended to a shared journal since the
+ * last call to hist.  One fstat() when there are none.  Returns the
+ * number of lines added, or -1.
+ */
+int history_journal_c::
+read (history_c &hist)
+{
+    lock_guard<mutex> lock(jn_lock);
+    struct stat st;
+    string text;
+    vector<string_view> lines;
+    off_t next;
+    ino_t next_ino;
+    int added = 0;
+
+    if (jn_fd == -1 || !jn_shared)
+	return 0;
+    if (fstat(jn_fd, &st) == -1)
+	return -1;
+    if (st.st_nlink > 0 && st.st_size <= jn_read && jn_pending.empty() && !jn_reload)
+	return 0;
+
+    if (lock_file(LOCK_SH, &st) == -1)
+	return -1;
+    if (st.st_size > jn_read) {
+	text.resize(st.st_size - jn_read);
+	if (pread(jn_fd, &text[0], text.size(), jn_read) != (ssize_t) text.size()) {
+	    flock(jn_fd, LOCK_UN);
+	    return -1;
+	}
+    }
+    flock(jn_fd, LOCK_UN);
+
+    /* The whole file is read again, our own lines included */
+    if (jn_reload) {
+	hist.clear();
+	jn_own.clear();
+	jn_reload = false;
+    }
+
+    for (size_t pos = 0, nl; (nl = jn_pending.find('\n', pos)) != string::npos; pos = nl + 1)
+	lines.push_back(string_view(jn_pending).substr(pos, nl - pos));
+    jn_read += scan(text, jn_read, lines, &next, &next_ino);
+    jn_own.erase(jn_own.begin(), lower_bound(jn_own.begin(), jn_own.end(), jn_read));
+
+    for (auto line : lines)
+	if (hist.add(line))
+	    added++;
+    jn_pending.clear();
+    jn_reads += added;
+    return added;
+}
+
+/*
+ * How often appended lines are synced, in milliseconds.  0 syncs each
+ * one before append() returns, < 0 leaves it to the kernel.
+ */
+void history_journal_c::
+set_sync_interval (int ms)
+{
+    lock_guard<mutex> lock(jn_lock);
+
+    jn_sync_ms = ms;
+    jn_cond.notify_all();
+}
+
+void history_journal_c::
+set_compact_size (size_t bytes)
+{
+    lock_guard<mutex> lock(jn_lock);
+
+    jn_compact_size = bytes;
+    jn_compact_at = bytes;
+    jn_cond.notify_all();
+}
+
+/*
+ * The journal thread.  Sleeps for the sync interval, or until the file
+ * is big enough to compact.
+ */
+void history_journal_c::
+run (void)
+{
+    unique_lock<mutex> lock(jn_lock);
+
+    while (!jn_stop) {
+	auto wake = [this] { return jn_stop || jn_size >= jn_compact_at; };
+
+	if (jn_sync_ms > 0)
+	    jn_cond.wait_for(lock, chrono::milliseconds(jn_sync_ms), wake);
+	else
+	    jn_cond.wait(lock, wake);
+	if (jn_stop)
+	    break;
+
+	if (jn_size >= jn_compact_at) {
+	    lock.unlock();
+	    int ret = compact();
+	    lock.lock();
+
+	    /* Don't spin on it, another process may have compacted it */
+	    if (ret == -1 && jn_size >= jn_compact_at)
+		jn_compact_at = jn_size + jn_compact_size;
+	}
+
+	if (jn_dirty && jn_sync_ms > 0) {
+	    lock.unlock();
+	    flush();
+	    lock.lock();
+	}
+    }
+}
+
+/*
+ * Rewrite the journal as the newest jn_max_len lines, only the newest
+ * copy of each with erase_dups.  Runs on the journal thread, reading
+ * the old file through a dup of jn_fd without the lock.
+ */
+int history_journal_c::
+compact (void)
+{
+    string tmp_path = jn_path + ".XXXXXX";
+    string text;
+    struct stat st;
+    off_t end;
+    size_t max_len;
+    bool erase_dups;
+    unsigned long opens;
+    int old;
+
+    {
+	lock_guard<mutex> lock(jn_lock);
+
+	end = jn_size;
+	max_len = jn_max_len;
+	erase_dups = jn_erase_dups;
+	opens = jn_opens;
+	old = dup(jn_fd);
+    }
+
+    /* Nothing appended yet, so the history's limits aren't known */
+    if (old == -1 || max_len == 0) {
+	if (old != -1)
+	    ::close(old);
+	return old == -1 ? -1 : 0;
+    }
+
+    /* Other processes append too, take what's there in whole lines */
+    if (jn_shared && fstat(old, &st) == 0)
+	end = st.st_size;
+
+    text.resize(end);
+    if (pread(old, &text[0], end, 0) != end) {
+	::close(old);
+	return -1;
+    }
+    ::close(old);
+    if (jn_shared) {
+	end = text.rfind('\n') + 1;
+	text.resize(end);
+    }
+    if (!text.empty() && text.back() != '\n')
+	text += '\n';
+
+    /* Newest lines first, each with its '\n', reversed into the snapshot */
+    vector<string_view> keep;
+    unordered_set<string_view> seen;
+    size_t pos = text.size();
+
+    while (pos > 0 && keep.size() < max_len) {
+	size_t nl = pos >= 2 ? text.rfind('\n', pos - 2) : string::npos;
+	size_t start = nl == string::npos ? 0 : nl + 1;
+	string_view line(text.data() + start, pos - start);
+
+	if (!erase_dups || seen.insert(line).second)
+	    keep.push_back(line);
+	pos = start;
+    }
+
+    string snap;
+    snap.reserve(text.size());
+    for (auto it = keep.rbegin(); it != keep.rend(); ++it)
+	snap.append(*it);
+
+    /* Unique, other processes sharing the journal may be compacting too */
+    int fd = mkostemp(&tmp_path[0], O_APPEND | O_CLOEXEC);
+    bool locked = false;
+    auto fail = [&] () {
+	if (locked)
+	    flock(jn_fd, LOCK_UN);
+	::close(fd);
+	unlink(tmp_path.c_str());
+	return -1;
+    };
+
+    if (fd == -1)
+	return -1;
+    if (write(fd, snap.data(), snap.size()) != (ssize_t) snap.size() || fdatasync(fd) == -1)
+	return fail();
+
+    /* Catch up with appends made while the snapshot was written, and swap */
+    unique_lock<mutex> lock(jn_lock);
+    off_t size = snap.size();
+    off_t cur = jn_size;
+
+    if (jn_opens != opens)
+	return fail();
+    if (jn_shared) {
+	/* Holding it keeps the others out until the rename, and if the
+	 * file is already unlinked someone else compacted it first */
+	if (flockRetry(jn_fd, LOCK_EX) == -1)
+	    return fail();
+	locked = true;
+	if (fstat(jn_fd, &st) == -1 || st.st_nlink == 0)
+	    return fail();
+	cur = st.st_size;
+    }
+
+    if (cur > end) {
+	string tail(cur - end, '\0');
+
+	if (pread(jn_fd, &tail[0], tail.size(), end) != (ssize_t) tail.size() ||
+	    write(fd, tail.data(), tail.size()) != (ssize_t) tail.size())
+	    return fail();
+	size += tail.size();
+    }
+
+    /* Tell the other processes where to carry on in the new file */
+    if (jn_shared) {
+	string rec;
+
+	if (fstat(fd, &st) == -1)
+	    return fail();
+	rec += '\0';
+	rec += to_string(size) + " " + to_string(st.st_ino) + "\n";
+	if (write(jn_fd, rec.data(), rec.size()) != (ssize_t) rec.size())
+	    return fail();
+    }
+
+    if (rename(tmp_path.c_str(), jn_path.c_str()) == -1) {
+	if (jn_shared)
+	    ftruncate(jn_fd, cur);
+	return fail();
+    }
+
+    if (jn_shared) {
+	/* We follow it like everyone else, on the next append() or read() */
+	flock(jn_fd, LOCK_UN);
+	::close(fd);
+	jn_size = size;
+	jn_compactions++;
+	jn_compact_at = size * 2 > (off_t) jn_compact_size ? size * 2 : jn_compact_size;
+	return 0;
+    }
+
+    ::close(jn_fd);
+    jn_fd = fd;
+    jn_size = size;
+    jn_dirty = size > (off_t) snap.size();
+    jn_compactions++;
+
+    /* A snapshot that's already big would be compacted again at once */
+    jn_compact_at = size * 2 > (off_t) jn_compact_size ? size * 2 : jn_compact_size;
+    return 0;
+}
+
+#ifdef _TEST
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST(x) if (!(x)) assert(0)
+
+static string
+slurp (const char *path)
+{
+    string s;
+    char buf[4096];
+    int fd = ::open(path, O_RDONLY), n;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+	s.append(buf, n);
+    ::close(fd);
+    return s;
+}
+
+int
+main ()
+{
+    char path[] = "/tmp/journal_test_XXXXXX";
+    int fd = mkstemp(path);
+    ::close(fd);
+
+    history_journal_c j;
+
+    TEST(j.open(path) == 0);
+    j.set_sync_interval(0);
+    TEST(j.append("one", 3, false) == 0 && j.append("two", 3, false) == 0);
+    TEST(slurp(path) == "one\ntwo\n" && j.jn_syncs == 2);
+
+    /* Past the threshold the thread keeps the newest max_len lines */
+    j.set_sync_interval(10);
+    for (int i = 0; i < 40; i++)
+	j.append(to_string(i % 4), 3, true);
+    j.set_compact_size(64);
+    for (int i = 0; i < 200 && j.jn_compactions == 0; i++)
+	usleep(10000);
+    j.close();
+    TEST(j.jn_compactions > 0);
+    TEST(slurp(path) == "1\n2\n3\n");
+
+    /* Two processes sharing it, each sees the other's lines once */
+    history_c h1(100), h2(100);
+    history_journal_c j1, j2;
+
+    TEST(j1.open(path, &h1) == 0 && j2.open(path, &h2) == 0);
+    TEST(h1.size() == 3 && h2.size() == 3);
+
+    auto add = [] (history_c &h, history_journal_c &j, const char *line) {
+	j.read(h);
+	h.add(line);
+	j.append(line, 100, false);
+    };
+    add(h1, j1, "a");
+    TEST(j2.read(h2) == 1 && h2[3] == "a");
+    TEST(j1.read(h1) == 0 && h1.size() == 4);
+    add(h2, j2, "b");
+    add(h1, j1, "c");
+    TEST(j1.read(h1) == 0 && h1[4] == "b" && h1[5] == "c");
+    TEST(j2.read(h2) == 1 && h2[5] == "c");
+
+    /* j1 compacts, j2 follows to the new file on its next append */
+    add(h2, j2, "d");
+    j1.set_compact_size(16);
+    add(h1, j1, "e");
+    for (int i = 0; i < 200 && j1.jn_compactions == 0; i++)
+	usleep(10000);
+    TEST(j1.jn_compactions == 1);
+    add(h2, j2, "f");
+    TEST(j2.read(h2) == 0 && h2[7] == "e" && h2[8] == "f");
+    TEST(j1.read(h1) == 1 && h1[8] == "f" && j2.jn_reads == 3);
+    j1.close();
+    j2.close();
+    TEST(slurp(path) == "1\n2\n3\na\nb\nc\nd\ne\nf\n");
+
+    unlink(path);
+    printf("all test passed\n");
+    return 0;
+}
+#endif
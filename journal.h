@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2015, Wing Eng
+ * All rights reserved.
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "history.h"
+
+#define JOURNAL_SYNC_MS		1000		/* default fsync interval */
+#define JOURNAL_COMPACT_SIZE	(256 * 1024)	/* default compaction threshold */
+
+/*
+ * Append-only history file.  Each line added to the history is appended
+ * with a single write(), in the same one-line-per-entry format that
+ * linenoiseHistoryLoad() reads.
+ *
+ * A thread per journal does the slow parts: it fsyncs appended lines
+ * every sync interval, and once the file grows past the compaction
+ * threshold it rewrites it as a snapshot of the newest max_len lines.
+ * The snapshot is written to a temporary file and renamed over the
+ * journal; jn_lock is only held to copy the lines appended meanwhile
+ * and swap the fd, so append() never waits for the rewrite.
+ *
+ * A shared journal is written by several processes.  Appends are made
+ * under an exclusive flock(), and read() adds the lines the others
+ * appended since the last call, found with one fstat() and read from
+ * the offset already seen.  Compaction takes the flock too, and before
+ * renaming leaves a record of where the new file continues at the end
+ * of the old one, so the other processes follow without reading the
+ * snapshot again.
+ */
+class history_journal_c {
+public:
+    history_journal_c ();
+    ~history_journal_c ();
+
+    int open (const char *path, history_c *shared = NULL);
+    void close (void);
+    int append (std::string_view line, size_t max_len, bool erase_dups);
+    int read (history_c &hist);
+    int sync (void);
+    void set_sync_interval (int ms);
+    void set_compact_size (size_t bytes);
+
+    std::atomic<unsigned long> jn_appends;
+    std::atomic<unsigned long> jn_syncs;
+    std::atomic<unsigned long> jn_compactions;
+    unsigned long jn_reads;		/* lines read() from other processes */
+
+private:
+    void run (void);
+    int flush (void);
+    int compact (void);
+    int lock_file (int op, struct stat *st);
+    int follow (void);
+    size_t scan (std::string_view text, off_t base,
+		 std::vector<std::string_view> &lines, off_t *next, ino_t *next_ino);
+
+    std::mutex jn_lock;
+    std::condition_variable jn_cond;
+    std::thread jn_thread;
+    bool jn_stop;
+
+    std::string jn_path;
+    int jn_fd;			/* swapped under jn_lock */
+    off_t jn_size;
+    bool jn_dirty;		/* appended since the last fsync */
+    unsigned long jn_opens;	/* bumped when jn_fd is swapped */
+
+    /* Shared journals only */
+    bool jn_shared;
+    off_t jn_read;		/* the file is in the history up to here */
+    std::vector<off_t> jn_own;	/* our lines past jn_read, not to read back */
+    std::string jn_pending;	/* lines follow() read from the old file */
+    bool jn_reload;		/* new file isn't a follow on, read it all */
+
+    int jn_sync_ms;		/* 0 syncs every append, < 0 never */
+    size_t jn_compact_size;
+    off_t jn_compact_at;	/* size that triggers the next compaction */
+
+    /* History limits as of the last append, applied by compact() */
+    size_t jn_max_len;
+    bool jn_erase_dups;
+};
+
+#endif
@@ -10,8 +10,11 @@
  * Copyright (c) 2015, Wing Eng
  * All rights reserved.
  */
-#include <deque>
 #include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <assert.h>
 
 #include "linenoise.h"
@@ -19,46 +22,87 @@
 
 using namespace std;
 
-class key_node_c {
-public:
-    key_node_c (int ch) : kn_ch(ch) {};
-
-public:
-    int kn_ch;
-    cmd_func kn_func;
-
-    vector<key_node_c *> kn_children;
-};
-
-typedef vector<key_node_c *> cmd_vec_t;
-
-static cmd_vec_t cmd_map;
-static deque<char> char_stack;
+#define KS_LEAF(h)	((int16_t) -((h) + 1))
+#define KS_HANDLER(n)	(-(n) - 1)
 
 static key_node_c *
-find_key_node (cmd_vec_t &cmd_map, int ch, int match_any = 1)
+find_key_node (cmd_vec_t &cmd_map, int ch)
 {
     for (auto kn : cmd_map) {
 	if (kn->kn_ch == ch)
 	    return kn;
-	if (kn->kn_ch == '*' && match_any)
-	    return kn;
     }
     return NULL;
 }
 
-static void
-nextChar (int fd, char &c)
+/*
+ * Read whatever is available on fd into the free part of the ring,
+ * up to the wrap point.  In raw mode read() blocks for the first byte
+ * and then returns everything that's pending, so a pasted line or an
+ * escape sequence costs one syscall instead of one per byte.
+ */
+int ln_input_c::
+fill (int fd)
 {
-    if (char_stack.size()) {
-	c = char_stack.front();
-	char_stack.pop_front();
-	return;
+    size_t off = in_tail & (LN_INPUT_SIZE - 1);
+    size_t room = LN_INPUT_SIZE - size();
+    ssize_t n;
+
+    if (room > LN_INPUT_SIZE - off)
+	room = LN_INPUT_SIZE - off;
+    if (room == 0)
+	return 0;
+
+    do {
+	n = read(fd, in_buf + off, room);
+	in_reads++;
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0) {
+	in_tail += n;
+	in_bytes += n;
     }
+    return n;
+}
 
-    if (read(fd, &c, 1) != 1) {
-	assert(0);
+void ln_input_c::
+unget (char ch)
+{
+    assert(size() < LN_INPUT_SIZE);
+
+    in_head--;
+    in_buf[in_head & (LN_INPUT_SIZE - 1)] = ch;
+}
+
+/*
+ * Append up to len bytes handed over by the application, returns how
+ * many fitted.
+ */
+size_t ln_input_c::
+put (const char *bytes, size_t len)
+{
+    size_t n = 0;
+
+    while (n < len && size() < LN_INPUT_SIZE)
+	in_buf[in_tail++ & (LN_INPUT_SIZE - 1)] = bytes[n++];
+    return n;
+}
+
+/*
+ * Return the next input char, refilling the ring from fd when it's
+ * empty.  Returns 1 on success, 0 on EOF and -1 on error.
+ */
+int
+lnReadChar (lnSession *ses, char *c)
+{
+    if (ses->ses_input.size() == 0) {
+	int n = ses->ses_input.fill(ses->ses_ifd);
+	if (n <= 0)
+	    return n;
     }
+
+    *c = ses->ses_input.get();
+    return 1;
 }
 
 /*
@@ -66,64 +110,372 @@ nextChar (int fd, char &c)
  * of stdin, used for complete line where the char wasn't consumed
  */
 void
-lnPushChar (char c)
+lnPushChar (lnSession *ses, char c)
 {
-    char_stack.push_back(c);
+    ses->ses_input.unget(c);
 }
 
-static key_node_c *
-lnGetKeys (cmd_vec_t &cmd_map, int fd, char &ch)
+void
+lnSessionGetStats (lnSession *ses, lnStats *stats)
 {
-    nextChar(fd, ch);
+    *stats = ses->ses_stats;
+    stats->lns_read_calls = ses->ses_input.in_reads;
+    stats->lns_read_bytes = ses->ses_input.in_bytes;
+    stats->lns_history_dups = ses->ses_history.hist_dups;
+    stats->lns_history_dup_bytes = ses->ses_history.hist_dup_bytes;
+    stats->lns_completion_hits = ses->ses_complete_cache.cc_hits;
+    stats->lns_completion_misses = ses->ses_complete_cache.cc_misses;
+    stats->lns_highlight_bytes = ses->ses_hl.hc_tokenized;
+    if (ses->ses_journal) {
+	stats->lns_journal_appends = ses->ses_journal->jn_appends;
+	stats->lns_journal_syncs = ses->ses_journal->jn_syncs;
+	stats->lns_journal_compactions = ses->ses_journal->jn_compactions;
+	stats->lns_journal_reads = ses->ses_journal->jn_reads;
+    }
+}
 
-    auto kn = find_key_node(cmd_map, ch);
-    if (kn) {
-	if (kn->kn_children.size()) {
-	    return lnGetKeys(kn->kn_children, fd, ch);
-	} else {
-	    if (kn->kn_func)
-		return kn;
+void
+lnGetStats (lnStats *stats)
+{
+    lnSessionGetStats(lnDefaultSession(), stats);
+}
+
+/*
+ * Set the inter-byte deadline for escape sequences, in milliseconds.
+ * Negative waits forever for the rest of a sequence.
+ */
+void
+lnSessionSetKeyTimeout (lnSession *ses, int ms)
+{
+    ses->ses_key_timeout_ms = ms;
+}
+
+void
+lnSetKeyTimeout (int ms)
+{
+    lnSessionSetKeyTimeout(lnDefaultSession(), ms);
+}
+
+static uint64_t
+nowUsec (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Give every node with children a state, depth first so the root is
+ * state 0, and return its index.
+ */
+static int
+compileNode (lnSession *ses, key_node_c *node)
+{
+    vector<key_state_s> &key_states = ses->ses_states;
+    int state = key_states.size();
+    key_node_c *any = NULL;
+
+    key_states.push_back(key_state_s());
+    key_states[state].ks_handler = node->kn_handler;
+
+    for (auto kn : node->kn_children) {
+	int16_t next = 0;
+
+	if (kn->kn_children.size())
+	    next = compileNode(ses, kn);
+	else if (kn->kn_handler >= 0)
+	    next = KS_LEAF(kn->kn_handler);
+
+	if (kn->kn_ch == '*')
+	    any = kn;
+	key_states[state].ks_next[(unsigned char) kn->kn_ch] = next;
+    }
+
+    /*
+     * The '*' wildcard takes every char that has no entry of its own.
+     */
+    if (any) {
+	int16_t *next = key_states[state].ks_next;
+	int16_t wild = next[(unsigned char) '*'];
+
+	for (int ch = 0; ch < 256; ch++) {
+	    if (next[ch] == 0)
+		next[ch] = wild;
 	}
     }
 
-    return NULL;
+    return state;
 }
 
 static void
-addKeyHandler (cmd_vec_t &cmap, const char *seq, cmd_func func)
+compileKeys (lnSession *ses)
+{
+    ses->ses_states.clear();
+    compileNode(ses, &ses->ses_keys);
+    ses->ses_states_dirty = 0;
+}
+
+/*
+ * Match the key at the head of the input without consuming it.  On
+ * KEY_MATCH *len is the length of the key and *handler its handler,
+ * on KEY_NOMATCH *len bytes should be dropped.  KEY_PARTIAL means the
+ * input ran out in the middle of a sequence; with 'flush' set the
+ * longest complete key seen so far is taken instead, and the bytes
+ * after it are left in the input to be matched again.
+ */
+static int
+lnMatchKey (lnSession *ses, size_t *len, int *handler, int flush)
+{
+    const ln_input_c &input = ses->ses_input;
+    const key_state_s *key_states = ses->ses_states.data();
+    size_t avail = input.size();
+    size_t last_len = 0;
+    int last_handler = -1;
+    int state = 0;
+    size_t i;
+
+    for (i = 0; i < avail; i++) {
+	int next = key_states[state].ks_next[(unsigned char) input.peek(i)];
+
+	if (next < 0) {
+	    *len = i + 1;
+	    *handler = KS_HANDLER(next);
+	    return KEY_MATCH;
+	}
+	if (next == 0)
+	    break;
+
+	state = next;
+	if (key_states[state].ks_handler >= 0) {
+	    last_len = i + 1;
+	    last_handler = key_states[state].ks_handler;
+	}
+    }
+
+    if (i == avail && !flush)
+	return KEY_PARTIAL;
+
+    if (last_handler >= 0) {
+	*len = last_len;
+	*handler = last_handler;
+	return KEY_MATCH;
+    }
+
+    /* Unknown sequence, drop what was read of it */
+    *len = (i < avail) ? i + 1 : avail;
+    return KEY_NOMATCH;
+}
+
+/*
+ * Account for the time a partial sequence was held once it's resolved.
+ */
+static void
+partialDone (lnSession *ses)
+{
+    if (ses->ses_partial_start == 0)
+	return;
+
+    uint64_t held = nowUsec() - ses->ses_partial_start;
+    lnStats *st = &ses->ses_stats;
+
+    st->lns_partial_keys++;
+    st->lns_partial_wait_us += held;
+    if (held > st->lns_partial_wait_max_us)
+	st->lns_partial_wait_max_us = held;
+    ses->ses_partial_start = 0;
+}
+
+/*
+ * Wait for more input on fd.  With a partial sequence held the wait is
+ * bounded by the key timeout.  Returns 1 when input was read or the
+ * wait was interrupted, 0 when the deadline passed.  The session's wake
+ * fd is watched too, and serviced while waiting.
+ */
+static int
+waitInput (lnSession *ses, int partial)
+{
+    int timeout_ms = partial ? lnSessionKeyTimeout(ses) : -1;
+
+    if (timeout_ms >= 0 || ses->ses_wake_fd != -1) {
+	struct pollfd pfd[2] = {
+	    { ses->ses_ifd, POLLIN, 0 },
+	    { ses->ses_wake_fd, POLLIN, 0 },
+	};
+	int n;
+
+	if (timeout_ms == 0)
+	    return 0;
+
+	n = poll(pfd, ses->ses_wake_fd != -1 ? 2 : 1, timeout_ms);
+	if (n == 0)
+	    return 0;
+	if (n < 0 && errno == EINTR)
+	    return 1;
+
+	/* Background results, the deadline is checked again by the caller */
+	if (pfd[1].revents & POLLIN) {
+	    lnSessionWake(ses);
+	    if (!(pfd[0].revents & POLLIN))
+		return 1;
+	}
+    }
+
+    if (ses->ses_input.fill(ses->ses_ifd) <= 0) {
+	assert(0);
+    }
+    return 1;
+}
+
+/*
+ * Build the path for seq in the tree, the handler is attached to the
+ * node for the last char.  Registering the same sequence again
+ * replaces its handler.
+ */
+static void
+addKeyHandler (lnSession *ses, cmd_vec_t &cmap, const char *seq, cmd_func func)
 {
     key_node_c *kn;
 
-    if ((kn = find_key_node(cmap, *seq, 0)) == NULL) {
+    if ((kn = find_key_node(cmap, *seq)) == NULL) {
 	kn = new key_node_c(*seq);
 
 	cmap.push_back(kn);
     }
 
-    kn->kn_func = func;
-    if (seq[1] == '\0')
+    if (seq[1] != '\0') {
+	addKeyHandler(ses, kn->kn_children, seq + 1, func);
 	return;
+    }
 
-    addKeyHandler(kn->kn_children, seq + 1, func);
+    if (kn->kn_handler < 0) {
+	kn->kn_handler = ses->ses_handlers.size();
+	ses->ses_handlers.push_back(func);
+    } else {
+	ses->ses_handlers[kn->kn_handler] = func;
+    }
+}
+
+void
+lnSessionAddKeyHandler (lnSession *ses, const char *seq, cmd_func func)
+{
+    addKeyHandler(ses, ses->ses_keys.kn_children, seq, func);
+    ses->ses_states_dirty = 1;
 }
 
 void
 lnAddKeyHandler (const char *seq, cmd_func func)
 {
-    addKeyHandler(cmd_map, seq, func);
+    lnSessionAddKeyHandler(lnDefaultSession(), seq, func);
+}
+
+/*
+ * Dispatch every complete key in the input ring without blocking.
+ * Stops when *done is set, the ring is empty or it ends in a partial
+ * sequence, in which case KEY_PARTIAL is returned and the bytes stay
+ * held.  With 'flush' the held bytes are resolved as on a timeout.
+ * *ret is set to the value of the last handler run.
+ */
+int
+lnSessionDispatchKeys (lnSession *ses, int *done, int flush, int *ret)
+{
+    ln_input_c &input = ses->ses_input;
+
+    if (ses->ses_states_dirty)
+	compileKeys(ses);
+
+    while (!*done && input.size()) {
+	size_t len = 0;
+	int h = -1;
+	int rc;
+
+	rc = lnMatchKey(ses, &len, &h, flush);
+	if (rc == KEY_PARTIAL) {
+	    if (ses->ses_partial_start == 0)
+		ses->ses_partial_start = nowUsec();
+	    lnSessionFlush(ses, 0);
+	    return KEY_PARTIAL;
+	}
+
+	partialDone(ses);
+	flush = 0;
+
+	char ch = input.peek(len - 1);
+	input.consume(len);
+
+	if (rc == KEY_MATCH) {
+	    size_t drawn = ses->ses_frame.size();
+
+	    ses->ses_stats.lns_keys++;
+	    *ret = ses->ses_handlers[h](ch);
+
+	    drawn = ses->ses_frame.size() - drawn;
+	    if (drawn > ses->ses_stats.lns_key_bytes_max)
+		ses->ses_stats.lns_key_bytes_max = drawn;
+	}
+    }
+
+    /* What the keys drew goes out in one write */
+    lnSessionFlush(ses, 0);
+    return KEY_MATCH;
 }
 
+/*
+ * Milliseconds left before a held partial sequence times out, 0 if
+ * it already has and -1 if nothing is held or there's no timeout.
+ */
 int
-lnHandleKeys (int fd, int *done)
+lnSessionKeyTimeout (lnSession *ses)
+{
+    if (ses->ses_partial_start == 0 || ses->ses_key_timeout_ms < 0)
+	return -1;
+
+    uint64_t deadline = ses->ses_partial_start + (uint64_t) ses->ses_key_timeout_ms * 1000;
+    uint64_t now = nowUsec();
+
+    if (now >= deadline)
+	return 0;
+    return (deadline - now + 999) / 1000;
+}
+
+/*
+ * Blocking key loop, reads the session's fd until *done is set.
+ */
+int
+lnSessionHandleKeys (lnSession *ses, int *done)
 {
-    char ch;
     int ret = 00;
+    int flush = 0;
 
     while (!*done) {
-	auto kn = lnGetKeys(cmd_map, fd, ch);
-	if (kn && kn->kn_func) {
-	    ret = kn->kn_func(ch);
+	int rc = lnSessionDispatchKeys(ses, done, flush, &ret);
+
+	/* A non-blocking ofd that's full is waited for here */
+	lnSessionFlush(ses, 1);
+	flush = 0;
+	if (*done)
+	    break;
+
+	if (rc == KEY_PARTIAL) {
+	    if (!waitInput(ses, 1)) {
+		ses->ses_stats.lns_partial_timeouts++;
+		flush = 1;
+	    }
+	} else {
+	    waitInput(ses, 0);
 	}
     }
     return ret;
 }
+
+/*
+ * Run the default session's key handlers on fd until *done is set.
+ */
+int
+lnHandleKeys (int fd, int *done)
+{
+    lnSession *ses = lnDefaultSession();
+
+    ses->ses_ifd = fd;
+    return lnSessionHandleKeys(ses, done);
+}
@@ -11,9 +11,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
@@ -21,62 +23,25 @@
 #include "string_fmt.h"
 #include "linenoise.h"
 #include "linenoise_private.h"
+#include "utf8.h"
 
 using namespace std;
 
-class lnCompletion {
-public:
-    lnCompletion(const char *tok, const char *help) :
-	lnc_token(tok), lnc_help(help) {};
-    lnCompletion(const std::string &tok, const std::string &help) :
-	lnc_token(tok), lnc_help(help) {};
-
-    std::string lnc_token;
-    std::string lnc_help;
-};
-
 #define ESC	27
 #define TAB	9
 
-#define LN_DEFAULT_HISTORY_MAX_LEN 100
-#define LN_MAX_LINE 4096
 static const char *unsupported_term[] = {"dumb", "cons25", "emacs", NULL};
-static linenoiseCompletionFunc *completionCallback;
 
-static struct termios orig_termios;	/* In order to restore at exit.*/
-static int rawmode = 0;			/* For atexit() function to check if restore is needed*/
 static int atexit_registered = 0;	/* Register atexit just 1 time. */
 
-static int history_max_len = LN_DEFAULT_HISTORY_MAX_LEN;
-static std::vector<std::string> history;
-static std::string yank_buffer;
-
-/* The linenoiseState structure represents the state during line editing.
- * We pass this state to functions implementing specific editing
- * functionalities. */
-struct linenoiseState {
-    int ifd;            /* Terminal stdin file descriptor. */
-    int ofd;            /* Terminal stdout file descriptor. */
-    char *buf;          /* Edited line buffer. */
-    size_t buflen;      /* Edited line buffer size. */
-    const char *prompt; /* Prompt to display. */
-    size_t plen;        /* Prompt length. */
-    size_t pos;         /* Current cursor position. */
-    size_t oldpos;      /* Previous refresh cursor position. */
-    size_t len;         /* Current edited line length. */
-    size_t cols;        /* Number of columns in terminal. */
-
-    int history_search; /* 1 if we are searching history */
-    int history_index;
-
-    int edit_done;      /* set non-zero when done with editing line */
-    int ret_code;	/* return code to linenoise() */
-};
-
 static void lnEditHistorySearchPrev(linenoiseState *ls);
+static void lnEditSetHistoryIndex(linenoiseState *ls);
+static void lnEditFuzzyUpdate(linenoiseState *ls);
+static void lnEditSetLine(linenoiseState *ls, std::string_view line);
+static int lnSessionWakePipe(lnSession *ses);
 
-/* Debugging macro. */
-#if 1
+/* Debugging macro, the log file is shared by all sessions. */
+#if 0
 FILE *lndebug_fp = NULL;
 #define wndebug(...) \
     do { \
@@ -97,6 +62,61 @@ lnAtExit (void)
     lnDisableRawMode(STDIN_FILENO);
 }
 
+/* ============================== Sessions ================================== */
+
+lnSession::lnSession (int ifd, int ofd) :
+    ses_ifd(ifd), ses_ofd(ofd), ses_keys(0), ses_states_dirty(1),
+    ses_key_timeout_ms(LN_KEY_TIMEOUT_MS), ses_partial_start(0),
+    ses_rawmode(0), ses_completion(NULL), ses_complete_count(NULL),
+    ses_complete_cache_on(0),
+    ses_complete_prefetch(0),
+    ses_history(LN_DEFAULT_HISTORY_MAX_LEN), ses_wake_fd(-1), ses_wake_notify(-1),
+    ses_keys_bound(0), ses_screen_valid(0), ses_screen_col(0),
+    ses_multiline(0), ses_screen_row(0), ses_highlight(NULL), ses_hint(NULL),
+    ses_hint_style(0), ses_hint_stale(1), ses_frame_sent(0),
+    ses_editing(0), ses_cols(80), ses_feed_off(0)
+{
+    memset(&ses_stats, 0, sizeof(ses_stats));
+    memset(&ses_orig_termios, 0, sizeof(ses_orig_termios));
+    memset(&ses_state, 0, sizeof(ses_state));
+}
+
+/* Workers may still write to the wake pipe until they're stopped */
+lnSession::~lnSession ()
+{
+    ses_complete_async.reset();
+    ses_fuzzy.reset();
+    if (ses_wake_fd != -1) {
+	close(ses_wake_fd);
+	close(ses_wake_notify);
+    }
+}
+
+/* The session used by the calls that don't take one. */
+lnSession *
+lnDefaultSession (void)
+{
+    static lnSession ses(STDIN_FILENO, STDOUT_FILENO);
+
+    return &ses;
+}
+
+/* Create a session editing on ifd/ofd. */
+lnSession *
+lnSessionCreate (int ifd, int ofd)
+{
+    return new lnSession(ifd, ofd);
+}
+
+void
+lnSessionDestroy (lnSession *ses)
+{
+    if (ses == NULL || ses == lnDefaultSession()) return;
+
+    lnSessionDisableRawMode(ses);
+    delete ses;
+}
+
 /* ======================= Low level terminal handling ====================== */
 
 /* Return true if the terminal name is in the list of terminals we know are
@@ -113,20 +133,22 @@ isUnsupportedTerm (void)
     return 0;
 }
 
-/* Raw mode: 1960 magic shit. */
-int
-lnEnableRawMode (int fd)
+/* Raw mode: 1960 magic shit.  Only the default session is restored
+ * at exit. */
+static int
+enableRawMode (lnSession *ses, int fd)
 {
     struct termios raw;
 
-    if (!isatty(STDIN_FILENO)) goto fatal;
-    if (!atexit_registered) {
+    if (ses == lnDefaultSession() && !atexit_registered) {
         atexit(lnAtExit);
         atexit_registered = 1;
     }
-    if (tcgetattr(fd, &orig_termios) == -1) goto fatal;
 
-    raw = orig_termios;  /* modify the original mode */
+    if (!isatty(fd)) goto fatal;
+    if (tcgetattr(fd, &ses->ses_orig_termios) == -1) goto fatal;
+
+    raw = ses->ses_orig_termios;  /* modify the original mode */
     /* input modes: no break, no CR to NL, no parity check, no strip char,
      * no start/stop output control. */
     raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
@@ -143,7 +165,7 @@ lnEnableRawMode (int fd)
 
     /* put terminal in raw mode after flushing */
     if (tcsetattr(fd, TCSAFLUSH,&raw) < 0) goto fatal;
-    rawmode = 1;
+    ses->ses_rawmode = 1;
     return 0;
 
  fatal:
@@ -151,30 +173,55 @@ lnEnableRawMode (int fd)
     return -1;
 }
 
+static void
+disableRawMode (lnSession *ses, int fd)
+{
+    /* Don't even check the return value as it's too late. */
+    if (ses->ses_rawmode && tcsetattr(fd, TCSAFLUSH, &ses->ses_orig_termios) != -1)
+        ses->ses_rawmode = 0;
+}
+
+int
+lnSessionEnableRawMode (lnSession *ses)
+{
+    return enableRawMode(ses, ses->ses_ifd);
+}
+
+void
+lnSessionDisableRawMode (lnSession *ses)
+{
+    disableRawMode(ses, ses->ses_ifd);
+}
+
+int
+lnEnableRawMode (int fd)
+{
+    return enableRawMode(lnDefaultSession(), fd);
+}
+
 void
 lnDisableRawMode (int fd)
 {
-    /* Don't even check the return value as it's too late. */
-    if (rawmode && tcsetattr(fd, TCSAFLUSH,&orig_termios) != -1)
-        rawmode = 0;
+    disableRawMode(lnDefaultSession(), fd);
 }
 
 /* Use the ESC [6n escape sequence to query the horizontal cursor position
  * and return it. On error -1 is returned, on success the position of the
  * cursor. */
 static int
-getCursorPosition (int ifd, int ofd)
+getCursorPosition (lnSession *ses)
 {
     char buf[32];
     int cols, rows;
     unsigned int i = 0;
 
-    /* Report cursor location */
-    if (write(ofd, CSI "6n", sizeof(CSI "6n") - 1) != 4) return -1;
+    /* Report cursor location, after what's already drawn */
+    if (lnSessionFlush(ses, 1) == -1) return -1;
+    if (write(ses->ses_ofd, CSI "6n", sizeof(CSI "6n") - 1) != 4) return -1;
 
     /* Read the response: ESC [ rows ; cols R */
     while (i < sizeof(buf) - 1) {
-        if (read(ifd, buf + i, 1) != 1) break;
+        if (lnReadChar(ses, buf + i) != 1) break;
         if (buf[i] == 'R') break;
         i++;
     }
@@ -187,13 +234,14 @@ getCursorPosition (int ifd, int ofd)
 }
 
 static void
-getColRow (unsigned int &cols, unsigned int &rows)
+getColRow (struct linenoiseState *ls, unsigned int &cols, unsigned int &rows)
 {
     struct winsize ws;
 
-    if (ioctl(1, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-	/* handle this case later */
-	assert(0);
+    if (ioctl(ls->ofd, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+	cols = ls->cols;
+	rows = 24;
+	return;
     }
 
     cols = ws.ws_col;
@@ -203,21 +251,22 @@ getColRow (unsigned int &cols, unsigned int &rows)
 /* Try to get the number of columns in the current terminal, or assume 80
  * if it fails. */
 static int
-getColumns (int ifd, int ofd)
+getColumns (lnSession *ses)
 {
     struct winsize ws;
+    int ofd = ses->ses_ofd;
 
-    if (ioctl(1, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+    if (ioctl(ofd, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
         /* ioctl() failed. Try to query the terminal itself. */
         int start, cols;
 
         /* Get the initial position so we can restore it later. */
-        start = getCursorPosition(ifd, ofd);
+        start = getCursorPosition(ses);
         if (start == -1) goto failed;
 
         /* Go to right margin and get position. */
         if (write(ofd, CSI "999C", 6) != 6) goto failed;
-        cols = getCursorPosition(ifd, ofd);
+        cols = getCursorPosition(ses);
         if (cols == -1) goto failed;
 
         /* Restore position. */
@@ -238,396 +287,1363 @@ getColumns (int ifd, int ofd)
     return 80;
 }
 
+/*
+ * Output while editing goes into the session's frame, and is written by
+ * lnSessionFlush() once the keys at hand have been handled.
+ */
+static void
+lnOutput (lnSession *ses, const char *s, size_t len)
+{
+    ses->ses_frame += string_view(s, len);
+}
+
+/*
+ * Write out the frame, in one write() unless ofd takes less.  On a
+ * non-blocking ofd that's full the rest is kept for the next flush, or
+ * with wait, ofd is polled until it takes it all.  Returns the bytes
+ * left to write, or -1 on a write error, when the frame is dropped.
+ */
+ssize_t
+lnSessionFlush (lnSession *ses, int wait)
+{
+    string_fmt_c &frame = ses->ses_frame;
+
+    while (ses->ses_frame_sent < frame.size()) {
+	ssize_t n = write(ses->ses_ofd, frame.data() + ses->ses_frame_sent,
+			  frame.size() - ses->ses_frame_sent);
+
+	ses->ses_stats.lns_write_calls++;
+	if (n > 0) {
+	    ses->ses_stats.lns_write_bytes += n;
+	    ses->ses_frame_sent += n;
+	    continue;
+	}
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+	    struct pollfd pfd = { ses->ses_ofd, POLLOUT, 0 };
+
+	    ses->ses_stats.lns_write_blocked++;
+	    if (!wait)
+		return frame.size() - ses->ses_frame_sent;
+	    poll(&pfd, 1, -1);
+	    continue;
+	}
+
+	/* Can't recover from a write error */
+	frame.clear();
+	ses->ses_frame_sent = 0;
+	return -1;
+    }
+    frame.clear();
+    ses->ses_frame_sent = 0;
+    return 0;
+}
+
 /* Clear the screen. Used to handle ctrl+l */
 void
-lnClearScreen (linenoiseState *ls UNUSED)
+lnClearScreen (linenoiseState *ls)
 {
-    if (write(STDOUT_FILENO, CSI "H" CSI "2J", 7) <= 0) {
-        /* nothing to do, just to avoid warning. */
-    }
+    ls->ses->ses_screen_valid = 0;
+    ls->ses->ses_screen_row = 0;
+    ls->ses->ses_rows.clear();
+    ls->ses->ses_row_attrs.clear();
+    lnOutput(ls->ses, CSI "H" CSI "2J", 7);
 }
 
 /* Beep, used for completion when there is nothing to complete or when all
  * the choices were already shown. */
 static void
-lnBeep (void)
+lnBeep (struct linenoiseState *ls)
+{
+    lnOutput(ls->ses, "\x7", 1);
+}
+
+/* The line as a C string, for callbacks and for returning it. */
+static const char *
+lnLine (struct linenoiseState *ls)
+{
+    return ls->line->c_str();
+}
+
+/*
+ * Multi-line mode: back to the prompt's row, forgetting the rows
+ * below, to draw the line afresh or something else in its place.
+ */
+static void
+lnScreenTop (struct linenoiseState *ls, string_fmt_c &ab)
 {
-    fprintf(stderr, "\x7");
-    fflush(stderr);
+    lnSession *ses = ls->ses;
+
+    if (ses->ses_screen_row > 1)
+	ab.append(CSI "%zuA"_fmt, ses->ses_screen_row);
+    else if (ses->ses_screen_row)
+	ab += CSI "A";
+    ses->ses_screen_row = 0;
+    ses->ses_rows.clear();
+    ses->ses_row_attrs.clear();
 }
 
 static void
 refreshHistorySearch (struct linenoiseState *ls)
 {
-    char prompt[LN_MAX_LINE];
-    char line[LN_MAX_LINE];
-    string_fmt_c ab;
+    string_fmt_c &ab = ls->ses->ses_frame;
+    auto &history = ls->ses->ses_history;
+    size_t start, pcols;
 
     unsigned hi = history.size() - ls->history_index  - 1;
 
-    snprintf(prompt, sizeof(prompt),
-	     "(history-i-search [%d]) '%s': ", ls->history_index, ls->buf);
-    snprintf(line, sizeof(line), "%s%s", prompt, history[hi].c_str());
+    ls->ses->ses_screen_valid = 0;
 
-    ab = CSI "0G";
-    ab += line;
-    ab += CSI "0K";  /* Erase Right */
+    /* The prompt goes straight into the frame, its cols from there */
+    lnScreenTop(ls, ab);
+    ab += CSI "0G";
+    start = ab.size();
+    ab.append("(history-i-search [%d]) '%s': "_fmt, ls->history_index, lnLine(ls));
+    pcols = utf8Columns(string_view(ab).substr(start));
+    ab += history[hi];
+    /* Erase Right, and the rest of a multi-line edit */
+    ab += ls->ses->ses_multiline ? CSI "0J" : CSI "0K";
 
     /* Move cursor to original position. */
-    ab.append(CSI "0G" CSI "%dC", (int) (strlen(prompt)));
-
-    write(ls->ofd, ab.c_str(), ab.size());
+    ab.append(CSI "0G" CSI "%zuC"_fmt, pcols);
 }
 
+/*
+ * The fuzzy finder's pattern on the prompt line and its best matches
+ * on the rows below, the highlighted one marked with '>'.
+ */
 static void
-lnYankSet (const char *str, int left, int right)
+refreshFuzzy (struct linenoiseState *ls)
 {
-    string tmp_buf = str;
+    auto &history = ls->ses->ses_history;
+    string_fmt_c &ab = ls->ses->ses_frame;
+    size_t start, pcols;
+    int rows = 0;
+
+    ls->ses->ses_screen_valid = 0;
+
+    lnScreenTop(ls, ab);
+    ab += CSI "0G";
+    start = ab.size();
+    ab.append("(fuzzy-search) '%s': "_fmt, lnLine(ls));
+    pcols = utf8Columns(string_view(ab).substr(start));
+    ab += CSI "0K";
+
+    for (auto &hit : ls->ses->ses_fuzzy_hits) {
+	size_t i = hit.fh_seq - history.seq(0);
+
+	if (hit.fh_seq < history.seq(0) || i >= history.size())
+	    continue;
+	ab += "\r\n";
+	ab += rows == ls->fuzzy_sel ? "> " : "  ";
+	ab += history[i].substr(0, ls->cols > 3 ? ls->cols - 3 : 0);
+	ab += CSI "0K";
+	rows++;
+    }
+    ab += CSI "0J";	/* Erase rows left by a longer list */
 
-    yank_buffer = tmp_buf.substr(left, right - left);
+    /* Move cursor back to the end of the pattern. */
+    if (rows)
+	ab.append(CSI "%dA"_fmt, rows);
+    ab.append(CSI "0G" CSI "%zuC"_fmt, pcols);
 }
 
-/* Single line low level line refresh.
- *
- * Rewrite the currently edited line accordingly to the buffer content,
- * cursor position, and number of columns of the terminal. */
 static void
-refreshSingleLine (struct linenoiseState *ls)
+lnYankSet (struct linenoiseState *ls, int left, int right)
 {
-    if (ls->history_search) {
-	refreshHistorySearch(ls);
-	return;
-    }
-    size_t plen = strlen(ls->prompt);
-    int fd = ls->ofd;
-    char *buf = ls->buf;
-    size_t len = ls->len;
-    size_t pos = ls->pos;
-    string_fmt_c ab;
+    ls->ses->ses_yank_buffer.clear();
+    ls->line->copy(left, right - left, ls->ses->ses_yank_buffer);
+}
 
-    while ((plen + pos) >= ls->cols) {
-        buf++;
-        len--;
-        pos--;
-    }
-    while ((plen + len) > ls->cols) {
-        len--;
-    }
+static size_t
+lnDigits (size_t n)
+{
+    size_t d = 1;
 
-    /* Cursor to left edge */
-    ab = CSI "0G";
+    while (n >= 10) {
+	n /= 10;
+	d++;
+    }
+    return d;
+}
 
-    /* Write the prompt and the current buffer content */
-    ab += ls->prompt;
-    ab += buf;
+/*
+ * Bytes to move the cursor from cur to col on the line, the shortest
+ * way: backspaces or rewriting what's shown for a step or three, else
+ * a relative or an absolute move.  Only an absolute move is safe after
+ * the last column was written, the cursor may be waiting to wrap.
+ */
+static size_t
+lnScreenMoveCost (struct linenoiseState *ls, size_t cur, size_t col, bool *absolute = NULL)
+{
+    size_t d = cur > col ? cur - col : col - cur;
+    size_t rel = d <= 3 ? d : 3 + lnDigits(d);
+    size_t abs = col ? 3 + lnDigits(col + 1) : 1;
+    bool use_abs = cur >= ls->cols || abs < rel;
 
-    /* Erase to right */
-    ab += CSI "0K";
+    if (absolute) *absolute = use_abs;
+    return use_abs ? abs : rel;
+}
 
-    /* Move cursor to original position. */
-    ab.append(CSI "0G" CSI "%dC", (int) (pos + plen));
+static void
+lnScreenMove (struct linenoiseState *ls, string_fmt_c &ab, size_t col)
+{
+    lnSession *ses = ls->ses;
+    size_t cur = ses->ses_screen_col;
+    size_t d = cur > col ? cur - col : col - cur;
+    bool absolute;
 
-    if (write(fd, ab.c_str(), ab.size()) == -1) {} /* Can't recover from write error. */
+    if (cur == col)
+	return;
+    lnScreenMoveCost(ls, cur, col, &absolute);
+    ses->ses_screen_col = col;
+
+    if (absolute) {
+	if (col)
+	    ab.append(CSI "%zuG"_fmt, col + 1);
+	else
+	    ab += '\r';
+    } else if (cur > col) {
+	if (d > 3)
+	    ab.append(CSI "%zuD"_fmt, d);
+	else
+	    while (d--) ab += '\b';
+    } else {
+	const string &screen = ses->ses_screen;
+	string_view attr = ses->ses_screen_attr;
+
+	/*
+	 * What's shown is only rewritten where cols are bytes, and up
+	 * to an ASCII char, not a mark that goes with the last one,
+	 * and where it's plain
+	 */
+	size_t n = min(col + 1, screen.size());
+
+	if (d > 3 || col > screen.size() || utf8AsciiPrefix(screen.data(), n) < n ||
+	    (!attr.empty() && attr.substr(cur, d).find_first_not_of('\0') != string_view::npos))
+	    ab.append(CSI "%zuC"_fmt, d);
+	else
+	    ab += string_view(screen).substr(cur, d);
+    }
 }
 
-/* Calls the two low level functions refreshSingleLine() or
- * refreshMultiLine() according to the selected mode. */
-static void
-refreshLine(struct linenoiseState *ls)
+/*
+ * The style of byte i of shown text, none is all plain.  Styles are
+ * indices into the session's highlight_cache_c.
+ */
+static inline char
+lnAttr (string_view attr, size_t i)
 {
-    refreshSingleLine(ls);
+    return attr.empty() ? 0 : attr[i];
 }
 
-/* ============================== Completion ================================ */
+static bool
+lnSameAttr (string_view a, string_view b)
+{
+    if (a.size() == b.size())
+	return a == b;
+    return (a.empty() ? b : a).find_first_not_of('\0') == string_view::npos;
+}
 
-static string
-longestMatch (std::vector<lnCompletion> *lc)
+/* Write n bytes of line from p in their styles, plain again after. */
+static void
+lnScreenPut (struct linenoiseState *ls, string_fmt_c &ab, string_view line,
+	     string_view attr, size_t p, size_t n)
 {
-    const char *s;
-    string longest;
+    const highlight_cache_c &hl = ls->ses->ses_hl;
+    char cur = 0;
 
-    if (lc->size() <= 0) return "";
-    
-    longest = (*lc)[0].lnc_token;
-    for (auto comp : (*lc)) {
-	s = comp.lnc_token.c_str();
-	while (longest.size() &&
-	       longest.compare(0, longest.size(), s, longest.size())) {
-	    longest = longest.substr(0, longest.size() - 1);
+    if (attr.empty()) {
+	ab += line.substr(p, n);
+	return;
+    }
+    for (size_t i = p, run; i < p + n; i = run) {
+	for (run = i + 1; run < p + n && attr[run] == attr[i]; run++)
+	    ;
+	if (attr[i] != cur) {
+	    cur = attr[i];
+	    if (cur)
+		ab.append(CSI "0;%sm"_fmt, hl.sgr(cur));
+	    else
+		ab += CSI "0m";
 	}
-	if (longest.size() == 0)
-	    break;
+	ab += line.substr(i, run - i);
     }
-	
-    return longest;
+    if (cur)
+	ab += CSI "0m";
 }
 
+/*
+ * Change the line the terminal shows to line, styled by attr, writing
+ * only what differs.  Past the common prefix, a run of chars inserted
+ * or deleted before a common suffix is done with ICH/DCH when that, and
+ * moving to the cursor's col after, is shorter than writing the rest of
+ * the line again; a run as wide as the one it replaces, a token that
+ * changed style say, is written over it.  With UTF-8 on either side the
+ * prefix and suffix stop where a char starts in both, and the counts
+ * become columns.
+ */
 static void
-helpLine (struct linenoiseState *ls)
+lnScreenUpdate (struct linenoiseState *ls, string_fmt_c &ab, string_view line,
+		string_view attr, size_t col)
 {
-    std::vector<lnCompletion> lc;
-    unsigned int max_cols, max_rows;
-    
-    getColRow(max_cols, max_rows);
-    completionCallback(ls->buf, (void **) &lc);
+    lnSession *ses = ls->ses;
+    string &screen = ses->ses_screen;
+    string_view shown = screen, was = ses->ses_screen_attr;
+    size_t p = 0, s = 0;
+
+    while (p < screen.size() && p < line.size() && screen[p] == line[p] &&
+	   lnAttr(was, p) == lnAttr(attr, p))
+	p++;
+    if (p == screen.size() && p == line.size())
+	return;
+    while (s < screen.size() - p && s < line.size() - p &&
+	   screen[screen.size() - 1 - s] == line[line.size() - 1 - s] &&
+	   lnAttr(was, screen.size() - 1 - s) == lnAttr(attr, line.size() - 1 - s))
+	s++;
+
+    size_t gone = screen.size() - p - s, added = line.size() - p - s;
+    size_t pcol = p, line_cols = line.size(), screen_cols = screen.size();
+    size_t gone_cols = gone, added_cols = added;
+
+    if (!utf8IsAscii(shown) || !utf8IsAscii(line)) {
+	while (!utf8IsBoundary(shown, shown.size(), p) ||
+	       !utf8IsBoundary(line, line.size(), p))
+	    p--;
+	while (!utf8IsBoundary(shown, shown.size(), shown.size() - s) ||
+	       !utf8IsBoundary(line, line.size(), line.size() - s))
+	    s--;
+	gone = screen.size() - p - s;
+	added = line.size() - p - s;
+	pcol = utf8Columns(line.substr(0, p));
+	gone_cols = utf8Columns(shown.substr(p, gone));
+	added_cols = utf8Columns(line.substr(p, added));
+	line_cols = pcol + utf8Columns(line.substr(p));
+	screen_cols = pcol + utf8Columns(shown.substr(p));
+    }
 
-    if (lc.size() == 0) {
-	printf("\r\n *no-match*");
+    size_t rewrite = line.size() - p + (line_cols < screen_cols ? 3 : 0) +
+	lnScreenMoveCost(ls, line_cols, col);
+    size_t ich = 3 + (added_cols > 1 ? lnDigits(added_cols) : 0) + added +
+	lnScreenMoveCost(ls, pcol + added_cols, col);
+    size_t dch = 3 + (gone_cols > 1 ? lnDigits(gone_cols) : 0) +
+	lnScreenMoveCost(ls, pcol, col);
+
+    lnScreenMove(ls, ab, pcol);
+    if (s && !gone && added_cols && ich < rewrite) {
+	if (added_cols > 1)
+	    ab.append(CSI "%zu@"_fmt, added_cols);
+	else
+	    ab += CSI "@";
+	lnScreenPut(ls, ab, line, attr, p, added);
+	ses->ses_screen_col = pcol + added_cols;
+    } else if (s && !added && gone_cols && dch < rewrite) {
+	if (gone_cols > 1)
+	    ab.append(CSI "%zuP"_fmt, gone_cols);
+	else
+	    ab += CSI "P";
+    } else if (s && added && added_cols == gone_cols) {
+	lnScreenPut(ls, ab, line, attr, p, added);
+	ses->ses_screen_col = pcol + added_cols;
     } else {
-	// maximum rows to display is the screen rows less
-	// 1 for prompt and 1 for the '... more ...' msg
-	if (max_rows > 1) max_rows -= 2;
-
-	unsigned int i = 0;
-	for (auto comp : lc) {
-	    if (i >= max_rows) break;
-	    auto tok = comp.lnc_token.c_str();
-	    auto help = comp.lnc_help.c_str();
-	    printf("\r\n %-20s %s", tok, help);
-	    wndebug("help %d - %s\n", i, tok);
-	    i++;
-        }
-	if (lc.size() >= max_rows) {
-	    printf("\r\n      ... more ...");
-	    wndebug("need more\n");
-	}
+	lnScreenPut(ls, ab, line, attr, p, line.size() - p);
+	if (line_cols < screen_cols)
+	    ab += CSI "K";
+	ses->ses_screen_col = line_cols;
     }
-    printf("\n\r");
-    fflush(stdout);
-
-    refreshSingleLine(ls);
-    fflush(stdout);
+    screen = line;
+    ses->ses_screen_attr = attr;
 }
 
-/* This is an helper function for lnEdit() and is called when the
- * user types the <tab> key in order to complete the string currently in the
- * input.
- * 
- * The state of the editing is encapsulated into the pointed linenoiseState
- * structure as described in the structure definition. */
+/*
+ * Bring the highlighting up to date before a refresh.  The callback
+ * is handed the line from where restart() says, just before the
+ * edits since the last refresh, with the gap moved there so that's
+ * cheap, and the hint is asked for again if the line changed.
+ */
 static void
-completeLine (struct linenoiseState *ls)
+lnHighlight (struct linenoiseState *ls)
 {
-    std::vector<lnCompletion> lc;
-    int nread, nwritten;
-    char c = 0;
-
-    if (!completionCallback) return;
-
-    completionCallback(ls->buf, (void **) &lc);
-    if (lc.size() == 0) {
-        lnBeep();
-    } else {
-        size_t stop = 0;
-	auto longest = longestMatch(&lc);
-
-	wndebug("longest: %s\n", longest.c_str());
-
-	nwritten = snprintf(ls->buf, ls->buflen, "%s", longest.c_str());
-	ls->len = ls->pos = nwritten;
-	refreshLine(ls);
+    lnSession *ses = ls->ses;
+    highlight_cache_c &hl = ses->ses_hl;
 
-        while (!stop) {
-            nread = read(ls->ifd, &c, 1);
-            if (nread <= 0) {
-		assert(0);
-            }
+    if (ses->ses_highlight && hl.dirty()) {
+	int state;
+	size_t from = hl.restart(&state);
+	string_view text = ls->line->tail(from);
 
-            switch (c) {
-	    case TAB:
-		lnBeep();
-	    case '?':
-		helpLine(ls);
-		break;
-	    default:
-		stop = 1;
-		break;
-            }
-        }
+	if (!text.empty())
+	    ses->ses_highlight(text.data(), text.size(), state, &hl);
+	hl.end();
     }
+    if (ses->ses_hint && ses->ses_hint_stale && ls->pos == ls->len) {
+	const char *style = NULL;
+	const char *hint = ses->ses_hint(lnLine(ls), &style);
 
-    lnPushChar(c);
+	ses->ses_hint_text = hint ? hint : "";
+	ses->ses_hint_style = hl.style(style ? style : "2");
+	ses->ses_hint_stale = 0;
+    }
 }
 
-/* Register a callback function to be called for tab-completion. */
-void
-linenoiseSetCompletionCallback (linenoiseCompletionFunc fn)
+/*
+ * Append as much of the hint as fits in room cols to the line, when
+ * the cursor is at its end.  Returns the cols it takes.
+ */
+static size_t
+lnHintAppend (struct linenoiseState *ls, string &line, string &attr, size_t room)
 {
-    completionCallback = fn;
-}
-
+    lnSession *ses = ls->ses;
+    string_view hint = ses->ses_hint_text;
+    size_t n = 0, cols = 0, next;
 
-/* This function is used by the callback function registered by the user
- * in order to add completion options given the input string when the
- * user typed <tab>. See the example.c source code for a very easy to
- * understand example. */
-void
-linenoiseAddCompletion (linenoiseCompletions opaque, const char *str, const char *help)
-{
-    auto lc = reinterpret_cast<std::vector<lnCompletion> *>(opaque);
-    lc->push_back(lnCompletion(str, help));
-}
+    if (!ses->ses_hint || ses->ses_hint_stale || ls->pos != ls->len ||
+	ls->edit_done || hint.empty())
+	return 0;
 
+    if (utf8IsAscii(hint)) {
+	n = cols = min(room, hint.size());
+    } else {
+	while (n < hint.size()) {
+	    size_t w = utf8ClusterWidth(hint, hint.size(), n, &next);
 
-/* =========================== Line editing ================================= */
+	    if (cols + w > room)
+		break;
+	    cols += w;
+	    n = next;
+	}
+    }
+    attr.resize(line.size(), 0);
+    line.append(hint.substr(0, n));
+    attr.append(n, ses->ses_hint_style);
+    return cols;
+}
 
-/* Insert the character 'c' at cursor current position.
+/* Single line low level line refresh.
  *
- * On error writing to the terminal -1 is returned, otherwise 0. */
-int
-lnEditInsert (struct linenoiseState *ls, char c)
+ * Draw the currently edited line accordingly to the buffer content,
+ * cursor position, and number of columns of the terminal.  What the
+ * terminal shows is kept in ses_screen, so typing at the end of the
+ * line only writes the char, motion only moves the cursor, and a key
+ * that changes nothing writes nothing.  Anything else that writes to
+ * the terminal clears ses_screen_valid, for the whole line to be
+ * redrawn. */
+static void
+refreshSingleLine (struct linenoiseState *ls)
 {
-    if (c <= ESC) return 0;
-
-    if (ls->len < ls->buflen) {
-        if (ls->len == ls->pos) {
-            ls->buf[ls->pos] = c;
-            ls->pos++;
-            ls->len++;
-            ls->buf[ls->len] = '\0';
-        } else {
-            memmove(ls->buf + ls->pos + 1, ls->buf + ls->pos, ls->len - ls->pos);
-            ls->buf[ls->pos] = c;
-            ls->len++;
-            ls->pos++;
-            ls->buf[ls->len] = '\0';
-        }
-    }
-
     if (ls->history_search) {
-	ls->history_index = 0;
-	lnEditHistorySearchPrev(ls);
+	refreshHistorySearch(ls);
+	return;
+    }
+    if (ls->fuzzy) {
+	refreshFuzzy(ls);
+	return;
     }
+    lnSession *ses = ls->ses;
+    const gap_buffer_c &buf = *ls->line;
+    size_t plen = ls->plen;
+    size_t start = 0, end = ls->len;	/* of the buffer, shown */
+    size_t col, width;			/* the cursor's col, the line's */
+    string &line = ses->ses_screen_next;
+    string &attr = ses->ses_screen_next_attr;
+    string_fmt_c &ab = ses->ses_frame;
+
+    lnHighlight(ls);
+
+    if (ls->pcols == plen && buf.ascii()) {
+	/* Scroll the window so the cursor is on the screen */
+	if (plen + ls->pos >= ls->cols)
+	    start = min(ls->pos, plen + ls->pos - ls->cols + 1);
+	if (plen + end - start > ls->cols)
+	    end = start + (ls->cols > plen ? ls->cols - plen : 0);
+	col = plen + ls->pos - start;
+	width = plen + end - start;
+    } else {
+	/* The same in columns, whole clusters at a time */
+	size_t next;
+
+	col = ls->pcols;
+	for (size_t i = 0; i < ls->pos; i = next)
+	    col += utf8ClusterWidth(buf, ls->len, i, &next);
+	while (col >= ls->cols && start < ls->pos) {
+	    col -= utf8ClusterWidth(buf, ls->len, start, &next);
+	    start = next;
+	}
+	width = col;
+	for (end = ls->pos; end < ls->len; end = next) {
+	    size_t w = utf8ClusterWidth(buf, ls->len, end, &next);
 
-    refreshLine(ls);
-    return 0;
-}
+	    if (width + w > ls->cols)
+		break;
+	    width += w;
+	}
+    }
 
-/* Move cursor on the left. */
-void
-lnEditMoveLeft (struct linenoiseState *ls)
-{
-    if (ls->pos > 0) {
-        ls->pos--;
+    line.assign(ls->prompt, plen);
+    buf.copy(start, end - start, line);
+    attr.clear();
+    if (ses->ses_highlight) {
+	attr.assign(plen, 0);
+	ses->ses_hl.attrs(start, end - start, attr);
     }
+    if (end == ls->len)
+	width += lnHintAppend(ls, line, attr, width < ls->cols ? ls->cols - width : 0);
+
+    if (!ses->ses_screen_valid) {
+	/* Cursor to left edge, the line, erase to right */
+	ab += CSI "0G";
+	lnScreenPut(ls, ab, line, attr, 0, line.size());
+	ab += CSI "0K";
+	ses->ses_screen = line;
+	ses->ses_screen_attr = attr;
+	ses->ses_screen_col = width;
+	ses->ses_screen_valid = 1;
+    } else {
+	lnScreenUpdate(ls, ab, line, attr, col);
+    }
+
+    /* Move cursor to original position. */
+    lnScreenMove(ls, ab, col);
 }
 
-/* Move cursor on the right. */
-void
-lnEditMoveRight (struct linenoiseState *ls)
+/*
+ * Multi-line mode: move the cursor to row, counted from the prompt's.
+ * ses_screen is the row the cursor is on, so it's swapped with the
+ * row's in ses_rows.  Rows down are reached with newlines, so going
+ * past the bottom of the screen scrolls it.
+ */
+static void
+lnScreenRow (struct linenoiseState *ls, string_fmt_c &ab, size_t row)
 {
-    if (ls->pos != ls->len) {
-        ls->pos++;
+    lnSession *ses = ls->ses;
+    size_t cur = ses->ses_screen_row;
+
+    if (row == cur)
+	return;
+    if (row > cur) {
+	for (size_t i = cur; i < row; i++)
+	    ab += "\r\n";
+	ses->ses_screen_col = 0;
+    } else if (cur - row > 1) {
+	ab.append(CSI "%zuA"_fmt, cur - row);
+    } else {
+	ab += CSI "A";
     }
+    swap(ses->ses_screen, ses->ses_rows[cur]);
+    swap(ses->ses_screen, ses->ses_rows[row]);
+    swap(ses->ses_screen_attr, ses->ses_row_attrs[cur]);
+    swap(ses->ses_screen_attr, ses->ses_row_attrs[row]);
+    ses->ses_screen_row = row;
 }
 
-static int
-isWordSep (int ch)
+/*
+ * Multi-line mode: to the line's last row, so what's written next goes
+ * below it.  The line is drawn afresh after that.
+ */
+static void
+lnScreenBottom (struct linenoiseState *ls, string_fmt_c &ab)
 {
-    return !isalnum(ch);
+    lnSession *ses = ls->ses;
+
+    if (ses->ses_rows.size() > 1)
+	lnScreenRow(ls, ab, ses->ses_rows.size() - 1);
+    ses->ses_screen_row = 0;
+    ses->ses_rows.clear();
+    ses->ses_row_attrs.clear();
+    ses->ses_screen_valid = 0;
 }
 
+/* Multi-line low level line refresh.
+ *
+ * The prompt and buffer wrap onto as many rows as they need.  Each row
+ * as shown is kept, and only the rows that differ from what they
+ * should show are drawn, by lnScreenUpdate() writing just what changed
+ * in them: an edit on one row of a long command leaves the rows before
+ * it alone, and rows the line no longer reaches are erased. */
 static void
-lnMoveWord (struct linenoiseState *ls, int dir)
+refreshMultiLine (struct linenoiseState *ls)
 {
-    if ((int) ls->pos + dir < 0) return;
-    if ((int) ls->pos + dir >= (int) ls->len) return;
+    lnSession *ses = ls->ses;
+    size_t plen = ls->plen;
+    size_t cols = ls->cols ? ls->cols : 1;
+    size_t cur = plen + ls->pos;
+    size_t crow, ccol, nrows;
+    string &text = ses->ses_screen_next;
+    string &attr = ses->ses_screen_next_attr;
+    string_fmt_c &ab = ses->ses_frame;
+    auto &rows = ses->ses_rows;
+    auto &starts = ses->ses_row_starts;
+    bool ascii;
+
+    lnHighlight(ls);
+    text.assign(ls->prompt, plen);
+    ls->line->copy(0, ls->len, text);
+    attr.clear();
+    if (ses->ses_highlight) {
+	attr.assign(plen, 0);
+	ses->ses_hl.attrs(0, ls->len, attr);
+    }
+    lnHintAppend(ls, text, attr, SIZE_MAX);
+    ascii = ls->pcols == plen && ls->line->ascii() &&
+	utf8IsAscii(string_view(text).substr(plen + ls->len));
+
+    /* Where each row starts, a wide char that doesn't fit goes below */
+    starts.assign(1, 0);
+    if (ascii) {
+	for (size_t i = cols; i < text.size(); i += cols)
+	    starts.push_back(i);
+    } else {
+	size_t w = 0, next;
 
-    ls->pos += dir;
-    while (ls->pos > 0 && ls->pos != ls->len && isWordSep(ls->buf[ls->pos]))
-	ls->pos += dir;
+	for (size_t i = 0; i < text.size(); i = next) {
+	    size_t cw = utf8ClusterWidth(string_view(text), text.size(), i, &next);
 
-    while (ls->pos > 0 && ls->pos != ls->len && !isWordSep(ls->buf[ls->pos-1]))
-	ls->pos += dir;
-}
+	    if (w + cw > cols && w) {
+		starts.push_back(i);
+		w = 0;
+	    }
+	    w += cw;
+	}
+    }
+    crow = upper_bound(starts.begin(), starts.end(), cur) - starts.begin() - 1;
+    ccol = cur - starts[crow];
+    if (!ascii)
+	ccol = utf8Columns(string_view(text).substr(starts[crow], ccol));
+    if (ccol >= cols) {
+	/* At the end of a full row, on the next one */
+	crow++;
+	ccol = 0;
+    }
+    nrows = max(starts.size(), crow + 1);
+
+    if (!ses->ses_screen_valid) {
+	/* From the prompt's row, erase it and all below */
+	lnScreenTop(ls, ab);
+	ab += "\r" CSI "0J";
+	ses->ses_screen.clear();
+	ses->ses_screen_attr.clear();
+	ses->ses_screen_col = 0;
+	ses->ses_screen_valid = 1;
+    }
+    if (rows.size() < nrows) {
+	rows.resize(nrows);
+	ses->ses_row_attrs.resize(nrows);
+    }
 
-static void
-lnEditMoveLeftWord (struct linenoiseState *ls)
-{
-    lnMoveWord(ls, -1);
+    for (size_t r = 0; r < rows.size(); r++) {
+	bool on = r == ses->ses_screen_row;
+	string_view want, want_attr;
+
+	if (r < starts.size()) {
+	    size_t end = r + 1 < starts.size() ? starts[r + 1] : text.size();
+
+	    want = string_view(text).substr(starts[r], end - starts[r]);
+	    if (!attr.empty())
+		want_attr = string_view(attr).substr(starts[r], end - starts[r]);
+	}
+	if (want == (on ? ses->ses_screen : rows[r]) &&
+	    lnSameAttr(want_attr, on ? ses->ses_screen_attr : ses->ses_row_attrs[r]))
+	    continue;
+	lnScreenRow(ls, ab, r);
+	lnScreenUpdate(ls, ab, want, want_attr, r == crow ? ccol : cols);
+	ses->ses_stats.lns_rows_drawn++;
+    }
+
+    /* Move cursor to original position. */
+    lnScreenRow(ls, ab, crow);
+    lnScreenMove(ls, ab, ccol);
+    rows.resize(nrows);
+    ses->ses_row_attrs.resize(nrows);
 }
 
+/* Calls the two low level functions refreshSingleLine() or
+ * refreshMultiLine() according to the selected mode. */
 static void
-lnEditMoveRightWord (struct linenoiseState *ls)
+refreshLine(struct linenoiseState *ls)
 {
-    lnMoveWord(ls, 1);
+    if (ls->ses->ses_multiline && !ls->history_search && !ls->fuzzy)
+	refreshMultiLine(ls);
+    else
+	refreshSingleLine(ls);
 }
 
-static void
-lnEditMoveHome (struct linenoiseState *ls)
+/* ============================== Completion ================================ */
+
+/*
+ * The completions for the buffer, from the cache if it's on.  NULL
+ * while async completions are still being asked for.  The callback
+ * fills the session's set, which the cache swaps with its old one, so
+ * both arenas are reused.
+ */
+static completion_cache_c *
+lnCompletions (struct linenoiseState *ls)
 {
-    ls->pos = 0;
+    lnSession *ses = ls->ses;
+    completion_cache_c &lc = ses->ses_complete_cache;
+    completion_async_c *async = ses->ses_complete_async.get();
+    completion_set_c &set = ses->ses_complete_set;
+    completion_req_s req;
+
+    if (!ses->ses_complete_cache_on)
+	lc.clear();
+    if (lc.find(lnLine(ls)))
+	return &lc;
+
+    set.clear();
+    if (!async) {
+	req.cr_set = &set;
+	req.cr_async = NULL;
+	req.cr_gen = 0;
+	req.cr_offset = req.cr_limit = req.cr_seen = 0;
+	ses->ses_completion(lnLine(ls), (void **) &req);
+    } else if (!async->results(lnLine(ls), set)) {
+	async->start(ses->ses_completion, lnLine(ls));
+	return NULL;
+    }
+    lc.fill(lnLine(ls), set);
+    return &lc;
 }
 
+/*
+ * With async completion, a TAB or '?' still waiting is dropped when the
+ * buffer changes, as is the request for it.  With prefetch, the new
+ * buffer's completions are asked for straight away instead.
+ */
 static void
-lnEditMoveEnd (struct linenoiseState *ls)
+lnEditCompleteChanged (struct linenoiseState *ls)
 {
-    ls->pos = ls->len;
+    lnSession *ses = ls->ses;
+    completion_async_c *async = ses->ses_complete_async.get();
+
+    if (!async || !ses->ses_completion || async->wanted(lnLine(ls)))
+	return;
+
+    ls->complete_wait = 0;
+    if (!ses->ses_complete_prefetch)
+	async->cancel();
+    else if (!ses->ses_complete_cache_on || !ses->ses_complete_cache.covers(lnLine(ls)))
+	async->start(ses->ses_completion, lnLine(ls));
 }
 
-/* Substitute the currently edited line with the next or previous history
- * entry as specified by 'dir'. */
-static void
-editHistoryNext (struct linenoiseState *ls, int dir)
+static string_view
+longestMatch (const completion_cache_c &lc)
 {
-    int *history_index = &ls->history_index;
+    size_t len;
 
-    if (history.size() > 1) {
-	auto history_len = (int) history.size();
+    if (lc.size() <= 0) return "";
+    
+    string_view first = lc[0].lnc_token;
 
-        /* Update the current history entry before to
+    len = first.size();
+    for (size_t i = 1; i < lc.size() && len; i++) {
+	string_view tok = lc[i].lnc_token;
+	size_t n = 0;
+
+	while (n < len && n < tok.size() && tok[n] == first[n])
+	    n++;
+	len = n;
+    }
+	
+    return first.substr(0, len);
+}
+
+/*
+ * List a page of the completions, from help_offset.  Pressing '?' again
+ * while there are more lists the next page.  Only the page is asked
+ * for where that can be done: the dictionary skips to it, and a
+ * callback that's called inline for the listing stops being fed once
+ * linenoiseAddCompletion() has the page.
+ */
+static void
+helpLine (struct linenoiseState *ls)
+{
+    lnSession *ses = ls->ses;
+    unsigned int max_cols, max_rows, shown = 0;
+    size_t offset = ls->help_offset, total = 0;
+    bool more = false;
+    string_fmt_c &ab = ses->ses_frame;
+
+    if (!ses->ses_completion && !ses->ses_dict.size()) return;
+
+    // maximum rows to display is the screen rows less
+    // 1 for prompt and 1 for the '... more ...' msg
+    getColRow(ls, max_cols, max_rows);
+    if (max_rows > 1) max_rows -= 2;
+
+    auto show = [&] (string_view tok, string_view help) {
+	if (shown >= max_rows) {
+	    more = true;
+	    return false;
+	}
+	if (!shown)
+	    lnScreenBottom(ls, ab);
+	ab.append("\r\n %-20.*s %.*s"_fmt, (int) tok.size(), tok.data(),
+		  (int) help.size(), help.data());
+	wndebug("help %d - %.*s\n", shown, (int) tok.size(), tok.data());
+	shown++;
+	return true;
+    };
+
+    /* The dictionary stops listing once the screen is full */
+    if (ses->ses_dict.size()) {
+	ses->ses_dict.find(lnLine(ls), std::ref(show), offset);
+	total = ses->ses_dict.count(lnLine(ls));
+    } else if (!ses->ses_complete_cache_on && !ses->ses_complete_async) {
+	completion_set_c &set = ses->ses_complete_set;
+	completion_req_s req;
+
+	/* One past the page, to know if there are more */
+	set.clear();
+	req.cr_set = &set;
+	req.cr_async = NULL;
+	req.cr_gen = 0;
+	req.cr_offset = offset;
+	req.cr_limit = max_rows + 1;
+	req.cr_seen = 0;
+	ses->ses_completion(lnLine(ls), (void **) &req);
+	for (size_t i = 0; i < set.size(); i++)
+	    if (!show(set[i].lnc_token, set[i].lnc_help))
+		break;
+    } else {
+	auto lc = lnCompletions(ls);
+
+	if (!lc) {
+	    ls->complete_wait = '?';
+	    return;
+	}
+	total = lc->size();
+	for (size_t i = offset; i < lc->size(); i++)
+	    if (!show((*lc)[i].lnc_token, (*lc)[i].lnc_help))
+		break;
+    }
+
+    /* Past the last page, start over */
+    if (shown == 0 && offset) {
+	ls->help_offset = 0;
+	helpLine(ls);
+	return;
+    }
+    if (!total && ses->ses_complete_count)
+	total = ses->ses_complete_count(lnLine(ls));
+
+    if (shown == 0) {
+	lnScreenBottom(ls, ab);
+	ab += "\r\n *no-match*";
+    } else if (more && total) {
+	ab.append("\r\n      ... %zu-%zu of %zu, ? for the next page ..."_fmt,
+		  offset + 1, offset + shown, total);
+    } else if (more) {
+	ab += "\r\n      ... more, ? for the next page ...";
+	wndebug("need more\n");
+    }
+    ab += "\n\r";
+    ls->help_offset = more ? offset + shown : 0;
+
+    /* The line is drawn again below the list */
+    ses->ses_screen_valid = 0;
+    refreshLine(ls);
+}
+
+/* This is an helper function for lnEdit() and is called when the
+ * user types the <tab> key in order to complete the string currently in the
+ * input.
+ * 
+ * The state of the editing is encapsulated into the pointed linenoiseState
+ * structure as described in the structure definition. */
+static void
+completeLine (struct linenoiseState *ls)
+{
+    lnSession *ses = ls->ses;
+    string &lcp = ses->ses_complete_lcp;
+    string_view longest;
+
+    if (!ses->ses_completion && !ses->ses_dict.size()) return;
+
+    /* TAB again after a completion lists the choices */
+    if (ls->completing) {
+	lnBeep(ls);
+	helpLine(ls);
+	return;
+    }
+
+    if (ses->ses_dict.size()) {
+	if (!ses->ses_dict.longest(lnLine(ls), lcp)) {
+	    lnBeep(ls);
+	    return;
+	}
+	longest = lcp;
+    } else {
+	auto lc = lnCompletions(ls);
+
+	if (!lc) {
+	    ls->complete_wait = TAB;
+	    return;
+	}
+	if (lc->size() == 0) {
+	    lnBeep(ls);
+	    return;
+	}
+	longest = longestMatch(*lc);
+    }
+    ls->help_offset = 0;
+
+    wndebug("longest: %.*s\n", (int) longest.size(), longest.data());
+
+    lnEditSetLine(ls, longest);
+    ls->pos = ls->len;
+    ls->completing = 1;
+}
+
+/* Register a callback function to be called for tab-completion. */
+void
+lnSessionSetCompletionCallback (lnSession *ses, linenoiseCompletionFunc fn)
+{
+    ses->ses_completion = fn;
+    ses->ses_complete_cache.clear();
+}
+
+void
+linenoiseSetCompletionCallback (linenoiseCompletionFunc fn)
+{
+    lnSessionSetCompletionCallback(lnDefaultSession(), fn);
+}
+
+/* An optional callback that says how many completions the buffer has,
+ * for the '?' pager to show which page it's on.  Only worth setting if
+ * it's cheap; the dictionary and the cache count their own. */
+void
+lnSessionSetCompletionCountCallback (lnSession *ses, linenoiseCompletionCountFunc fn)
+{
+    ses->ses_complete_count = fn;
+}
+
+void
+linenoiseSetCompletionCountCallback (linenoiseCompletionCountFunc fn)
+{
+    lnSessionSetCompletionCountCallback(lnDefaultSession(), fn);
+}
+
+/* Cache the completions by the buffer they were asked for, and narrow
+ * them down as the buffer grows instead of calling back.  Only for
+ * callbacks whose completions all start with the buffer. */
+void
+lnSessionSetCompletionCache (lnSession *ses, int on)
+{
+    ses->ses_complete_cache_on = on;
+    ses->ses_complete_cache.clear();
+}
+
+void
+linenoiseSetCompletionCache (int on)
+{
+    lnSessionSetCompletionCache(lnDefaultSession(), on);
+}
+
+/* Add a token to the session's completion dictionary, or replace its
+ * help.  While the dictionary has tokens, TAB and '?' complete from it
+ * and the completion callback isn't called. */
+void
+lnSessionDictAdd (lnSession *ses, const char *token, const char *help)
+{
+    ses->ses_dict.add(token, help ? help : "");
+}
+
+void
+linenoiseDictAdd (const char *token, const char *help)
+{
+    lnSessionDictAdd(lnDefaultSession(), token, help);
+}
+
+void
+lnSessionDictClear (lnSession *ses)
+{
+    ses->ses_dict.clear();
+}
+
+void
+linenoiseDictClear (void)
+{
+    lnSessionDictClear(lnDefaultSession());
+}
+
+/* Run the completion callback on a worker thread, so a slow one doesn't
+ * hold up the editor.  A TAB or '?' completes when the answer is in,
+ * unless the buffer has changed by then.  The callback has to be safe
+ * to call from another thread. */
+void
+lnSessionSetCompletionAsync (lnSession *ses, int on)
+{
+    if (!on) {
+	ses->ses_complete_async.reset();
+	ses->ses_complete_prefetch = 0;
+    } else if (!ses->ses_complete_async) {
+	int fd = lnSessionWakePipe(ses);
+
+	if (fd != -1)
+	    ses->ses_complete_async.reset(new completion_async_c(fd));
+    }
+}
+
+void
+linenoiseSetCompletionAsync (int on)
+{
+    lnSessionSetCompletionAsync(lnDefaultSession(), on);
+}
+
+/* Async completion that asks for the buffer's completions as it's typed,
+ * so TAB usually finds them ready. */
+void
+lnSessionSetCompletionPrefetch (lnSession *ses, int on)
+{
+    if (on) lnSessionSetCompletionAsync(ses, 1);
+    ses->ses_complete_prefetch = on && ses->ses_complete_async;
+}
+
+void
+linenoiseSetCompletionPrefetch (int on)
+{
+    lnSessionSetCompletionPrefetch(lnDefaultSession(), on);
+}
+
+/* Forget the cached completions, for when the callback's change. */
+void
+lnSessionCompletionCacheClear (lnSession *ses)
+{
+    ses->ses_complete_cache.clear();
+}
+
+void
+linenoiseCompletionCacheClear (void)
+{
+    lnSessionCompletionCacheClear(lnDefaultSession());
+}
+
+
+/* This function is used by the callback function registered by the user
+ * in order to add completion options given the input string when the
+ * user typed <tab>. See the example.c source code for a very easy to
+ * understand example.
+ *
+ * Returns 1 once the page being listed is full, when the callback can
+ * stop adding; further adds are ignored. */
+int
+linenoiseAddCompletion (linenoiseCompletions opaque, const char *str, const char *help)
+{
+    auto req = reinterpret_cast<completion_req_s *>(opaque);
+    size_t seen = req->cr_seen++;
+
+    if (req->cr_limit && seen >= req->cr_offset + req->cr_limit)
+	return 1;
+    if (seen >= req->cr_offset)
+	req->cr_set->add(str, help ? help : "");
+    return req->cr_limit && seen + 1 >= req->cr_offset + req->cr_limit;
+}
+
+/* For an async callback, true once its answer is no longer wanted. */
+int
+linenoiseCompletionCancelled (linenoiseCompletions opaque)
+{
+    auto req = reinterpret_cast<completion_req_s *>(opaque);
+
+    return req->cr_async && req->cr_async->cancelled(req);
+}
+
+
+/* ============================= Highlighting =============================== */
+
+/* Takes effect from the next refresh, the whole line is tokenized. */
+void
+lnSessionSetHighlightCallback (lnSession *ses, linenoiseHighlightFunc fn)
+{
+    ses->ses_highlight = fn;
+    ses->ses_hl.reset(ses->ses_state.len);
+}
+
+void
+linenoiseSetHighlightCallback (linenoiseHighlightFunc fn)
+{
+    lnSessionSetHighlightCallback(lnDefaultSession(), fn);
+}
+
+void
+lnSessionSetHintCallback (lnSession *ses, linenoiseHintFunc fn)
+{
+    ses->ses_hint = fn;
+    ses->ses_hint_stale = 1;
+}
+
+void
+linenoiseSetHintCallback (linenoiseHintFunc fn)
+{
+    lnSessionSetHintCallback(lnDefaultSession(), fn);
+}
+
+/*
+ * Used by the highlight callback for each token in turn.  Returns 1
+ * when it can stop, further adds are ignored.
+ */
+int
+linenoiseAddHighlight (linenoiseHighlights opaque, size_t len, const char *style, int state)
+{
+    return reinterpret_cast<highlight_cache_c *>(opaque)->add(len, style, state);
+}
+
+/* =========================== Line editing ================================= */
+
+/* The line changed, for the highlighting and the hint. */
+static void
+lnEditChanged (struct linenoiseState *ls, size_t pos, size_t erased, size_t inserted)
+{
+    ls->ses->ses_hl.edit(pos, erased, inserted);
+    ls->ses->ses_hint_stale = 1;
+}
+
+/* Put the chars in the buffer at the cursor. */
+static void
+lnEditPut (struct linenoiseState *ls, string_view chars)
+{
+    lnEditChanged(ls, ls->pos, 0, chars.size());
+    ls->line->insert(ls->pos, chars);
+    ls->pos += chars.size();
+    ls->len += chars.size();
+}
+
+/* Remove n chars at pos, the cursor is left where it was in the text. */
+static void
+lnEditErase (struct linenoiseState *ls, size_t pos, size_t n)
+{
+    lnEditChanged(ls, pos, n, 0);
+    ls->line->erase(pos, n);
+    ls->len -= n;
+    if (ls->pos > pos + n)
+	ls->pos -= n;
+    else if (ls->pos > pos)
+	ls->pos = pos;
+}
+
+/* Insert the character 'c' at cursor current position.
+ *
+ * On error writing to the terminal -1 is returned, otherwise 0. */
+int
+lnEditInsert (struct linenoiseState *ls, char c)
+{
+    unsigned char u = c;
+
+    if (u <= ESC) {
+	ls->utf8_len = 0;
+	return 0;
+    }
+
+    if (u < 0x80) {
+	ls->utf8_len = 0;
+	lnEditPut(ls, string_view(&c, 1));
+    } else {
+	/* The bytes of a UTF-8 char are gathered, it goes in whole */
+	if (utf8SeqLen(u))
+	    ls->utf8_len = 0;
+	else if (!ls->utf8_len)
+	    return 0;
+	ls->utf8_pend[ls->utf8_len++] = c;
+	if (ls->utf8_len < (int) utf8SeqLen(ls->utf8_pend[0]))
+	    return 0;
+	lnEditPut(ls, string_view(ls->utf8_pend, ls->utf8_len));
+	ls->utf8_len = 0;
+    }
+    if (ls->history_search) {
+	ls->history_index = 0;
+	lnEditHistorySearchPrev(ls);
+    }
+    if (ls->fuzzy)
+	lnEditFuzzyUpdate(ls);
+
+    refreshLine(ls);
+    return 0;
+}
+
+/* Replace the buffer with line. */
+static void
+lnEditSetLine (struct linenoiseState *ls, string_view line)
+{
+    ls->line->assign(line);
+    ls->len = line.size();
+    ls->ses->ses_hl.reset(ls->len);
+    ls->ses->ses_hint_stale = 1;
+    if (ls->pos > ls->len) ls->pos = ls->len;
+}
+
+/*
+ * Where the char after or before pos starts.  A char is a grapheme
+ * cluster, a byte while the line is all ASCII.
+ */
+static size_t
+lnNext (struct linenoiseState *ls, size_t pos)
+{
+    if (ls->line->ascii()) return pos + 1;
+    return utf8Next(*ls->line, ls->len, pos);
+}
+
+static size_t
+lnPrev (struct linenoiseState *ls, size_t pos)
+{
+    if (ls->line->ascii()) return pos - 1;
+    return utf8Prev(*ls->line, ls->len, pos);
+}
+
+/* The codepoint at pos, the first of its cluster. */
+static uint32_t
+lnCharAt (struct linenoiseState *ls, size_t pos)
+{
+    uint32_t cp;
+
+    if (ls->line->ascii()) return (unsigned char) (*ls->line)[pos];
+    utf8Decode(*ls->line, ls->len, pos, &cp);
+    return cp;
+}
+
+/* Move cursor on the left. */
+void
+lnEditMoveLeft (struct linenoiseState *ls)
+{
+    if (ls->pos > 0) {
+        ls->pos = lnPrev(ls, ls->pos);
+    }
+}
+
+/* Move cursor on the right. */
+void
+lnEditMoveRight (struct linenoiseState *ls)
+{
+    if (ls->pos != ls->len) {
+        ls->pos = lnNext(ls, ls->pos);
+    }
+}
+
+/* Letters of other scripts are word chars, their spaces aren't */
+static int
+isWordSep (uint32_t ch)
+{
+    if (ch < 0x80) return !isalnum(ch);
+    return ch == 0xA0 || (ch >= 0x2000 && ch <= 0x200A) ||
+	(ch >= 0x3000 && ch <= 0x3002);
+}
+
+static void
+lnMoveWord (struct linenoiseState *ls, int dir)
+{
+    auto step = [ls, dir] (size_t pos) {
+	return dir > 0 ? lnNext(ls, pos) : lnPrev(ls, pos);
+    };
+
+    if (dir < 0 && ls->pos == 0) return;
+    if (dir > 0 && (ls->pos == ls->len || lnNext(ls, ls->pos) >= ls->len)) return;
+
+    ls->pos = step(ls->pos);
+    while (ls->pos > 0 && ls->pos != ls->len && isWordSep(lnCharAt(ls, ls->pos)))
+	ls->pos = step(ls->pos);
+
+    while (ls->pos > 0 && ls->pos != ls->len &&
+	   !isWordSep(lnCharAt(ls, lnPrev(ls, ls->pos))))
+	ls->pos = step(ls->pos);
+}
+
+static void
+lnEditMoveLeftWord (struct linenoiseState *ls)
+{
+    lnMoveWord(ls, -1);
+}
+
+static void
+lnEditMoveRightWord (struct linenoiseState *ls)
+{
+    lnMoveWord(ls, 1);
+}
+
+static void
+lnEditMoveHome (struct linenoiseState *ls)
+{
+    ls->pos = 0;
+}
+
+static void
+lnEditMoveEnd (struct linenoiseState *ls)
+{
+    ls->pos = ls->len;
+}
+
+/* Substitute the currently edited line with the next or previous history
+ * entry as specified by 'dir'. */
+static void
+editHistoryNext (struct linenoiseState *ls, int dir)
+{
+    int *history_index = &ls->history_index;
+    auto &history = ls->ses->ses_history;
+
+    if (history.size() > 1) {
+	auto history_len = (int) history.size();
+
+        /* Update the current history entry before to
          * overwrite it with the next one. */
-        history[history_len - 1 - *history_index] = ls->buf;
+        history.set(history_len - 1 - *history_index, lnLine(ls));
 	
-        /* Show the new entry */
-        *history_index += dir;
-        if (*history_index < 0) {
-            *history_index = 0;
-            return;
-        } else if (*history_index >= history_len) {
-            *history_index = history_len - 1;
+        /* Show the new entry, stepping over lines erase_dups moved */
+        int i = *history_index;
+        do {
+            i += dir;
+        } while (i > 0 && i < history_len && !history.live(history_len - 1 - i));
+
+        if (i < 0 || i >= history_len)
             return;
-        }
-        strncpy(ls->buf, history[history_len - 1 - *history_index].c_str(), ls->buflen);
-        ls->buf[ls->buflen - 1] = '\0';
-        ls->len = ls->pos = strlen(ls->buf);
+        *history_index = i;
+        lnEditSetLine(ls, history[history_len - 1 - *history_index]);
+        ls->pos = ls->len;
     }
 }
 
+/* In the fuzzy finder these move the highlight instead */
 static void
 lnEditHistoryPrev (linenoiseState *ls)
 {
+    if (ls->fuzzy) {
+	if (ls->fuzzy_sel > 0) ls->fuzzy_sel--;
+	return;
+    }
+    lnEditSetHistoryIndex(ls);
     editHistoryNext(ls, 1);
 }
 
 static void
 lnEditHistoryNext (linenoiseState *ls)
 {
+    if (ls->fuzzy) {
+	if (ls->fuzzy_sel + 1 < (int) ls->ses->ses_fuzzy_hits.size()) ls->fuzzy_sel++;
+	return;
+    }
+    lnEditSetHistoryIndex(ls);
     editHistoryNext(ls, -1);
 }
 
 static void
 lnEditHistorySearchPrev (linenoiseState *ls)
 {
+    auto &history = ls->ses->ses_history;
     int history_len = history.size();
-    int i;
+    long hi;
 
-    if (strlen(ls->buf) == 0) {
+    if (ls->len == 0) {
 	ls->history_search = 1;
 	return;
     }
 
     /* search backwards through history starting from history_index */
-    for (i = ls->history_index + 1; i < history_len && i >= 0; i++) {
-	if (history[history_len - i - 1].find(ls->buf) != string::npos)
-	    break;
-    }
-    if (i < 0 || i >= history_len) {
-	lnBeep();
+    hi = ls->ses->ses_search.find(history, lnLine(ls),
+				  history_len - 1 - ls->history_index);
+    if (hi < 0) {
+	lnBeep(ls);
 	return;
     }
 
-    ls->history_index = i;
+    ls->history_index = history_len - 1 - hi;
     ls->history_search = 1;
 }
 
@@ -636,26 +1652,24 @@ lnEditHistorySearchPrev (linenoiseState *ls)
 void
 lnEditDelete (struct linenoiseState *ls)
 {
-    if (ls->len > 0 && ls->pos < ls->len) {
-        memmove(ls->buf + ls->pos, ls->buf + ls->pos + 1, ls->len-ls->pos - 1);
-        ls->len--;
-        ls->buf[ls->len] = '\0';
-    }
+    if (ls->len > 0 && ls->pos < ls->len)
+	lnEditErase(ls, ls->pos, lnNext(ls, ls->pos) - ls->pos);
 }
 
 void
 lnEditBackspace (struct linenoiseState *ls)
 {
     if (ls->pos > 0 && ls->len > 0) {
-        memmove(ls->buf + ls->pos - 1, ls->buf + ls->pos, ls->len - ls->pos);
-        ls->pos--;
-        ls->len--;
-        ls->buf[ls->len] = '\0';
+	size_t prev = lnPrev(ls, ls->pos);
+
+	lnEditErase(ls, prev, ls->pos - prev);
     }
     if (ls->history_search) {
 	ls->history_index = 0;
 	lnEditHistorySearchPrev(ls);
     }
+    if (ls->fuzzy)
+	lnEditFuzzyUpdate(ls);
 }
 
 /* Delete the previous/next word, maintaining the cursor at the start of the
@@ -675,10 +1689,9 @@ lnEditDeleteWord (struct linenoiseState *ls, int dir)
 	right = old_pos;
     }
 
-    lnYankSet(ls->buf, left, right);
+    lnYankSet(ls, left, right);
 
-    memmove(ls->buf + left, ls->buf + right, ls->len - left + 1);
-    ls->len -= (right - left);
+    lnEditErase(ls, left, right - left);
     ls->pos = left;
 }
 
@@ -688,221 +1701,604 @@ lnEditDeletePrevWord (struct linenoiseState *ls)
     lnEditDeleteWord(ls, -1);
 }
 
-void
-lnEditDeleteNextWord (struct linenoiseState *ls)
-{
-    lnEditDeleteWord(ls, 1);
+void
+lnEditDeleteNextWord (struct linenoiseState *ls)
+{
+    lnEditDeleteWord(ls, 1);
+}
+
+void
+lnEditYank (struct linenoiseState *ls)
+{
+    /* Drawn once by lnCmd() */
+    lnEditPut(ls, ls->ses->ses_yank_buffer);
+}
+
+static void
+lnEditSwap (linenoiseState *ls)
+{
+    if (ls->pos > 0 && ls->pos < ls->len) {
+	size_t prev = lnPrev(ls, ls->pos), next = lnNext(ls, ls->pos);
+	string aux;
+
+	/* The char before the cursor goes after the one at it */
+	ls->line->copy(prev, ls->pos - prev, aux);
+	ls->line->erase(prev, ls->pos - prev);
+	ls->line->insert(next - aux.size(), aux);
+	lnEditChanged(ls, prev, next - prev, next - prev);
+	if (next != ls->len)
+	    ls->pos = next;
+	else
+	    ls->pos = next - aux.size();
+    }
+}
+
+static void
+lnEditDeleteLine (linenoiseState *ls)
+{
+    lnYankSet(ls, 0, ls->len);
+
+    lnEditErase(ls, 0, ls->len);
+}
+
+static void
+lnEditDeleteToEOL (linenoiseState *ls)
+{
+    lnYankSet(ls, ls->pos, ls->len);
+
+    lnEditErase(ls, ls->pos, ls->len - ls->pos);
+}
+
+/*
+ * However the edit ends, the history entry lnEditBegin() pushed for the
+ * current buffer goes.
+ */
+static void
+lnEditDone (linenoiseState *ls, int ret_code)
+{
+    ls->ses->ses_history.pop_back();
+    ls->edit_done = 1;
+    ls->ret_code = ret_code;
+}
+
+/* Handles CTRL-D by either deleting char, or exiting if empty buf */
+static void
+lnEditControlD (linenoiseState *ls)
+{
+    if (ls->len > 0)
+	lnEditDelete(ls);
+    else
+	lnEditDone(ls, -1);
+}
+
+static void
+lnEditControlC (linenoiseState *ls)
+{
+    errno = EAGAIN;
+    lnEditDone(ls, -1);
+}
+
+static void
+lnEditEnter (linenoiseState *ls)
+{
+    lnEditDone(ls, ls->len);
+}
+
+/* ============================ Fuzzy finder =============================== */
+
+static fuzzy_finder_c *
+lnFuzzyFinder (lnSession *ses)
+{
+    if (!ses->ses_fuzzy)
+	ses->ses_fuzzy.reset(new fuzzy_finder_c(lnSessionWakePipe(ses)));
+    return ses->ses_fuzzy.get();
+}
+
+/* Rescore for the new pattern, the old scan is cancelled. */
+static void
+lnEditFuzzyUpdate (linenoiseState *ls)
+{
+    lnSession *ses = ls->ses;
+    fuzzy_finder_c *finder = lnFuzzyFinder(ses);
+
+    ls->fuzzy_sel = 0;
+    finder->start(ses->ses_history, ses->ses_search, lnLine(ls));
+    finder->results(ses->ses_fuzzy_hits);
+}
+
+/*
+ * Close the finder, with accept the highlighted match replaces the
+ * line.  The finder is cancelled first, the history may change after.
+ */
+static void
+lnEditFuzzyEnd (linenoiseState *ls, int accept)
+{
+    lnSession *ses = ls->ses;
+    auto &history = ses->ses_history;
+    auto &hits = ses->ses_fuzzy_hits;
+
+    if (!ls->fuzzy) return;
+
+    ses->ses_fuzzy->cancel();
+    if (accept && ls->fuzzy_sel < (int) hits.size()) {
+	uint64_t seq = hits[ls->fuzzy_sel].fh_seq;
+
+	if (seq >= history.seq(0) && seq - history.seq(0) < history.size()) {
+	    lnEditSetLine(ls, history[seq - history.seq(0)]);
+	    ls->pos = ls->len;
+	}
+    }
+    hits.clear();
+    ls->fuzzy = 0;
+
+    /* Erase the list of matches */
+    ls->ses->ses_screen_valid = 0;
+    lnOutput(ls->ses, CSI "0J", sizeof(CSI "0J") - 1);
+}
+
+/* ESC r opens the finder, with the line as the pattern, or closes it
+ * leaving the pattern. */
+static void
+lnEditFuzzy (linenoiseState *ls)
+{
+    if (ls->fuzzy) {
+	lnEditFuzzyEnd(ls, 0);
+	return;
+    }
+
+    lnEditSetHistoryIndex(ls);
+    ls->fuzzy = 1;
+    lnEditFuzzyUpdate(ls);
+}
+
+/* Other keys leave the finder with its match, or Ctrl-R search with
+ * the line found. */
+static void
+lnEditSetHistoryIndex (linenoiseState *ls)
+{
+    lnEditFuzzyEnd(ls, 1);
+
+    if (!ls->history_search) return;
+
+    auto &history = ls->ses->ses_history;
+    unsigned hi = history.size() - ls->history_index  - 1;
+
+    lnEditSetLine(ls, history[hi]);
+    ls->pos = 0;
+
+    ls->history_search = 0;
+    ls->history_index = 0;
+    ls->ses->ses_search.reset();
+}
+
+typedef void (ln_func_t)(linenoiseState *);
+
+static cmd_func
+lnCmd (linenoiseState *ls, ln_func_t func, int reset_history_search = 1)
+{
+    return [ls, func, reset_history_search] (int ch UNUSED) {
+	if (reset_history_search) lnEditSetHistoryIndex(ls);
+	if (func != completeLine && func != helpLine) {
+	    ls->completing = 0;
+	    ls->help_offset = 0;
+	}
+
+	func(ls);
+	lnEditCompleteChanged(ls);
+	refreshLine(ls);
+
+	return 0;
+    };
+}
+
+/*
+ * Bind the editing commands to their keys.  The handlers work on the
+ * session's ses_state, so this is done once per session and the
+ * compiled key table is reused by every call to lnEdit().
+ */
+static void
+lnEditBindKeys (linenoiseState *ls)
+{
+    lnSession *ses = ls->ses;
+
+    lnSessionAddKeyHandler(ses, "?",	 lnCmd(ls, helpLine));
+    lnSessionAddKeyHandler(ses, S_BSPACE,    lnCmd(ls, lnEditBackspace, 0));
+    lnSessionAddKeyHandler(ses, S_TAB,	 lnCmd(ls, completeLine));
+    lnSessionAddKeyHandler(ses, S_CTRL('A'), lnCmd(ls, lnEditMoveHome));
+    lnSessionAddKeyHandler(ses, S_CTRL('B'), lnCmd(ls, lnEditMoveLeft));
+    lnSessionAddKeyHandler(ses, S_CTRL('C'), lnCmd(ls, lnEditControlC));
+    lnSessionAddKeyHandler(ses, S_CTRL('D'), lnCmd(ls, lnEditControlD));
+    lnSessionAddKeyHandler(ses, S_CTRL('E'), lnCmd(ls, lnEditMoveEnd));
+    lnSessionAddKeyHandler(ses, S_CTRL('F'), lnCmd(ls, lnEditMoveRight));
+    lnSessionAddKeyHandler(ses, S_CTRL('H'), lnCmd(ls, lnEditBackspace, 0));
+    lnSessionAddKeyHandler(ses, S_CTRL('K'), lnCmd(ls, lnEditDeleteToEOL));
+    lnSessionAddKeyHandler(ses, S_CTRL('L'), lnCmd(ls, lnClearScreen));
+    lnSessionAddKeyHandler(ses, S_CTRL('M'), lnCmd(ls, lnEditEnter));
+    lnSessionAddKeyHandler(ses, S_CTRL('N'), lnCmd(ls, lnEditHistoryNext, 0));
+    lnSessionAddKeyHandler(ses, S_CTRL('P'), lnCmd(ls, lnEditHistoryPrev, 0));
+    lnSessionAddKeyHandler(ses, S_CTRL('R'), lnCmd(ls, lnEditHistorySearchPrev, 0));
+    lnSessionAddKeyHandler(ses, S_CTRL('T'), lnCmd(ls, lnEditSwap));
+    lnSessionAddKeyHandler(ses, S_CTRL('U'), lnCmd(ls, lnEditDeleteLine));
+    lnSessionAddKeyHandler(ses, S_CTRL('W'), lnCmd(ls, lnEditDeletePrevWord));
+    lnSessionAddKeyHandler(ses, S_CTRL('Y'), lnCmd(ls, lnEditYank));
+
+    lnSessionAddKeyHandler(ses, S_ESC S_BRACKET "3~", lnCmd(ls, lnEditDelete));
+    lnSessionAddKeyHandler(ses, S_ESC S_BRACKET "A",  lnCmd(ls, lnEditHistoryPrev, 0));
+    lnSessionAddKeyHandler(ses, S_ESC S_BRACKET "B",  lnCmd(ls, lnEditHistoryNext, 0));
+    lnSessionAddKeyHandler(ses, S_ESC S_BRACKET "C",  lnCmd(ls, lnEditMoveRight));
+    lnSessionAddKeyHandler(ses, S_ESC S_BRACKET "D",  lnCmd(ls, lnEditMoveLeft));
+    lnSessionAddKeyHandler(ses, S_ESC S_BRACKET "F",  lnCmd(ls, lnEditMoveEnd));
+    lnSessionAddKeyHandler(ses, S_ESC S_BRACKET "H",  lnCmd(ls, lnEditMoveHome));
+
+    lnSessionAddKeyHandler(ses, S_ESC S_ESC S_BRACKET "C", lnCmd(ls, lnEditMoveRightWord));
+    lnSessionAddKeyHandler(ses, S_ESC S_ESC S_BRACKET "D", lnCmd(ls, lnEditMoveLeftWord));
+
+    lnSessionAddKeyHandler(ses, S_ESC "O" "F", lnCmd(ls, lnEditMoveEnd));
+    lnSessionAddKeyHandler(ses, S_ESC "O" "H", lnCmd(ls, lnEditMoveHome));
+
+    lnSessionAddKeyHandler(ses, S_ESC S_BSPACE, lnCmd(ls, lnEditDeletePrevWord));
+    lnSessionAddKeyHandler(ses, S_ESC "b", lnCmd(ls, lnEditMoveLeftWord));
+    lnSessionAddKeyHandler(ses, S_ESC "d", lnCmd(ls, lnEditDeleteNextWord));
+    lnSessionAddKeyHandler(ses, S_ESC "f", lnCmd(ls, lnEditMoveRightWord));
+    lnSessionAddKeyHandler(ses, S_ESC "h", lnCmd(ls, lnEditDeletePrevWord));
+    lnSessionAddKeyHandler(ses, S_ESC "r", lnCmd(ls, lnEditFuzzy, 0));
+
+    /*  This has to be the last handler, to take care of all 'other' keys */
+    lnSessionAddKeyHandler(ses, "*", [ls] (int c) {
+	    ls->completing = 0;
+	    ls->help_offset = 0;
+            if (lnEditInsert(ls, c))
+		lnEditDone(ls, -1);
+	    lnEditCompleteChanged(ls);
+	    return 0;
+	});
+}
+
+/*
+ * Set up ses_state for editing a new line and show the prompt.
+ */
+static int
+lnEditBegin (lnSession *ses, const char *prompt, size_t cols)
+{
+    struct linenoiseState &l = ses->ses_state;
+    struct linenoiseState *ls = &l;
+
+    /* Populate the linenoise state that we pass to functions implementing
+     * specific editing functionalities. */
+    l.ses = ses;
+    l.ifd = ses->ses_ifd;
+    l.ofd = ses->ses_ofd;
+    l.line = &ses->ses_line;
+    l.prompt = prompt;
+    l.plen = strlen(prompt);
+    l.pcols = utf8Columns(prompt);
+    l.oldpos = l.pos = 0;
+    l.len = 0;
+    l.cols = cols;
+    l.edit_done = 0;
+    l.ret_code = 0;
+    l.history_index = 0;
+    l.history_search = 0;
+    l.completing = 0;
+    l.complete_wait = 0;
+    l.help_offset = 0;
+    l.fuzzy = 0;
+    l.fuzzy_sel = 0;
+    l.utf8_len = 0;
+
+    /* Buffer starts empty, keeping the space of the last line. */
+    l.line->clear();
+    ses->ses_hl.reset(0);
+    ses->ses_hint_stale = 1;
+
+    /* The latest history entry is always our current buffer, that
+     * initially is just an empty string.  It's pushed even if the newest
+     * entry is empty too, since it's popped again when editing ends.
+     * Lines other processes added to a shared history come first. */
+    if (ses->ses_journal)
+	ses->ses_journal->read(ses->ses_history);
+    ses->ses_history.push_back("");
+    
+    if (!ses->ses_keys_bound) {
+	lnEditBindKeys(ls);
+	ses->ses_keys_bound = 1;
+    }
+    lnEditCompleteChanged(ls);
+
+    /* Where the prompt lands isn't known, the first refresh redraws */
+    ses->ses_screen_valid = 0;
+    ses->ses_screen_row = 0;
+    ses->ses_rows.clear();
+    ses->ses_row_attrs.clear();
+    lnOutput(ses, prompt, l.plen);
+    if (lnSessionFlush(ses, 0) == -1) {
+	lnEditDone(ls, -1);
+	return -1;
+    }
+    return 0;
+}
+
+/* This function is the core of the line editing capability of linenoise.
+ * It expects 'fd' to be already in "raw mode" so that every key pressed
+ * will be returned ASAP to read().
+ *
+ * The resulting string is left in the session's line when the user type
+ * enter, or when ctrl+d is typed.
+ *
+ * The function returns the length of the current buffer. */
+static int
+lnEdit (lnSession *ses, const char *prompt)
+{
+    struct linenoiseState *ls = &ses->ses_state;
+
+    if (lnEditBegin(ses, prompt, getColumns(ses)) == -1)
+	return -1;
+
+    /* This loops over the session's input until ls->edit_done == 1 */
+    lnSessionHandleKeys(ses, &ls->edit_done);
+
+    /* Below all the rows of a multi-line edit for the newline */
+    lnScreenBottom(ls, ses->ses_frame);
+    lnSessionFlush(ses, 1);
+
+    return ls->ret_code;
 }
 
-void
-lnEditYank (struct linenoiseState *ls)
+/* ========================== Event driven editing ========================== */
+
+/*
+ * Dispatch the keys in the input ring, topping it up from what was fed
+ * in that it had no room for, until the line is done or the input runs
+ * out.  Input after the end of the line stays queued for the next one.
+ */
+static int
+lnEditRun (lnSession *ses)
 {
-    for (auto ch : yank_buffer) {
-	lnEditInsert(ls, ch);
-    }
+    struct linenoiseState *ls = &ses->ses_state;
+    ln_input_c &input = ses->ses_input;
+    string &feed = ses->ses_feed;
+    int ret;
+
+    do {
+	int flush = 0;
+
+	if (ses->ses_feed_off < feed.size()) {
+	    ses->ses_feed_off += input.put(feed.data() + ses->ses_feed_off,
+					   feed.size() - ses->ses_feed_off);
+	    if (ses->ses_feed_off == feed.size()) {
+		feed.clear();
+		ses->ses_feed_off = 0;
+	    }
+	}
+
+	if (lnSessionKeyTimeout(ses) == 0) {
+	    ses->ses_stats.lns_partial_timeouts++;
+	    flush = 1;
+	}
+
+	lnSessionDispatchKeys(ses, &ls->edit_done, flush, &ret);
+    } while (!ls->edit_done && ses->ses_feed_off < feed.size());
+
+    return ls->edit_done ? LN_EDIT_DONE : LN_EDIT_MORE;
 }
 
-static void
-lnEditSwap (linenoiseState *ls)
+/*
+ * Start editing a line without blocking.  The host reads the session's
+ * input itself, whenever its event loop says there is some, and passes
+ * it to lnEditFeed().  Nothing is read from ifd and the terminal mode
+ * is left alone; the width comes from ofd or lnSessionSetColumns().
+ * Input queued after the last line is handled straight away, so this
+ * returns LN_EDIT_DONE if it already holds the whole line, LN_EDIT_MORE
+ * if not and -1 on error.
+ */
+int
+lnEditStart (lnSession *ses, const char *prompt)
 {
-    if (ls->pos > 0 && ls->pos < ls->len) {
-	int aux = ls->buf[ls->pos - 1];
-	ls->buf[ls->pos - 1] = ls->buf[ls->pos];
-	ls->buf[ls->pos] = aux;
-	if (ls->pos != ls->len-1) (ls->pos)++;
+    struct winsize ws;
+    size_t cols = ses->ses_cols;
+
+    if (ses->ses_editing) {
+	errno = EBUSY;
+	return -1;
     }
-}
 
-static void
-lnEditDeleteLine (linenoiseState *ls)
-{
-    lnYankSet(ls->buf, 0, ls->len);
+    if (ioctl(ses->ses_ofd, TIOCGWINSZ, &ws) != -1 && ws.ws_col != 0)
+	cols = ws.ws_col;
 
-    ls->buf[0] = '\0';
-    ls->pos = ls->len = 0;
+    ses->ses_prompt = prompt;
+    ses->ses_editing = 1;
+    if (lnEditBegin(ses, ses->ses_prompt.c_str(), cols) == -1) {
+	ses->ses_editing = 0;
+	return -1;
+    }
+    return lnEditRun(ses);
 }
 
-static void
-lnEditDeleteToEOL (linenoiseState *ls)
+/*
+ * Run the editor over len bytes of input.  Returns LN_EDIT_DONE once
+ * the line is finished, collect it with lnEditStop(), LN_EDIT_MORE
+ * while it's still being edited and -1 if no edit was started.  None
+ * of the input is lost: what comes after the end of the line is kept,
+ * however much there is, and edited into the lines that follow.
+ * lnEditFeed(ses, NULL, 0) handles input that's queued, see
+ * lnEditTimeout().
+ */
+int
+lnEditFeed (lnSession *ses, const char *bytes, size_t len)
 {
-    lnYankSet(ls->buf, ls->pos, ls->len);
+    if (!ses->ses_editing) return -1;
 
-    ls->buf[ls->pos] = '\0';
-    ls->len = ls->pos;
-}
+    /* What the ring has no room for waits, after what's waiting already */
+    if (ses->ses_feed.empty()) {
+	size_t n = ses->ses_input.put(bytes, len);
 
-/* Handles CTRL-D by either deleting char, or exiting if empty buf */
-static void
-lnEditControlD (linenoiseState *ls)
-{
-    if (ls->len > 0) {
-	lnEditDelete(ls);
-    } else {
-	history.pop_back();
-	ls->edit_done = 1;
-	ls->ret_code = -1;
+	bytes += n;
+	len -= n;
     }
+    ses->ses_feed.append(bytes, len);
+    return lnEditRun(ses);
 }
 
-static void
-lnEditControlC (linenoiseState *ls)
+/*
+ * Milliseconds until lnEditFeed(ses, NULL, 0) should be called: 0 when
+ * there is queued input to handle, otherwise when a held partial key
+ * sequence has to be resolved, -1 if there's nothing to wait for.
+ */
+int
+lnEditTimeout (lnSession *ses)
 {
-    errno = EAGAIN;
-    ls->edit_done = 1;
-    ls->ret_code = -1;
-}
+    struct linenoiseState *ls = &ses->ses_state;
 
-static void
-lnEditEnter (linenoiseState *ls)
-{
-    history.pop_back();
-    ls->edit_done = 1;
-    ls->ret_code = ls->len;
+    if (ses->ses_editing && !ls->edit_done &&
+	(!ses->ses_feed.empty() ||
+	 (ses->ses_input.size() && ses->ses_partial_start == 0)))
+	return 0;
+    return lnSessionKeyTimeout(ses);
 }
 
-static void
-lnEditSetHistoryIndex (linenoiseState *ls)
+/*
+ * Finish the edit.  Returns the line as a malloc() allocated string, or
+ * NULL if it was cancelled with ctrl-c/ctrl-d or isn't finished yet.
+ */
+char *
+lnEditStop (lnSession *ses)
 {
-    if (!ls->history_search) return;
+    struct linenoiseState *ls = &ses->ses_state;
 
-    unsigned hi = history.size() - ls->history_index  - 1;
+    if (!ses->ses_editing) return NULL;
+    ses->ses_editing = 0;
 
-    snprintf(ls->buf, ls->buflen, "%s", history[hi].c_str());
+    if (!ls->edit_done) {
+	/* Abandoned */
+	lnEditFuzzyEnd(ls, 0);
+	lnEditDone(ls, -1);
+    }
 
-    ls->pos = 0;
-    ls->len = strlen(ls->buf);
+    lnScreenBottom(ls, ses->ses_frame);
+    lnOutput(ses, "\r\n", 2);
+    lnSessionFlush(ses, 0);
 
-    ls->history_search = 0;
-    ls->history_index = 0;
+    if (ls->ret_code == -1) return NULL;
+    return strdup(lnLine(ls));
 }
 
-typedef void (ln_func_t)(linenoiseState *);
-
-static cmd_func
-lnCmd (linenoiseState *ls, ln_func_t func, int reset_history_search = 1)
+/*
+ * Background work finished, show its results.  Called from the blocking
+ * loop when the wake fd is readable, and by hosts via lnEditWake().
+ */
+void
+lnSessionWake (lnSession *ses)
 {
-    return [ls, func, reset_history_search] (int ch UNUSED) {
-	if (reset_history_search) lnEditSetHistoryIndex(ls);
+    struct linenoiseState *ls = &ses->ses_state;
+    char buf[64];
 
-	func(ls);
+    while (read(ses->ses_wake_fd, buf, sizeof(buf)) > 0) {}
+
+    if (ses->ses_fuzzy && ses->ses_fuzzy->results(ses->ses_fuzzy_hits) && ls->fuzzy)
 	refreshLine(ls);
 
-	return 0;
-    };
+    /* The completions a TAB or '?' is waiting for may be in */
+    if (ls->complete_wait && ses->ses_complete_async &&
+	ses->ses_complete_async->ready(lnLine(ls))) {
+	if (ls->complete_wait == TAB)
+	    completeLine(ls);
+	else
+	    helpLine(ls);
+	ls->complete_wait = 0;
+	refreshLine(ls);
+    }
+    lnSessionFlush(ses, 0);
 }
 
-/* This function is the core of the line editing capability of linenoise.
- * It expects 'fd' to be already in "raw mode" so that every key pressed
- * will be returned ASAP to read().
- *
- * The resulting string is put into 'buf' when the user type enter, or
- * when ctrl+d is typed.
- *
- * The function returns the length of the current buffer. */
+/*
+ * The pipe background work pokes when it's done, made on first use.
+ * Returns the end to write to, -1 if there's no pipe.
+ */
 static int
-lnEdit (int stdin_fd, int stdout_fd,
-	char *buf, size_t buflen, const char *prompt)
+lnSessionWakePipe (lnSession *ses)
 {
-    struct linenoiseState l;
-    struct linenoiseState *ls = &l;
+    int fds[2];
+
+    if (ses->ses_wake_fd != -1)
+	return ses->ses_wake_notify;
+    if (pipe(fds) == -1)
+	return -1;
+    for (int fd : fds) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    ses->ses_wake_fd = fds[0];
+    ses->ses_wake_notify = fds[1];
+    return fds[1];
+}
 
-    /* Populate the linenoise state that we pass to functions implementing
-     * specific editing functionalities. */
-    l.ifd = stdin_fd;
-    l.ofd = stdout_fd;
-    l.buf = buf;
-    l.buflen = buflen;
-    l.prompt = prompt;
-    l.plen = strlen(prompt);
-    l.oldpos = l.pos = 0;
-    l.len = 0;
-    l.cols = getColumns(stdin_fd, stdout_fd);
-    l.edit_done = 0;
-    l.history_index = 0;
-    l.history_search = 0;
+/* The fd to poll for background work, see lnEditWake(). */
+int
+lnSessionWakeFd (lnSession *ses)
+{
+    lnSessionWakePipe(ses);
+    return ses->ses_wake_fd;
+}
 
-    /* Buffer starts empty. */
-    l.buf[0] = '\0';
-    l.buflen--; /* Make sure there is always space for the nulterm */
+int
+lnEditWake (lnSession *ses)
+{
+    if (!ses->ses_editing) return -1;
 
-    /* The latest history entry is always our current buffer, that
-     * initially is just an empty string. */
-    linenoiseHistoryAdd("");
-    
-    if (write(l.ofd, prompt, l.plen) == -1) return -1;
-
-    lnAddKeyHandler("?",	 lnCmd(ls, helpLine));
-    lnAddKeyHandler(S_BSPACE,    lnCmd(ls, lnEditBackspace, 0));
-    lnAddKeyHandler(S_TAB,	 lnCmd(ls, completeLine));
-    lnAddKeyHandler(S_CTRL('A'), lnCmd(ls, lnEditMoveHome));
-    lnAddKeyHandler(S_CTRL('B'), lnCmd(ls, lnEditMoveLeft));
-    lnAddKeyHandler(S_CTRL('C'), lnCmd(ls, lnEditControlC));
-    lnAddKeyHandler(S_CTRL('D'), lnCmd(ls, lnEditControlD));
-    lnAddKeyHandler(S_CTRL('E'), lnCmd(ls, lnEditMoveEnd));
-    lnAddKeyHandler(S_CTRL('F'), lnCmd(ls, lnEditMoveRight));
-    lnAddKeyHandler(S_CTRL('H'), lnCmd(ls, lnEditBackspace, 0));
-    lnAddKeyHandler(S_CTRL('K'), lnCmd(ls, lnEditDeleteToEOL));
-    lnAddKeyHandler(S_CTRL('L'), lnCmd(ls, lnClearScreen));
-    lnAddKeyHandler(S_CTRL('M'), lnCmd(ls, lnEditEnter));
-    lnAddKeyHandler(S_CTRL('N'), lnCmd(ls, lnEditHistoryNext));
-    lnAddKeyHandler(S_CTRL('P'), lnCmd(ls, lnEditHistoryPrev));
-    lnAddKeyHandler(S_CTRL('R'), lnCmd(ls, lnEditHistorySearchPrev, 0));
-    lnAddKeyHandler(S_CTRL('T'), lnCmd(ls, lnEditSwap));
-    lnAddKeyHandler(S_CTRL('U'), lnCmd(ls, lnEditDeleteLine));
-    lnAddKeyHandler(S_CTRL('W'), lnCmd(ls, lnEditDeletePrevWord));
-    lnAddKeyHandler(S_CTRL('Y'), lnCmd(ls, lnEditYank));
-
-    lnAddKeyHandler(S_ESC S_BRACKET "3~", lnCmd(ls, lnEditDelete));
-    lnAddKeyHandler(S_ESC S_BRACKET "A",  lnCmd(ls, lnEditHistoryPrev));
-    lnAddKeyHandler(S_ESC S_BRACKET "B",  lnCmd(ls, lnEditHistoryNext));
-    lnAddKeyHandler(S_ESC S_BRACKET "C",  lnCmd(ls, lnEditMoveRight));
-    lnAddKeyHandler(S_ESC S_BRACKET "D",  lnCmd(ls, lnEditMoveLeft));
-    lnAddKeyHandler(S_ESC S_BRACKET "F",  lnCmd(ls, lnEditMoveEnd));
-    lnAddKeyHandler(S_ESC S_BRACKET "H",  lnCmd(ls, lnEditMoveHome));
-
-    lnAddKeyHandler(S_ESC S_ESC S_BRACKET "C", lnCmd(ls, lnEditMoveRightWord));
-    lnAddKeyHandler(S_ESC S_ESC S_BRACKET "D", lnCmd(ls, lnEditMoveLeftWord));
-
-    lnAddKeyHandler(S_ESC "O" "F", lnCmd(ls, lnEditMoveEnd));
-    lnAddKeyHandler(S_ESC "O" "H", lnCmd(ls, lnEditMoveHome));
-
-    lnAddKeyHandler(S_ESC S_BSPACE, lnCmd(ls, lnEditDeletePrevWord));
-    lnAddKeyHandler(S_ESC "b", lnCmd(ls, lnEditMoveLeftWord));
-    lnAddKeyHandler(S_ESC "d", lnCmd(ls, lnEditDeleteNextWord));
-    lnAddKeyHandler(S_ESC "f", lnCmd(ls, lnEditMoveRightWord));
-    lnAddKeyHandler(S_ESC "h", lnCmd(ls, lnEditDeletePrevWord));
+    lnSessionWake(ses);
+    return ses->ses_state.edit_done ? LN_EDIT_DONE : LN_EDIT_MORE;
+}
 
-    /*  This has to be the last handler, to take care of all 'other' keys */
-    lnAddKeyHandler("*", [ls] (int c) {
-            if (lnEditInsert(ls, c)) {
-		ls->edit_done = 1;
-		ls->ret_code = -1;
-	    }
-	    return 0;
-	});
+/* Output a full non-blocking ofd hasn't taken yet, see lnEditFlush(). */
+size_t
+lnEditOutputPending (lnSession *ses)
+{
+    return ses->ses_frame.size() - ses->ses_frame_sent;
+}
+
+/* Write what's pending when ofd is writable.  Returns the bytes still
+ * to write, -1 on a write error. */
+int
+lnEditFlush (lnSession *ses)
+{
+    return lnSessionFlush(ses, 0);
+}
 
-    /* This loops over stdin_fd until ls->edit_done == 1 */
-    lnHandleKeys(stdin_fd, &ls->edit_done);
+/*
+ * Wrap long lines onto more rows instead of scrolling them sideways.
+ * Takes effect from the next refresh.
+ */
+void
+lnSessionSetMultiLine (lnSession *ses, int on)
+{
+    ses->ses_multiline = on;
+    ses->ses_screen_valid = 0;
+}
 
-    return ls->ret_code;
+void
+linenoiseSetMultiLine (int on)
+{
+    lnSessionSetMultiLine(lnDefaultSession(), on);
+}
+
+/* Width to use when it can't be read from the session's ofd. */
+void
+lnSessionSetColumns (lnSession *ses, int cols)
+{
+    if (cols > 0) ses->ses_cols = cols;
 }
 
 /* This function calls the line editing function lnEdit() using
- * the STDIN file descriptor set in raw mode. */
+ * the session's input file descriptor set in raw mode. */
 static int
-lnRaw (char *buf, size_t buflen, const char *prompt)
+lnRaw (lnSession *ses, const char *prompt)
 {
     int count;
 
-    if (buflen == 0) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    if (lnEnableRawMode(STDIN_FILENO) == -1) return -1;
-    count = lnEdit(STDIN_FILENO, STDOUT_FILENO, buf, buflen, prompt);
-    lnDisableRawMode(STDIN_FILENO);
-    printf("\n");
+    if (lnSessionEnableRawMode(ses) == -1) return -1;
+    count = lnEdit(ses, prompt);
+    lnSessionDisableRawMode(ses);
+    if (write(ses->ses_ofd, "\n", 1) == -1) {} /* Can't recover from write error. */
 
     return count;
 }
@@ -910,110 +2306,414 @@ lnRaw (char *buf, size_t buflen, const char *prompt)
 /* The high level function that is the main API of the linenoise library.
  * This function checks if the terminal has basic capabilities, just checking
  * for a blacklist of stupid terminals, and later either calls the line
- * editing function or uses dummy fgets() so that you will be able to type
+ * editing function or just reads a line so that you will be able to type
  * something even in the most desperate of the conditions. */
 char *
-linenoise (const char *prompt)
+lnSessionLine (lnSession *ses, const char *prompt)
 {
-    char buf[LN_MAX_LINE];
     int count;
 
-    if (isUnsupportedTerm() || !isatty(STDIN_FILENO)) {
-        size_t len;
+    if (isUnsupportedTerm() || !isatty(ses->ses_ifd)) {
+        string buf;
+        char c;
+        int n = 0;
 
-	if (isatty(STDIN_FILENO)) {
-	    printf("%s", prompt);
-	    fflush(stdout);
+	if (isatty(ses->ses_ifd)) {
+	    if (write(ses->ses_ofd, prompt, strlen(prompt)) == -1) {}
 	}
 
-        if (fgets(buf, LN_MAX_LINE, stdin) == NULL) return NULL;
-        len = strlen(buf);
-        while (len && (buf[len-1] == '\n' || buf[len-1] == '\r')) {
-            len--;
-            buf[len] = '\0';
+        while ((n = lnReadChar(ses, &c)) == 1 && c != '\n') {
+            buf += c;
         }
-    } else {
-        count = lnRaw(buf, LN_MAX_LINE, prompt);
-        if (count == -1) return NULL;
+        if (n != 1 && buf.empty()) return NULL;
+
+        while (!buf.empty() && buf.back() == '\r') buf.pop_back();
+        return strdup(buf.c_str());
     }
 
-    return strdup(buf);
+    count = lnRaw(ses, prompt);
+    if (count == -1) return NULL;
+    return strdup(ses->ses_line.c_str());
+}
+
+char *
+linenoise (const char *prompt)
+{
+    return lnSessionLine(lnDefaultSession(), prompt);
 }
 
 /* ================================ History ================================= */
 
 /* This is the API call to add a new entry in the linenoise history. */
 int
-linenoiseHistoryAdd (const char *line)
+lnSessionHistoryAdd (lnSession *ses, const char *line)
 {
-    if (history_max_len == 0) return 0;
+    auto &history = ses->ses_history;
 
-    /* Don't add duplicated lines. */
-    auto history_len = (int) history.size();
-    if (history_len && history[history_len - 1] == line)
-	return 0;
+    /* Lines another process added to a shared history go before ours */
+    if (ses->ses_journal)
+	ses->ses_journal->read(history);
 
-    if (history_len == history_max_len) {
-        history.erase(history.begin());
-    }
+    /* Repeats of the newest line aren't added, see history_c::add() */
+    if (!history.add(line))
+	return 0;
 
-    history.push_back(line);
+    if (ses->ses_journal)
+	ses->ses_journal->append(line, history.max_len(), history.erase_dups());
     return 1;
 }
 
+int
+linenoiseHistoryAdd (const char *line)
+{
+    return lnSessionHistoryAdd(lnDefaultSession(), line);
+}
+
 /* Set the maximum length for the history. This function can be called even
  * if there is already some history, the function will make sure to retain
  * just the latest 'len' elements if the new history length value is smaller
  * than the amount of items already inside the history. */
 int
-lnHistorySetMaxLen (int len)
+lnSessionHistorySetMaxLen (lnSession *ses, int len)
 {
     if (len < 1) return 0;
 
-    while ((int) history.size() >= len) {
-	history.erase(history.begin());
-    }
-
-    history_max_len = len;
+    ses->ses_history.set_max_len(len);
 
     return 1;
 }
 
+int
+linenoiseHistorySetMaxLen (int len)
+{
+    return lnSessionHistorySetMaxLen(lnDefaultSession(), len);
+}
+
+/* With erase_dups on, adding a line already in the history moves it to
+ * the newest position, so each line is kept once. */
+void
+lnSessionHistorySetEraseDups (lnSession *ses, int on)
+{
+    ses->ses_history.set_erase_dups(on != 0);
+}
+
+void
+linenoiseHistorySetEraseDups (int on)
+{
+    lnSessionHistorySetEraseDups(lnDefaultSession(), on);
+}
+
+/* ================================ Journal ================================= */
+
+static history_journal_c *
+lnJournal (lnSession *ses)
+{
+    if (!ses->ses_journal)
+	ses->ses_journal.reset(new history_journal_c());
+    return ses->ses_journal.get();
+}
+
+/* Load the history from filename and from then on append each line added
+ * to it, instead of rewriting it with lnSessionHistorySave().  NULL
+ * closes the journal.  Returns 0 on success, -1 if the file can't be
+ * opened for appending. */
+int
+lnSessionHistoryJournal (lnSession *ses, const char *filename)
+{
+    std::unique_ptr<history_journal_c> journal = std::move(ses->ses_journal);
+
+    if (!journal) journal.reset(new history_journal_c());
+    journal->close();
+
+    /* Loaded while detached, so the lines aren't appended again */
+    if (filename) lnSessionHistoryLoad(ses, filename);
+
+    ses->ses_journal = std::move(journal);
+    return filename ? ses->ses_journal->open(filename) : 0;
+}
+
+int
+linenoiseHistoryJournal (const char *filename)
+{
+    return lnSessionHistoryJournal(lnDefaultSession(), filename);
+}
+
+/* Like lnSessionHistoryJournal(), but the file is shared with other
+ * processes: each appends under a lock, and the lines the others added
+ * are picked up before every prompt. */
+int
+lnSessionHistoryShare (lnSession *ses, const char *filename)
+{
+    history_journal_c *journal = lnJournal(ses);
+
+    journal->close();
+    return filename ? journal->open(filename, &ses->ses_history) : 0;
+}
+
+int
+linenoiseHistoryShare (const char *filename)
+{
+    return lnSessionHistoryShare(lnDefaultSession(), filename);
+}
+
+/* How often lines appended to the journal are fsynced, in milliseconds.
+ * 0 syncs each line before lnSessionHistoryAdd() returns and negative
+ * never syncs. */
+void
+lnSessionHistorySetSyncInterval (lnSession *ses, int ms)
+{
+    lnJournal(ses)->set_sync_interval(ms);
+}
+
+void
+linenoiseHistorySetSyncInterval (int ms)
+{
+    lnSessionHistorySetSyncInterval(lnDefaultSession(), ms);
+}
+
+/* Once the journal grows past bytes it is compacted in the background,
+ * into a snapshot of the history. */
+void
+lnSessionHistorySetCompactSize (lnSession *ses, size_t bytes)
+{
+    lnJournal(ses)->set_compact_size(bytes);
+}
+
+void
+linenoiseHistorySetCompactSize (size_t bytes)
+{
+    lnSessionHistorySetCompactSize(lnDefaultSession(), bytes);
+}
+
 /* Save the history in the specified file. On success 0 is returned
- * otherwise -1 is returned. */
+ * otherwise -1 is returned.  The file is written under a temporary name
+ * and renamed, a loaded history may still be mapped from the old one. */
 int
-linenoiseHistorySave (const char *filename)
+lnSessionHistorySave (lnSession *ses, const char *filename)
 {
-    FILE *fp = fopen(filename, "w");
+    string tmp = string(filename) + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
     
     if (fp == NULL) return -1;
-    for (auto s : history) 
-        fprintf(fp, "%s\n", s.c_str());
-    fclose(fp);
+    auto &history = ses->ses_history;
+    for (size_t i = 0; i < history.size(); i++)
+	if (history.live(i))
+	    fprintf(fp, "%.*s\n", (int) history[i].size(), history[i].data());
+    if (fclose(fp) == EOF || rename(tmp.c_str(), filename) == -1) {
+	unlink(tmp.c_str());
+	return -1;
+    }
     return 0;
 }
 
+int
+linenoiseHistorySave (const char *filename)
+{
+    return lnSessionHistorySave(lnDefaultSession(), filename);
+}
+
 /* Load the history from the specified file. If the file does not exist
  * zero is returned and no operation is performed.
  *
  * If the file exists and the operation succeeded 0 is returned, otherwise
  * on error -1 is returned. */
+int
+lnSessionHistoryLoad (lnSession *ses, const char *filename)
+{
+    /* Only the newest lines are read, see history_c::load() */
+    return ses->ses_history.load(filename);
+}
+
 int
 linenoiseHistoryLoad (const char *filename)
 {
-    FILE *fp = fopen(filename, "r");
-    char buf[LN_MAX_LINE];
-    
-    if (fp == NULL) return -1;
+    return lnSessionHistoryLoad(lnDefaultSession(), filename);
+}
+
+#ifdef _TEST
+
+#include <new>
+
+#define TEST(x) if (!(x)) assert(0)
+
+/* Every allocation is counted, to check the steady state makes none */
+static unsigned long allocs;
+
+void *
+operator new (size_t size)
+{
+    void *p;
+
+    allocs++;
+    if (!(p = malloc(size ? size : 1)))
+	throw bad_alloc();
+    return p;
+}
+
+void
+operator delete (void *p) noexcept
+{
+    free(p);
+}
+
+void
+operator delete (void *p, size_t) noexcept
+{
+    free(p);
+}
+
+static int asked;
+
+static void
+completeCmds (const char *buf, linenoiseCompletions *lc)
+{
+    char tok[32];
+
+    asked++;
+    for (int i = 0; i < 50; i++) {
+	snprintf(tok, sizeof(tok), "show interface ethernet%d", i);
+	if (strncmp(tok, buf, strlen(buf)) == 0 &&
+	    linenoiseAddCompletion(lc, tok, "a longer help string than fits in a short string"))
+	    break;
+    }
+}
+
+/* Allocations made by typing keys, after typing them once to warm up. */
+static unsigned long
+keyAllocs (lnSession *ses, const char *keys)
+{
+    unsigned long before;
+
+    for (int i = 0; i < 2; i++) {
+	before = allocs;
+	TEST(lnEditFeed(ses, keys, strlen(keys)) == LN_EDIT_MORE);
+    }
+    return allocs - before;
+}
+
+/* Finish the line and start the next, returns what lnEditStart() did. */
+static int
+nextLine (lnSession *ses, string &line)
+{
+    char *s = lnEditStop(ses);
+
+    line = s ? s : "(null)";
+    free(s);
+    return lnEditStart(ses, "> ");
+}
+
+int
+main ()
+{
+    int null = open("/dev/null", O_WRONLY);
+    lnSession *ses = lnSessionCreate(null, null);
+    string paste, line;
+    int rc, lines;
 
-    while (fgets(buf, LN_MAX_LINE, fp) != NULL) {
-        char *p;
-        
-        p = strchr(buf, '\r');
-        if (!p) p = strchr(buf, '\n');
-        if (p) *p = '\0';
-        linenoiseHistoryAdd(buf);
+    /* A paste of many lines, far more than the input ring holds */
+    for (int i = 0; i < 1000; i++) {
+	string_fmt_c s;
+
+	s.format("echo line %d\r", i);
+	paste += s;
+    }
+    TEST(paste.size() > 2 * LN_INPUT_SIZE);
+    TEST(lnEditStart(ses, "> ") == LN_EDIT_MORE);
+    rc = lnEditFeed(ses, paste.data(), paste.size());
+    for (lines = 0; rc == LN_EDIT_DONE; lines++) {
+	string_fmt_c want;
+
+	want.format("echo line %d", lines);
+	rc = nextLine(ses, line);
+	TEST(line == want);
     }
+    TEST(lines == 1000 && rc == LN_EDIT_MORE);
+
+    /* Lines queued behind the one that's done are handled by the start */
+    TEST(lnEditFeed(ses, "ls\rpwd\rdat", 10) == LN_EDIT_DONE);
+    TEST(nextLine(ses, line) == LN_EDIT_DONE && line == "ls");
+    TEST(nextLine(ses, line) == LN_EDIT_MORE && line == "pwd");
+    TEST(lnEditTimeout(ses) == -1);
+    TEST(lnEditFeed(ses, "e\r", 2) == LN_EDIT_DONE);
+    TEST(nextLine(ses, line) == LN_EDIT_MORE && line == "date");
+    lnEditStop(ses);
+
+    /* Lines cancelled every way leave no blank history entries */
+    size_t entries;
+    char tmp[] = "/tmp/test_linenoise.XXXXXX";
+    FILE *fp;
+
+    lnSessionHistoryAdd(ses, "real");
+    entries = ses->ses_history.size();
+    for (int i = 0; i < 5; i++) {
+	TEST(lnEditStart(ses, "> ") == LN_EDIT_MORE);
+	TEST(lnEditFeed(ses, "\x03", 1) == LN_EDIT_DONE);
+	TEST(lnEditStop(ses) == NULL);
+    }
+    TEST(lnEditStart(ses, "> ") == LN_EDIT_MORE);
+    TEST(lnEditFeed(ses, "\x04", 1) == LN_EDIT_DONE);
+    TEST(lnEditStop(ses) == NULL);
+    TEST(lnEditStart(ses, "> ") == LN_EDIT_MORE);
+    TEST(lnEditStop(ses) == NULL);
+    TEST(lnEditStart(ses, "> ") == LN_EDIT_MORE);
+    TEST(lnEditFeed(ses, "x\r", 2) == LN_EDIT_DONE);
+    TEST(nextLine(ses, line) == LN_EDIT_MORE && line == "x");
+    lnEditStop(ses);
+    TEST(ses->ses_history.size() == entries);
+
+    close(mkstemp(tmp));
+    TEST(lnSessionHistorySave(ses, tmp) == 0);
+    TEST((fp = fopen(tmp, "r")) != NULL);
+    line.clear();
+    for (int c; (c = getc(fp)) != EOF; )
+	line += c;
     fclose(fp);
+    unlink(tmp);
+    TEST(line == "real\n");
+
+    /* A prompt that can't be written leaves the session as it was */
+    int bad = dup(null);
+    lnSession *ses2;
+
+    close(bad);
+    ses2 = lnSessionCreate(null, bad);
+    entries = ses2->ses_history.size();
+    TEST(lnEditStart(ses2, "> ") == -1 && errno == EBADF);
+    TEST(ses2->ses_history.size() == entries);
+    TEST(dup2(null, bad) == bad);
+    TEST(lnEditStart(ses2, "> ") == LN_EDIT_MORE);
+    TEST(lnEditStart(ses2, "> ") == -1 && errno == EBUSY);
+    TEST(lnEditFeed(ses2, "ok\r", 3) == LN_EDIT_DONE);
+    TEST(nextLine(ses2, line) == LN_EDIT_MORE && line == "ok");
+    lnEditStop(ses2);
+    TEST(ses2->ses_history.size() == entries);
+    lnSessionDestroy(ses2);
+    close(bad);
+
+    /*
+     * TAB and '?' make no allocations once the completions have been
+     * asked for and listed before: from the callback, cached and not,
+     * and from the dictionary.
+     */
+    const char *keys = "\x15show i\t??\t\x15show interface ethernet1\t?";
+
+    lnSessionSetCompletionCallback(ses, completeCmds);
+    TEST(lnEditStart(ses, "> ") == LN_EDIT_MORE);
+    TEST(keyAllocs(ses, keys) == 0 && asked > 2);
+    lnSessionSetCompletionCache(ses, 1);
+    TEST(keyAllocs(ses, keys) == 0);
+    for (int i = 0; i < 50; i++) {
+	string_fmt_c tok;
+
+	tok.format("show interface ethernet%d", i);
+	lnSessionDictAdd(ses, tok.c_str(), "a longer help string than fits in a short string");
+    }
+    TEST(keyAllocs(ses, keys) == 0);
+    lnEditStop(ses);
+
+    lnSessionDestroy(ses);
+    close(null);
+    printf("all test passed\n");
     return 0;
 }
+#endif
@@ -5,25 +5,165 @@
 #ifndef __LINENOISE_H
 #define __LINENOISE_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef void *linenoiseCompletions;
 typedef void (linenoiseCompletionFunc)(const char *, linenoiseCompletions *);
+typedef size_t (linenoiseCompletionCountFunc)(const char *);
+
+/*
+ * Highlighting.  The callback is a tokenizer: it's handed the line from
+ * the start of a token on, len bytes not NUL terminated, and the state
+ * it said it was in there, 0 at the start of the line.  It reports the
+ * tokens in order with linenoiseAddHighlight(), each with its SGR style
+ * ("1;34", NULL for plain) and its state after the token, and stops
+ * when that returns 1.  After an edit it's called from a token or so
+ * before it, and stopped once it's back in step with what it said
+ * before, so typing doesn't tokenize the whole line again.
+ *
+ * The hint callback gets the line when it changes with the cursor at
+ * its end, and returns text to show after it, kept until the next call,
+ * or NULL.  *style is its SGR style, faint if left NULL.
+ */
+typedef void *linenoiseHighlights;
+typedef void (linenoiseHighlightFunc)(const char *text, size_t len, int state,
+				      linenoiseHighlights hl);
+typedef const char *(linenoiseHintFunc)(const char *line, const char **style);
+
+/* Counters for checking the syscall behaviour of the editor */
+typedef struct lnStats {
+    unsigned long lns_read_calls;	/* read() calls on the input fd */
+    unsigned long lns_read_bytes;	/* bytes returned by those calls */
+    unsigned long lns_keys;		/* key handlers dispatched */
+    unsigned long lns_partial_keys;	/* keys held waiting for more bytes */
+    unsigned long lns_partial_timeouts;	/* ... of which hit the key timeout */
+    unsigned long long lns_partial_wait_us;	/* total time held */
+    unsigned long long lns_partial_wait_max_us;	/* longest time held */
+    unsigned long lns_history_dups;	/* adds that moved an older copy */
+    unsigned long long lns_history_dup_bytes;	/* history text not stored twice */
+    unsigned long lns_journal_appends;	/* lines appended to the journal */
+    unsigned long lns_journal_syncs;	/* fsyncs of the journal */
+    unsigned long lns_journal_compactions;	/* rewrites as a snapshot */
+    unsigned long lns_journal_reads;	/* lines added by other processes */
+    unsigned long lns_completion_hits;	/* completions from the cache */
+    unsigned long lns_completion_misses;	/* ... and from the callback */
+    unsigned long lns_write_calls;	/* write() calls on the output fd */
+    unsigned long long lns_write_bytes;	/* bytes written by those calls */
+    unsigned long lns_key_bytes_max;	/* most written for one key */
+    unsigned long lns_write_blocked;	/* writes ofd was too full for */
+    unsigned long lns_rows_drawn;	/* rows a multi-line refresh changed */
+    unsigned long long lns_highlight_bytes;	/* text tokenized for highlighting */
+} lnStats;
+
+/*
+ * A session owns all the state of one editor: terminal, key bindings,
+ * history and completion.  The calls below without a session argument
+ * work on a default session reading stdin and writing stdout.
+ */
+typedef struct lnSession lnSession;
+
+lnSession *lnSessionCreate(int ifd, int ofd);
+void lnSessionDestroy(lnSession *ses);
+
+void lnSessionSetCompletionCallback(lnSession *ses, linenoiseCompletionFunc fn);
+void lnSessionSetCompletionCountCallback(lnSession *ses, linenoiseCompletionCountFunc fn);
+void lnSessionSetCompletionCache(lnSession *ses, int on);
+void lnSessionCompletionCacheClear(lnSession *ses);
+void lnSessionSetCompletionAsync(lnSession *ses, int on);
+void lnSessionSetCompletionPrefetch(lnSession *ses, int on);
+void lnSessionDictAdd(lnSession *ses, const char *token, const char *help);
+void lnSessionDictClear(lnSession *ses);
+void lnSessionSetHighlightCallback(lnSession *ses, linenoiseHighlightFunc fn);
+void lnSessionSetHintCallback(lnSession *ses, linenoiseHintFunc fn);
+char *lnSessionLine(lnSession *ses, const char *prompt);
+int lnSessionHistoryAdd(lnSession *ses, const char *line);
+int lnSessionHistorySetMaxLen(lnSession *ses, int len);
+int lnSessionHistorySave(lnSession *ses, const char *filename);
+int lnSessionHistoryLoad(lnSession *ses, const char *filename);
+void lnSessionHistorySetEraseDups(lnSession *ses, int on);
+int lnSessionHistoryJournal(lnSession *ses, const char *filename);
+int lnSessionHistoryShare(lnSession *ses, const char *filename);
+void lnSessionHistorySetSyncInterval(lnSession *ses, int ms);
+void lnSessionHistorySetCompactSize(lnSession *ses, size_t bytes);
+
+/*
+ * Event driven editing, for hosts running many sessions from one
+ * event loop.  Feed the session's input as it arrives; once
+ * lnEditFeed() returns LN_EDIT_DONE the line is fetched with
+ * lnEditStop().  Input after the end of a line is kept for the next,
+ * so lnEditStart() can return LN_EDIT_DONE too.  When lnEditTimeout()
+ * returns 0, lnEditFeed(ses, NULL, 0) handles the pending input.
+ * lnEditStart() returns -1 with errno EBUSY when the session is already
+ * editing, or with write()'s errno when the prompt can't be written, in
+ * which case the session is left as it was.
+ */
+#define LN_EDIT_MORE	0	/* line is still being edited */
+#define LN_EDIT_DONE	1	/* line is ready */
+
+int lnEditStart(lnSession *ses, const char *prompt);
+int lnEditFeed(lnSession *ses, const char *bytes, size_t len);
+int lnEditTimeout(lnSession *ses);
+char *lnEditStop(lnSession *ses);
+void lnSessionSetColumns(lnSession *ses, int cols);
+void lnSessionSetMultiLine(lnSession *ses, int on);
+
+/*
+ * The fuzzy finder scores large histories in the background.  Poll
+ * lnSessionWakeFd() for reading along with the input and call
+ * lnEditWake() when it's readable, to show the matches.
+ */
+int lnSessionWakeFd(lnSession *ses);
+int lnEditWake(lnSession *ses);
+
+/*
+ * Output is written once per batch of keys.  If ofd is non-blocking and
+ * full, poll it for writing too while lnEditOutputPending() is non-zero
+ * and call lnEditFlush() when it's writable.
+ */
+size_t lnEditOutputPending(lnSession *ses);
+int lnEditFlush(lnSession *ses);
+
+int lnSessionEnableRawMode(lnSession *ses);
+void lnSessionDisableRawMode(lnSession *ses);
+void lnSessionGetStats(lnSession *ses, lnStats *stats);
+void lnSessionSetKeyTimeout(lnSession *ses, int ms);
 
 void linenoiseSetCompletionCallback(linenoiseCompletionFunc fn);
-void linenoiseAddCompletion(linenoiseCompletions, const char *, const char *);
+void linenoiseSetCompletionCountCallback(linenoiseCompletionCountFunc fn);
+void linenoiseSetCompletionCache(int on);
+void linenoiseCompletionCacheClear(void);
+void linenoiseSetCompletionAsync(int on);
+void linenoiseSetCompletionPrefetch(int on);
+void linenoiseDictAdd(const char *token, const char *help);
+void linenoiseDictClear(void);
+int linenoiseAddCompletion(linenoiseCompletions, const char *, const char *);
+int linenoiseCompletionCancelled(linenoiseCompletions);
+void linenoiseSetHighlightCallback(linenoiseHighlightFunc fn);
+void linenoiseSetHintCallback(linenoiseHintFunc fn);
+int linenoiseAddHighlight(linenoiseHighlights, size_t len, const char *style, int state);
 
 char *linenoise(const char *prompt);
 int linenoiseHistoryAdd(const char *line);
 int linenoiseHistorySetMaxLen(int len);
 int linenoiseHistorySave(const char *filename);
 int linenoiseHistoryLoad(const char *filename);
+void linenoiseHistorySetEraseDups(int on);
+int linenoiseHistoryJournal(const char *filename);
+int linenoiseHistoryShare(const char *filename);
+void linenoiseHistorySetSyncInterval(int ms);
+void linenoiseHistorySetCompactSize(size_t bytes);
 
 int lnEnableRawMode(int);
 void lnDisableRawMode(int);
 
+void lnGetStats(lnStats *stats);
+void lnSetKeyTimeout(int ms);
+void linenoiseSetMultiLine(int on);
+
 #ifdef __cplusplus
 }
 #endif
@@ -7,7 +7,21 @@
 #define LINENOISE_PRIVATE_H
 
 #include <functional>
+#include <memory>
+#include <string>
 #include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <termios.h>
+
+#include "linenoise.h"
+#include "string_fmt.h"
+#include "gap_buffer.h"
+#include "highlight.h"
+#include "history.h"
+#include "fuzzy.h"
+#include "journal.h"
+#include "completion.h"
 
 #define UNUSED __attribute__((unused))
 
@@ -28,9 +42,212 @@
 /* non-zero to exit, returning status */
 typedef std::function<int (int ch)> cmd_func;
 
+/*
+ * Input ring buffer.  Everything available on the fd is drained with a
+ * single read() and keys are decoded from memory.  Chars pushed back
+ * with lnPushChar() go to the front of the ring, so they are the next
+ * ones returned.
+ */
+#define LN_INPUT_SIZE 4096	/* must be a power of 2 */
+
+class ln_input_c {
+public:
+    ln_input_c() : in_head(0), in_tail(0), in_reads(0), in_bytes(0) {};
+
+    size_t size (void) const { return in_tail - in_head; }
+    char peek (size_t i) const { return in_buf[(in_head + i) & (LN_INPUT_SIZE - 1)]; }
+    char get (void) { return in_buf[in_head++ & (LN_INPUT_SIZE - 1)]; }
+    void consume (size_t n) { in_head += n; }
+    void unget (char ch);
+    size_t put (const char *bytes, size_t len);
+    int fill (int fd);
+
+public:
+    char in_buf[LN_INPUT_SIZE];
+    size_t in_head;		/* next char to hand out */
+    size_t in_tail;		/* one past the last char read */
+
+    unsigned long in_reads;	/* read() calls made by fill() */
+    unsigned long in_bytes;	/* bytes returned by those calls */
+};
+
+/*
+ * Key sequences are registered into a tree of key_node_c, which is only
+ * the front end.  Before keys are read the tree is compiled into a flat
+ * table with one 256 entry transition row per interior node, so
+ * decoding a key is one array index per byte.
+ */
+class key_node_c;
+typedef std::vector<key_node_c *> cmd_vec_t;
+
+class key_node_c {
+public:
+    key_node_c (int ch) : kn_ch(ch), kn_handler(-1) {};
+    ~key_node_c () { for (auto kn : kn_children) delete kn; }
+
+public:
+    int kn_ch;
+    int kn_handler;		/* index into ses_handlers, -1 if none */
+
+    cmd_vec_t kn_children;
+};
+
+/*
+ * A compiled state.  ks_next[ch] is 0 when ch doesn't continue any
+ * sequence, > 0 for the next state and < 0 for a complete key, whose
+ * handler index is KS_HANDLER(ks_next[ch]).  ks_handler is the key
+ * that ends at this state when no more bytes follow in time, -1 if
+ * the chars so far are only a prefix.
+ */
+struct key_state_s {
+    int16_t ks_next[256];
+    int ks_handler;
+};
+
+/*
+ * How long to wait for the rest of a partial sequence, so a bare ESC
+ * isn't held until the next key.  Negative waits forever.
+ */
+#define LN_KEY_TIMEOUT_MS 100
+
+#define LN_DEFAULT_HISTORY_MAX_LEN 100
+
+/* The linenoiseState structure represents the state during line editing.
+ * We pass this state to functions implementing specific editing
+ * functionalities. */
+struct linenoiseState {
+    lnSession *ses;     /* Session this edit belongs to. */
+    int ifd;            /* Terminal stdin file descriptor. */
+    int ofd;            /* Terminal stdout file descriptor. */
+    gap_buffer_c *line; /* Edited line, the session's ses_line. */
+    const char *prompt; /* Prompt to display. */
+    size_t plen;        /* Prompt length. */
+    size_t pcols;       /* Prompt width in columns. */
+    size_t pos;         /* Current cursor position. */
+    size_t oldpos;      /* Previous refresh cursor position. */
+    size_t len;         /* Current edited line length. */
+    size_t cols;        /* Number of columns in terminal. */
+
+    int history_search; /* 1 if we are searching history */
+    int history_index;
+
+    int completing;     /* 1 after a TAB completion, until another key */
+    int complete_wait;  /* TAB or '?' waiting for async completions */
+    size_t help_offset; /* first completion of the next '?' page */
+
+    int fuzzy;          /* 1 while the fuzzy finder is open */
+    int fuzzy_sel;      /* highlighted row of its matches */
+
+    char utf8_pend[4];  /* bytes of a UTF-8 char being typed */
+    int utf8_len;
+
+    int edit_done;      /* set non-zero when done with editing line */
+    int ret_code;	/* return code to linenoise() */
+};
+
+/*
+ * Everything one editor needs.  Nothing here is shared between
+ * sessions, so sessions can run on their own threads without locking.
+ * The linenoise*() calls without a session argument use the default
+ * session on stdin/stdout.
+ */
+struct lnSession {
+    lnSession(int ifd, int ofd);
+    ~lnSession();
+
+    int ses_ifd;
+    int ses_ofd;
+
+    ln_input_c ses_input;
+
+    /* Key state machine, see key_state_machine.cpp */
+    key_node_c ses_keys;
+    std::vector<cmd_func> ses_handlers;
+    std::vector<key_state_s> ses_states;
+    int ses_states_dirty;
+    int ses_key_timeout_ms;
+    uint64_t ses_partial_start;	/* usec when the held bytes arrived */
+
+    lnStats ses_stats;
+
+    struct termios ses_orig_termios;	/* In order to restore at exit.*/
+    int ses_rawmode;		/* For lnDisableRawMode() to check if restore is needed */
+
+    linenoiseCompletionFunc *ses_completion;
+    linenoiseCompletionCountFunc *ses_complete_count;
+    completion_cache_c ses_complete_cache;
+    completion_set_c ses_complete_set;	/* filled by the callback */
+    int ses_complete_cache_on;
+    completion_trie_c ses_dict;
+    std::string ses_complete_lcp;	/* the dictionary's, for completeLine() */
+    std::unique_ptr<completion_async_c> ses_complete_async;
+    int ses_complete_prefetch;
+
+    history_c ses_history;
+    history_search_c ses_search;
+    std::unique_ptr<fuzzy_finder_c> ses_fuzzy;
+    std::vector<fuzzy_hit_s> ses_fuzzy_hits;
+    int ses_wake_fd;		/* readable when background work is done */
+    int ses_wake_notify;	/* ... written by the workers */
+    std::unique_ptr<history_journal_c> ses_journal;
+    std::string ses_yank_buffer;
+
+    linenoiseState ses_state;
+    int ses_keys_bound;		/* editing keys are bound to ses_state */
+
+    /* What the terminal shows of the line, see refreshSingleLine() */
+    int ses_screen_valid;	/* 0 when it has to be redrawn in full */
+    size_t ses_screen_col;	/* where its cursor is */
+    std::string ses_screen;	/* prompt and buffer, as shown */
+    std::string ses_screen_next;	/* ... being drawn */
+    std::string ses_screen_attr;	/* style of each of its bytes, or none */
+    std::string ses_screen_next_attr;
+
+    /* Multi-line mode, see refreshMultiLine() */
+    int ses_multiline;
+    size_t ses_screen_row;	/* row of the cursor, from the prompt's */
+    std::vector<std::string> ses_rows;	/* rows as shown, but the cursor's */
+    std::vector<std::string> ses_row_attrs;	/* ... their styles */
+    std::vector<size_t> ses_row_starts;	/* ... and where they start */
+
+    /* Highlighting and hints, see lnHighlight() */
+    linenoiseHighlightFunc *ses_highlight;
+    linenoiseHintFunc *ses_hint;
+    highlight_cache_c ses_hl;
+    std::string ses_hint_text;	/* for the line as it was asked for */
+    unsigned char ses_hint_style;
+    int ses_hint_stale;		/* the line changed since */
+
+    /* Output of the keys being handled, see lnSessionFlush() */
+    string_fmt_c ses_frame;
+    size_t ses_frame_sent;	/* written so far, the rest is pending */
+
+    /* lnEditStart() and friends */
+    int ses_editing;		/* an event driven edit is in progress */
+    int ses_cols;		/* width when ofd can't tell */
+    std::string ses_prompt;
+    std::string ses_feed;	/* fed input the ring had no room for */
+    size_t ses_feed_off;	/* ... the part already in the ring */
+    gap_buffer_c ses_line;	/* the line being edited */
+};
+
+lnSession *lnDefaultSession(void);
+
+/* lnSessionDispatchKeys() results, also used inside the key matcher */
+enum { KEY_MATCH, KEY_NOMATCH, KEY_PARTIAL };
+
+void lnSessionWake(lnSession *ses);
+ssize_t lnSessionFlush(lnSession *ses, int wait);
+
+void lnSessionAddKeyHandler(lnSession *ses, const char *seq, cmd_func func);
+int lnSessionHandleKeys(lnSession *ses, int *done);
+int lnSessionDispatchKeys(lnSession *ses, int *done, int flush, int *ret);
+int lnSessionKeyTimeout(lnSession *ses);
+void lnPushChar(lnSession *ses, char ch);
+int lnReadChar(lnSession *ses, char *ch);
+
 void lnAddKeyHandler(const char *seq, cmd_func func);
 int lnHandleKeys(int fd, int *done);
-void lnPushChar(char ch);
 
 
 #endif
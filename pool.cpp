@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2015, Wing Eng
+ * All rights reserved.
+ */
+#include "pool.h"
+
+using namespace std;
+
+/* One thread per core, up to max_threads. */
+work_pool_c::
+work_pool_c (unsigned max_threads)
+{
+    unsigned n = thread::hardware_concurrency();
+
+    if (n > max_threads) n = max_threads;
+    if (n < 1) n = 1;
+
+    for (unsigned i = 0; i < n; i++) {
+	wp_threads.emplace_back(&work_pool_c::run, this);
+	wp_threads.back().detach();
+    }
+}
+
+void work_pool_c::
+submit (function<void ()> task)
+{
+    lock_guard<mutex> lock(wp_lock);
+
+    wp_queue.push_back(std::move(task));
+    wp_cond.notify_one();
+}
+
+void work_pool_c::
+run (void)
+{
+    while (1) {
+	function<void ()> task;
+
+	{
+	    unique_lock<mutex> lock(wp_lock);
+
+	    wp_cond.wait(lock, [this] { return !wp_queue.empty(); });
+	    task = std::move(wp_queue.front());
+	    wp_queue.pop_front();
+	}
+	task();
+    }
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2015, Wing Eng
+ * All rights reserved.
+ */
+#ifndef POOL_H
+#define POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Worker threads shared by the sessions.  Started on first use and never
+ * stopped, the workers just sleep when there is nothing queued.  Tasks
+ * have to outlive nothing but themselves: whoever submits one waits for
+ * it before freeing what it uses.
+ */
+class work_pool_c {
+public:
+    work_pool_c (unsigned max_threads);
+
+    size_t size (void) const { return wp_threads.size(); }
+    void submit (std::function<void ()> task);
+
+private:
+    void run (void);
+
+    std::mutex wp_lock;
+    std::condition_variable wp_cond;
+    std::deque<std::function<void ()>> wp_queue;
+    std::vector<std::thread> wp_threads;
+};
+
+#endif
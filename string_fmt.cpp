@@ -2,34 +2,103 @@
  * Copyright (c) 2015, Wing Eng
  * All rights reserved.
  */
-#include <alloca.h>
+#include <algorithm>
 #include <stdarg.h>
+#include <stdio.h>
 #include <assert.h>
 
 #include "string_fmt.h"
 
+#define FMT_ROOM_MIN	64	/* room to format in, at the least */
+#define FMT_BUF_SIZE	256	/* format()'s on the stack */
+
+/* Up at once to what output needed, down slowly */
+void string_fmt_c::
+used (size_t n)
+{
+    if (n > sf_room)
+	sf_room = n;
+    else
+	sf_room -= (sf_room - n) / 16;
+}
+
+/*
+ * Format at pos, replacing what's after it, straight into the string:
+ * it's resized over the room, formatted into and cut back to what was
+ * written.  The room is the spare capacity, grown only when there's
+ * less than FMT_ROOM_MIN.  resize() zeroes what it adds though, so it
+ * only goes as far as output has needed lately, sf_room.  In the steady
+ * state, a frame appended to again and again, that's one pass with no
+ * copy.  Output that doesn't fit, from vsnprintf() the slow way, is
+ * formatted again into as much as it needs.
+ */
+void string_fmt_c::
+vput (size_t pos, const char *fmt, va_list ap)
+{
+    size_t room = std::max(sf_room, (size_t) FMT_ROOM_MIN);
+    size_t spare = capacity() - pos;
+    va_list apc;
+    int n;
+
+    if (room > spare && spare >= FMT_ROOM_MIN)
+	room = spare;
+    resize(pos + room);
+
+    /* The terminating NUL goes in the string's own, at [size()] */
+    va_copy(apc, ap);
+    n = vsnprintf(&(*this)[pos], room + 1, fmt, apc);
+    va_end(apc);
+
+    if (n > (int) room) {
+	resize(pos + n);
+	va_copy(apc, ap);
+	n = vsnprintf(&(*this)[pos], n + 1, fmt, apc);
+	va_end(apc);
+    }
+    if (n < 0) {
+	assert(0);
+	n = 0;
+    }
+    resize(pos + n);
+    used(n);
+}
+
+/*
+ * Replace the text.  What fits on the stack is formatted there and
+ * copied in, which is no more than a memcpy() into a string that's held
+ * as much before, where resizing over the room would zero it first.
+ * Output longer than that, now or lately, is formatted in place.
+ */
 void string_fmt_c::
 vformat (const char *fmt, va_list ap)
 {
-    int buf_sz = 256;
-			
-    while (1) {  
-	char *buf = (char *) alloca(buf_sz);
-	
+    if (sf_room < FMT_BUF_SIZE) {
+	char buf[FMT_BUF_SIZE];
 	va_list apc;
+	int n;
+
 	va_copy(apc, ap);
-        int n = vsnprintf(buf, buf_sz, fmt, apc);
-	
-        if (n > -1 && n < buf_sz) {
-	    *this = buf;
-	    return;
-        }
-        if (n > -1)  // Needed size returned
-            buf_sz = n + 1;   // For null char
-        else {
+	n = vsnprintf(buf, sizeof(buf), fmt, apc);
+	va_end(apc);
+
+	if (n < 0) {
 	    assert(0);
+	    clear();
+	    return;
+	}
+	used(n);
+	if (n < (int) sizeof(buf)) {
+	    assign(buf, n);
+	    return;
 	}
     }
+    vput(0, fmt, ap);
+}
+
+void string_fmt_c::
+vappend (const char *fmt, va_list ap)
+{
+    vput(size(), fmt, ap);
 }
 
 void string_fmt_c::
@@ -41,23 +110,94 @@ format (const char *fmt, ...)
     vformat(fmt, ap);
     va_end(ap);
 }
-	
+
 void string_fmt_c::
 append (const char *fmt, ...)
 {
-    string_fmt_c tmp;
-    
     va_list ap;
-    va_start(ap, fmt);
-    tmp.vformat(fmt, ap);
 
-    *this += tmp;
+    va_start(ap, fmt);
+    vappend(fmt, ap);
+    va_end(ap);
 }
 
 #ifdef _TEST
 
+#include <alloca.h>
+#include <chrono>
+
 #define TEST(x) if (!(x)) assert(0)
 
+/* The implementation before, for the benchmarks */
+static void
+oldVformat (std::string &s, const char *fmt, va_list ap)
+{
+    int buf_sz = 256;
+
+    while (1) {
+	char *buf = (char *) alloca(buf_sz);
+
+	va_list apc;
+	va_copy(apc, ap);
+	int n = vsnprintf(buf, buf_sz, fmt, apc);
+	va_end(apc);
+
+	if (n > -1 && n < buf_sz) {
+	    s = buf;
+	    return;
+	}
+	buf_sz = n + 1;
+    }
+}
+
+static void
+oldFormat (std::string &s, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    oldVformat(s, fmt, ap);
+    va_end(ap);
+}
+
+static void
+oldAppend (std::string &s, const char *fmt, ...)
+{
+    std::string tmp;
+    va_list ap;
+
+    va_start(ap, fmt);
+    oldVformat(tmp, fmt, ap);
+    va_end(ap);
+    s += tmp;
+}
+
+/*
+ * ns per call of the new and the old code, best of runs taken in turn,
+ * so that noise from the machine hits both the same.
+ */
+template <class F, class G> static void
+bench (const char *what, F fn, G old)
+{
+    const int calls = 20000;
+    double best[2] = { 1e9, 1e9 };
+
+    for (int run = 0; run < 100; run++) {
+	auto t0 = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < calls; i++) {
+	    if (run % 2)
+		old(i);
+	    else
+		fn(i);
+	}
+	std::chrono::duration<double, std::nano> d =
+	    std::chrono::steady_clock::now() - t0;
+	best[run % 2] = std::min(best[run % 2], d.count() / calls);
+    }
+    printf("%s: %.1f ns, was %.1f ns\n", what, best[0], best[1]);
+}
+
 int
 main ()
 {
@@ -71,6 +211,86 @@ main ()
     s1.append("some %d", 55);
     TEST(s1 == "this 'thing' is 99\nsome 55");
 
+    /* Checked formats, with std::string arguments */
+    static_assert(fmtCheck<const char *, int>("'%s' is %d"));
+    static_assert(fmtCheck<std::string>("%s"));
+    static_assert(!fmtCheck<std::string>("%d"));
+    static_assert(fmtCheck<size_t, char, bool>("%zu %c %d"));
+    static_assert(!fmtCheck<int>("%zu") && !fmtCheck<size_t>("%d"));
+    static_assert(fmtCheck<int, const char *, int, const char *>("%-20.*s %.*s"));
+    static_assert(!fmtCheck<size_t, const char *>("%.*s"));
+    static_assert(fmtCheck<double, long double>("%.1f %Lg") && !fmtCheck<int>("%f"));
+    static_assert(fmtCheck<>("100%%") && fmtCheck<void *>("%p"));
+    static_assert(!fmtCheck<int>("%d %d") && !fmtCheck<int, int>("%d"));
+    static_assert(!fmtCheck<int *>("%n") && !fmtCheck<int>("%"));
+
+    std::string thing("thing");
+
+    s1.format("this '%s' is %d"_fmt, thing, 99);
+    TEST(s1 == "this 'thing' is 99");
+    s1.append(" and %s"_fmt, s);
+    TEST(s1 == "this 'thing' is 99 and abc");
+
+    /* Longer than the room it's first formatted in, and empty */
+    std::string big(1000, 'x');
+
+    s1.format("<%s>", big.c_str());
+    TEST(s1 == "<" + big + ">");
+    s1.append("%s", "");
+    TEST(s1 == "<" + big + ">");
+    for (int i = 0; i < 1000; i++)
+	s.append("%d,", i % 10);
+    TEST(s.size() == 3 + 2000 && s.compare(3, 4, "0,1,") == 0);
+
+    /* Appending to a reused frame doesn't allocate once it has grown */
+    const char *data;
+
+    s.clear();
+    data = s.data();
+    for (int i = 0; i < 100; i++)
+	s.append("\x1b[%dC", i);
+    TEST(s.data() == data);
+
+    /* What a refresh and a completion listing append to the frame */
+    std::string old;
+
+    bench("append escape", [&] (int i) {
+	    if (i % 64 == 0) s.clear();
+	    s.append("\x1b[0G\x1b[%dC", i % 80);
+	}, [&] (int i) {
+	    if (i % 64 == 0) old.clear();
+	    oldAppend(old, "\x1b[0G\x1b[%dC", i % 80);
+	});
+    string_fmt_c grown;
+    std::string grown_old;
+
+    grown.reserve(1 << 16);
+    grown_old.reserve(1 << 16);
+    bench("append escape, 64K frame", [&] (int i) {
+	    if (i % 64 == 0) grown.clear();
+	    grown.append("\x1b[0G\x1b[%dC", i % 80);
+	}, [&] (int i) {
+	    if (i % 64 == 0) grown_old.clear();
+	    oldAppend(grown_old, "\x1b[0G\x1b[%dC", i % 80);
+	});
+    bench("append listing", [&] (int i) {
+	    if (i % 16 == 0) s.clear();
+	    s.append("\r\n %-20.*s %.*s", 5, "hello", 14, "help for hello");
+	}, [&] (int i) {
+	    if (i % 16 == 0) old.clear();
+	    oldAppend(old, "\r\n %-20.*s %.*s", 5, "hello", 14, "help for hello");
+	});
+    bench("format prompt", [&] (int i) {
+	    s.format("(history-i-search [%d]) '%s': ", i, "ls -l");
+	}, [&] (int i) {
+	    oldFormat(old, "(history-i-search [%d]) '%s': ", i, "ls -l");
+	});
+    bench("format 1000 bytes", [&] (int i) {
+	    s.format("%s %d", big.c_str(), i);
+	}, [&] (int i) {
+	    oldFormat(old, "%s %d", big.c_str(), i);
+	});
+
     printf("all test passed\n");
     return 0;
 }
@@ -5,17 +5,203 @@
 #ifndef STRING_FMT_H
 #define STRING_FMT_H
 
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string>
+#include <type_traits>
 
+#define FMT_PRINTF(f, a)	__attribute__((format(printf, f, a)))
+
+/*
+ * A format string checked at compile time, "%s is %d"_fmt.  The
+ * literal becomes a type, so fmtCheck() can go through its conversions
+ * in a static_assert.  That takes a string literal operator template,
+ * a GNU extension g++ and clang have; -Wpedantic's warning about it is
+ * turned off where it's defined.
+ */
+template <char... cs>
+struct fmt_literal_s {
+    static constexpr char fl_text[] = { cs..., '\0' };
+};
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#ifdef __clang__
+#pragma GCC diagnostic ignored "-Wgnu-string-literal-operator-template"
+#endif
+template <class C, C... cs>
+constexpr fmt_literal_s<cs...>
+operator""_fmt ()
+{
+    return {};
+}
+#pragma GCC diagnostic pop
+
+/* What an argument is to printf: its kind and size once promoted. */
+enum { FMT_ARG_INT, FMT_ARG_DOUBLE, FMT_ARG_LDOUBLE, FMT_ARG_STR, FMT_ARG_PTR,
+       FMT_ARG_BAD };
+
+struct fmt_arg_s {
+    int fa_kind;
+    size_t fa_size;
+};
+
+template <class T>
+constexpr fmt_arg_s
+fmtArg (void)
+{
+    typedef std::decay_t<T> U;
+
+    if constexpr (std::is_base_of_v<std::string, U> ||
+		  std::is_same_v<U, const char *> || std::is_same_v<U, char *>)
+	return { FMT_ARG_STR, 0 };
+    else if constexpr (std::is_pointer_v<U> || std::is_null_pointer_v<U>)
+	return { FMT_ARG_PTR, 0 };
+    else if constexpr (std::is_integral_v<U> || std::is_enum_v<U>)
+	return { FMT_ARG_INT, sizeof(U) < sizeof(int) ? sizeof(int) : sizeof(U) };
+    else if constexpr (std::is_same_v<U, long double>)
+	return { FMT_ARG_LDOUBLE, 0 };
+    else if constexpr (std::is_floating_point_v<U>)
+	return { FMT_ARG_DOUBLE, 0 };
+    else
+	return { FMT_ARG_BAD, 0 };
+}
+
+/*
+ * Does each conversion in fmt have an argument of its type, and each
+ * argument a conversion?  Integers have to be the size the length
+ * modifier says, %n isn't allowed.
+ */
+template <class... Args>
+constexpr bool
+fmtCheck (const char *fmt)
+{
+    const fmt_arg_s args[] = { fmtArg<Args>()..., { FMT_ARG_BAD, 0 } };
+    const size_t nargs = sizeof...(Args);
+    size_t a = 0;
+
+    for (const char *p = fmt; *p; p++) {
+	size_t isize = sizeof(int);
+	bool ldouble = false;
+
+	if (*p != '%')
+	    continue;
+	if (*++p == '%')
+	    continue;
+
+	while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0')
+	    p++;
+	/* A * width or precision takes an int */
+	for (int field = 0; field < 2; field++) {
+	    if (field == 1) {
+		if (*p != '.')
+		    break;
+		p++;
+	    }
+	    if (*p == '*') {
+		if (a == nargs || args[a].fa_kind != FMT_ARG_INT ||
+		    args[a].fa_size != sizeof(int))
+		    return false;
+		a++;
+		p++;
+	    }
+	    while (*p >= '0' && *p <= '9')
+		p++;
+	}
+
+	switch (*p) {
+	case 'h':
+	    p += p[1] == 'h' ? 2 : 1;
+	    break;
+	case 'l':
+	    isize = p[1] == 'l' ? sizeof(long long) : sizeof(long);
+	    p += p[1] == 'l' ? 2 : 1;
+	    break;
+	case 'z': isize = sizeof(size_t); p++; break;
+	case 'j': isize = sizeof(intmax_t); p++; break;
+	case 't': isize = sizeof(ptrdiff_t); p++; break;
+	case 'L': ldouble = true; p++; break;
+	}
+
+	if (a == nargs)
+	    return false;
+	switch (*p) {
+	case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+	    if (args[a].fa_kind != FMT_ARG_INT || args[a].fa_size != isize)
+		return false;
+	    break;
+	case 'e': case 'E': case 'f': case 'F':
+	case 'g': case 'G': case 'a': case 'A':
+	    if (args[a].fa_kind != (ldouble ? FMT_ARG_LDOUBLE : FMT_ARG_DOUBLE))
+		return false;
+	    break;
+	case 's':
+	    if (args[a].fa_kind != FMT_ARG_STR)
+		return false;
+	    break;
+	case 'p':
+	    if (args[a].fa_kind != FMT_ARG_PTR && args[a].fa_kind != FMT_ARG_STR)
+		return false;
+	    break;
+	default:
+	    return false;
+	}
+	a++;
+    }
+    return a == nargs;
+}
+
+/*
+ * A std::string that printf()s.  Appended text is formatted in place
+ * into the string's spare capacity, so appending to one that's reused,
+ * like the editor's frame, doesn't allocate or copy once it has grown.
+ * format() replaces the text with a copy from the stack, or in place
+ * when it's long, which doesn't allocate either once the string has
+ * held as much.
+ *
+ * format() and append() with a plain format are checked by -Wformat,
+ * when it's a literal.  Given a "..."_fmt literal, each conversion is
+ * checked against the type of its argument by a static_assert, and a
+ * std::string can be passed for a %s as it is.
+ */
 class string_fmt_c : public std::string
 {
 public:
-    string_fmt_c() : std::string() {}
-    string_fmt_c(const char *s) : std::string(s) {}
+    string_fmt_c() : std::string(), sf_room(0) {}
+    string_fmt_c(const char *s) : std::string(s), sf_room(0) {}
 
     void vformat(const char *fmt, va_list);
-    void format(const char *fmt, ...);
-    void append(const char *fmt, ...);
+    void vappend(const char *fmt, va_list);
+    void format(const char *fmt, ...) FMT_PRINTF(2, 3);
+    void append(const char *fmt, ...) FMT_PRINTF(2, 3);
+
+    template <char... cs, class... Args>
+    void format (fmt_literal_s<cs...> fmt, const Args &...args) {
+	static_assert(fmtCheck<Args...>(fmt_literal_s<cs...>::fl_text),
+		      "format doesn't match its arguments");
+	format(fmt.fl_text, arg(args)...);
+    }
+    template <char... cs, class... Args>
+    void append (fmt_literal_s<cs...> fmt, const Args &...args) {
+	static_assert(fmtCheck<Args...>(fmt_literal_s<cs...>::fl_text),
+		      "format doesn't match its arguments");
+	append(fmt.fl_text, arg(args)...);
+    }
+
+private:
+    void vput(size_t pos, const char *fmt, va_list);
+    void used(size_t n);
+
+    size_t sf_room;		/* what output needed lately, see vput() */
+
+    template <class T>
+    static auto arg (const T &v) {
+	if constexpr (std::is_base_of_v<std::string, T>)
+	    return v.c_str();
+	else
+	    return std::decay_t<T>(v);
+    }
 };
 
 #endif
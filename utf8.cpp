@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2015, Wing Eng
+ * All rights reserved.
+ */
+#include <array>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "utf8.h"
+
+using namespace std;
+
+struct utf8_range_s {
+    uint32_t ur_first;
+    uint32_t ur_last;
+};
+
+/*
+ * Codepoints taking no column: combining marks, the zero width and
+ * bidi controls, variation selectors and emoji modifiers.  These are
+ * also the ones that extend a grapheme cluster.
+ */
+static constexpr utf8_range_s utf8_zero[] = {
+    { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD },
+    { 0x05BF, 0x05BF }, { 0x05C1, 0x05C2 }, { 0x05C4, 0x05C5 },
+    { 0x05C7, 0x05C7 }, { 0x0610, 0x061A }, { 0x064B, 0x065F },
+    { 0x0670, 0x0670 }, { 0x06D6, 0x06DC }, { 0x06DF, 0x06E4 },
+    { 0x06E7, 0x06E8 }, { 0x06EA, 0x06ED }, { 0x0711, 0x0711 },
+    { 0x0730, 0x074A }, { 0x07A6, 0x07B0 }, { 0x07EB, 0x07F3 },
+    { 0x0816, 0x0819 }, { 0x081B, 0x0823 }, { 0x0825, 0x0827 },
+    { 0x0829, 0x082D }, { 0x0859, 0x085B }, { 0x08D3, 0x08E1 },
+    { 0x08E3, 0x0902 }, { 0x093A, 0x093A }, { 0x093C, 0x093C },
+    { 0x0941, 0x0948 }, { 0x094D, 0x094D }, { 0x0951, 0x0957 },
+    { 0x0962, 0x0963 }, { 0x0981, 0x0981 }, { 0x09BC, 0x09BC },
+    { 0x09C1, 0x09C4 }, { 0x09CD, 0x09CD }, { 0x09E2, 0x09E3 },
+    { 0x0A01, 0x0A02 }, { 0x0A3C, 0x0A3C }, { 0x0A41, 0x0A42 },
+    { 0x0A47, 0x0A48 }, { 0x0A4B, 0x0A4D }, { 0x0A70, 0x0A71 },
+    { 0x0A81, 0x0A82 }, { 0x0ABC, 0x0ABC }, { 0x0AC1, 0x0AC5 },
+    { 0x0AC7, 0x0AC8 }, { 0x0ACD, 0x0ACD }, { 0x0B01, 0x0B01 },
+    { 0x0B3C, 0x0B3C }, { 0x0B3F, 0x0B3F }, { 0x0B41, 0x0B44 },
+    { 0x0B4D, 0x0B4D }, { 0x0B82, 0x0B82 }, { 0x0BC0, 0x0BC0 },
+    { 0x0BCD, 0x0BCD }, { 0x0C3E, 0x0C40 }, { 0x0C46, 0x0C48 },
+    { 0x0C4A, 0x0C4D }, { 0x0CBC, 0x0CBC }, { 0x0CCC, 0x0CCD },
+    { 0x0D41, 0x0D44 }, { 0x0D4D, 0x0D4D }, { 0x0DCA, 0x0DCA },
+    { 0x0DD2, 0x0DD4 }, { 0x0DD6, 0x0DD6 }, { 0x0E31, 0x0E31 },
+    { 0x0E34, 0x0E3A }, { 0x0E47, 0x0E4E }, { 0x0EB1, 0x0EB1 },
+    { 0x0EB4, 0x0EBC }, { 0x0EC8, 0x0ECD }, { 0x0F18, 0x0F19 },
+    { 0x0F35, 0x0F35 }, { 0x0F37, 0x0F37 }, { 0x0F39, 0x0F39 },
+    { 0x0F71, 0x0F7E }, { 0x0F80, 0x0F84 }, { 0x0F86, 0x0F87 },
+    { 0x0F8D, 0x0FBC }, { 0x0FC6, 0x0FC6 }, { 0x102D, 0x1030 },
+    { 0x1032, 0x1037 }, { 0x1039, 0x103A }, { 0x103D, 0x103E },
+    { 0x1058, 0x1059 }, { 0x1160, 0x11FF }, { 0x135D, 0x135F },
+    { 0x1712, 0x1714 }, { 0x1732, 0x1734 }, { 0x1752, 0x1753 },
+    { 0x1772, 0x1773 }, { 0x17B4, 0x17B5 }, { 0x17B7, 0x17BD },
+    { 0x17C6, 0x17C6 }, { 0x17C9, 0x17D3 }, { 0x17DD, 0x17DD },
+    { 0x180B, 0x180F }, { 0x18A9, 0x18A9 }, { 0x1920, 0x1922 },
+    { 0x1927, 0x1928 }, { 0x1932, 0x1932 }, { 0x1939, 0x193B },
+    { 0x1A17, 0x1A18 }, { 0x1A56, 0x1A56 }, { 0x1A58, 0x1A60 },
+    { 0x1A65, 0x1A6C }, { 0x1A73, 0x1A7F }, { 0x1AB0, 0x1AFF },
+    { 0x1B00, 0x1B03 }, { 0x1B34, 0x1B34 }, { 0x1B36, 0x1B3A },
+    { 0x1B6B, 0x1B73 }, { 0x1DC0, 0x1DFF }, { 0x200B, 0x200F },
+    { 0x202A, 0x202E }, { 0x2060, 0x2064 }, { 0x20D0, 0x20FF },
+    { 0x2CEF, 0x2CF1 }, { 0x2DE0, 0x2DFF }, { 0x302A, 0x302D },
+    { 0x3099, 0x309A }, { 0xA66F, 0xA672 }, { 0xA674, 0xA67D },
+    { 0xA69E, 0xA69F }, { 0xA6F0, 0xA6F1 }, { 0xA8E0, 0xA8F1 },
+    { 0xFB1E, 0xFB1E }, { 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F },
+    { 0xFEFF, 0xFEFF }, { 0x1D167, 0x1D169 }, { 0x1D17B, 0x1D182 },
+    { 0x1D185, 0x1D18B }, { 0x1D1AA, 0x1D1AD }, { 0x1F3FB, 0x1F3FF },
+    { 0xE0001, 0xE0001 }, { 0xE0020, 0xE007F }, { 0xE0100, 0xE01EF },
+};
+
+/* East Asian wide and fullwidth codepoints, and the emoji shown wide */
+static constexpr utf8_range_s utf8_wide[] = {
+    { 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A },
+    { 0x23E9, 0x23EC }, { 0x23F0, 0x23F0 }, { 0x23F3, 0x23F3 },
+    { 0x25FD, 0x25FE }, { 0x2614, 0x2615 }, { 0x2648, 0x2653 },
+    { 0x267F, 0x267F }, { 0x2693, 0x2693 }, { 0x26A1, 0x26A1 },
+    { 0x26AA, 0x26AB }, { 0x26BD, 0x26BE }, { 0x26C4, 0x26C5 },
+    { 0x26CE, 0x26CE }, { 0x26D4, 0x26D4 }, { 0x26EA, 0x26EA },
+    { 0x26F2, 0x26F3 }, { 0x26F5, 0x26F5 }, { 0x26FA, 0x26FA },
+    { 0x26FD, 0x26FD }, { 0x2705, 0x2705 }, { 0x270A, 0x270B },
+    { 0x2728, 0x2728 }, { 0x274C, 0x274C }, { 0x274E, 0x274E },
+    { 0x2753, 0x2755 }, { 0x2757, 0x2757 }, { 0x2795, 0x2797 },
+    { 0x27B0, 0x27B0 }, { 0x27BF, 0x27BF }, { 0x2B1B, 0x2B1C },
+    { 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 }, { 0x2E80, 0x303E },
+    { 0x3041, 0x33FF }, { 0x3400, 0x4DBF }, { 0x4E00, 0x9FFF },
+    { 0xA000, 0xA4CF }, { 0xA960, 0xA97F }, { 0xAC00, 0xD7A3 },
+    { 0xF900, 0xFAFF }, { 0xFE10, 0xFE19 }, { 0xFE30, 0xFE6F },
+    { 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 }, { 0x16FE0, 0x16FE4 },
+    { 0x17000, 0x187F7 }, { 0x18800, 0x18CD5 }, { 0x1B000, 0x1B2FF },
+    { 0x1F004, 0x1F004 }, { 0x1F0CF, 0x1F0CF }, { 0x1F18E, 0x1F18E },
+    { 0x1F191, 0x1F19A }, { 0x1F200, 0x1F202 }, { 0x1F210, 0x1F23B },
+    { 0x1F240, 0x1F248 }, { 0x1F250, 0x1F251 }, { 0x1F260, 0x1F265 },
+    { 0x1F300, 0x1F320 }, { 0x1F32D, 0x1F335 }, { 0x1F337, 0x1F37C },
+    { 0x1F37E, 0x1F393 }, { 0x1F3A0, 0x1F3CA }, { 0x1F3CF, 0x1F3D3 },
+    { 0x1F3E0, 0x1F3F0 }, { 0x1F3F4, 0x1F3F4 }, { 0x1F3F8, 0x1F3FA },
+    { 0x1F400, 0x1F43E }, { 0x1F440, 0x1F440 }, { 0x1F442, 0x1F4FC },
+    { 0x1F4FF, 0x1F53D }, { 0x1F54B, 0x1F54E }, { 0x1F550, 0x1F567 },
+    { 0x1F57A, 0x1F57A }, { 0x1F595, 0x1F596 }, { 0x1F5A4, 0x1F5A4 },
+    { 0x1F5FB, 0x1F64F }, { 0x1F680, 0x1F6C5 }, { 0x1F6CC, 0x1F6CC },
+    { 0x1F6D0, 0x1F6D2 }, { 0x1F6D5, 0x1F6D7 }, { 0x1F6EB, 0x1F6EC },
+    { 0x1F6F4, 0x1F6FC }, { 0x1F7E0, 0x1F7EB }, { 0x1F90C, 0x1F93A },
+    { 0x1F93C, 0x1F945 }, { 0x1F947, 0x1F9FF }, { 0x1FA70, 0x1FAFF },
+    { 0x20000, 0x2FFFD }, { 0x30000, 0x3FFFD },
+};
+
+template <size_t N> static constexpr bool
+utf8Sorted (const utf8_range_s (&t)[N])
+{
+    for (size_t i = 0; i < N; i++) {
+	if (t[i].ur_first > t[i].ur_last)
+	    return false;
+	if (i && t[i - 1].ur_last >= t[i].ur_first)
+	    return false;
+    }
+    return true;
+}
+
+static_assert(utf8Sorted(utf8_zero), "utf8_zero must be sorted");
+static_assert(utf8Sorted(utf8_wide), "utf8_wide must be sorted");
+
+template <size_t N> static constexpr bool
+utf8InTable (const utf8_range_s (&t)[N], uint32_t cp)
+{
+    size_t lo = 0, hi = N;
+
+    while (lo < hi) {
+	size_t mid = (lo + hi) / 2;
+
+	if (cp > t[mid].ur_last)
+	    lo = mid + 1;
+	else if (cp < t[mid].ur_first)
+	    hi = mid;
+	else
+	    return true;
+    }
+    return false;
+}
+
+/*
+ * Width of each BMP codepoint, two bits each: 0 for one column, 1 for
+ * none and 2 for two.  Filled from the tables at compile time, the
+ * zero width ones last as a few marks are inside wide blocks.  The
+ * rest of Unicode is rare enough to search the tables for.
+ */
+#define UTF8_BMP_ZERO	1
+#define UTF8_BMP_WIDE	2
+
+typedef array<uint8_t, 0x10000 / 4> utf8_bmp_t;
+
+template <size_t N> static constexpr void
+utf8BmpFill (utf8_bmp_t &bmp, const utf8_range_s (&t)[N], uint8_t v)
+{
+    for (auto &r : t) {
+	for (uint32_t cp = r.ur_first; cp <= r.ur_last && cp < 0x10000; cp++) {
+	    /* Whole bytes at a time where the range covers them */
+	    if (cp % 4 == 0 && cp + 3 <= r.ur_last) {
+		bmp[cp / 4] = v * 0x55;
+		cp += 3;
+	    } else {
+		int shift = cp % 4 * 2;
+
+		bmp[cp / 4] = (bmp[cp / 4] & ~(3 << shift)) | (v << shift);
+	    }
+	}
+    }
+}
+
+static constexpr utf8_bmp_t
+utf8BmpTable (void)
+{
+    utf8_bmp_t bmp {};
+
+    utf8BmpFill(bmp, utf8_wide, UTF8_BMP_WIDE);
+    utf8BmpFill(bmp, utf8_zero, UTF8_BMP_ZERO);
+    return bmp;
+}
+
+static constexpr utf8_bmp_t utf8_bmp = utf8BmpTable();
+
+static_assert(((utf8_bmp[0x4E00 / 4] >> 0) & 3) == UTF8_BMP_WIDE, "CJK is wide");
+static_assert(((utf8_bmp[0x0301 / 4] >> 2) & 3) == UTF8_BMP_ZERO, "marks take no column");
+
+/* Bytes in the sequence lead starts, 0 if it can't start one. */
+size_t
+utf8SeqLen (unsigned char lead)
+{
+    if (lead < 0x80) return 1;
+    if (lead < 0xC2) return 0;
+    if (lead < 0xE0) return 2;
+    if (lead < 0xF0) return 3;
+    if (lead < 0xF5) return 4;
+    return 0;
+}
+
+/* Columns the codepoint takes, 0, 1 or 2. */
+int
+utf8CharWidth (uint32_t cp)
+{
+    if (cp < 0x300)
+	return 1;
+    if (cp < 0x10000) {
+	switch ((utf8_bmp[cp / 4] >> (cp % 4 * 2)) & 3) {
+	case UTF8_BMP_ZERO: return 0;
+	case UTF8_BMP_WIDE: return 2;
+	default: return 1;
+	}
+    }
+    if (utf8InTable(utf8_zero, cp))
+	return 0;
+    return utf8InTable(utf8_wide, cp) ? 2 : 1;
+}
+
+/* Does cp stay in the cluster of the char before it? */
+bool
+utf8Extends (uint32_t cp)
+{
+    return cp >= 0x300 && utf8CharWidth(cp) == 0;
+}
+
+/* Bytes before the first one that isn't ASCII. */
+size_t
+utf8AsciiPrefix (const char *s, size_t n)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+	int high = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (s + i)));
+
+	if (high)
+	    return i + __builtin_ctz(high);
+    }
+#endif
+    for (; i + 8 <= n; i += 8) {
+	uint64_t w;
+
+	memcpy(&w, s + i, 8);
+	if (w & 0x8080808080808080ULL)
+	    break;
+    }
+    while (i < n && !(s[i] & 0x80))
+	i++;
+    return i;
+}
+
+/* Columns s takes on the terminal. */
+size_t
+utf8Columns (string_view s)
+{
+    size_t i = utf8AsciiPrefix(s.data(), s.size());
+    size_t cols = i;
+
+    /* The char before the first that isn't may be extended by it */
+    if (i && i < s.size()) {
+	i--;
+	cols--;
+    }
+    while (i < s.size())
+	cols += utf8ClusterWidth(s, s.size(), i, &i);
+    return cols;
+}
+
+#ifdef _TEST
+
+#include <assert.h>
+#include <stdio.h>
+#include <string>
+
+#define TEST(x) if (!(x)) assert(0)
+
+/* Boundaries by utf8Next() forwards and utf8Prev() backwards agree */
+static void
+clusters (string_view s, size_t want)
+{
+    size_t fwd[64], n = 0;
+
+    for (size_t i = 0; i < s.size(); i = utf8Next(s, s.size(), i))
+	fwd[n++] = i;
+    TEST(n == want);
+    for (size_t i = s.size(); i > 0; ) {
+	i = utf8Prev(s, s.size(), i);
+	TEST(n && fwd[--n] == i);
+    }
+    TEST(n == 0);
+}
+
+int
+main ()
+{
+    uint32_t cp;
+
+    /* Widths */
+    TEST(utf8CharWidth('a') == 1);
+    TEST(utf8CharWidth(0xE9) == 1);
+    TEST(utf8CharWidth(0x301) == 0);
+    TEST(utf8CharWidth(0x200D) == 0);
+    TEST(utf8CharWidth(0x4E2D) == 2);
+    TEST(utf8CharWidth(0xAC00) == 2);
+    TEST(utf8CharWidth(0xFF21) == 2);
+    TEST(utf8CharWidth(0x1F600) == 2);
+    TEST(utf8CharWidth(0x20000) == 2);
+    TEST(utf8CharWidth(0xE0100) == 0);
+    TEST(utf8CharWidth(0x10000) == 1);
+
+    /* The BMP table agrees with the ranges */
+    for (uint32_t c = 0x300; c < 0x10000; c++) {
+	int w = utf8InTable(utf8_zero, c) ? 0 : utf8InTable(utf8_wide, c) ? 2 : 1;
+
+	TEST(utf8CharWidth(c) == w);
+    }
+
+    /* Decoding */
+    TEST(utf8Decode(string_view("\xC3\xA9"), 2, 0, &cp) == 2 && cp == 0xE9);
+    TEST(utf8Decode(string_view("\xE4\xB8\xAD"), 3, 0, &cp) == 3 && cp == 0x4E2D);
+    TEST(utf8Decode(string_view("\xF0\x9F\x98\x80"), 4, 0, &cp) == 4 && cp == 0x1F600);
+    TEST(utf8Decode(string_view("\xE4\xB8"), 2, 0, &cp) == 1 && cp == UTF8_INVALID);
+    TEST(utf8Decode(string_view("\xA9x"), 2, 0, &cp) == 1 && cp == UTF8_INVALID);
+    TEST(utf8Decode(string_view("\xC3x"), 2, 0, &cp) == 1 && cp == UTF8_INVALID);
+
+    /* Clusters */
+    clusters("abc", 3);
+    clusters("e\xCC\x81x", 2);				/* e + acute */
+    clusters("\xE4\xB8\xAD\xE6\x96\x87", 2);		/* two CJK */
+    clusters("\xF0\x9F\x91\xA9\xE2\x80\x8D\xF0\x9F\x92\xBB", 1);	/* ZWJ sequence */
+    clusters("\xF0\x9F\x91\x8D\xF0\x9F\x8F\xBD", 1);	/* thumbs up, skin tone */
+    clusters("\xF0\x9F\x87\xAB\xF0\x9F\x87\xB7\xF0\x9F\x87\xAC", 2);	/* flag + lone RI */
+    clusters("\xE2\x9D\xA4\xEF\xB8\x8F", 1);		/* heart + VS16 */
+    clusters("a\xA9\xC3", 3);				/* invalid bytes */
+    clusters("\xCC\x81" "a", 2);			/* mark with no base */
+
+    /* Columns */
+    TEST(utf8Columns("hello") == 5);
+    TEST(utf8Columns("h\xC3\xA9llo") == 5);
+    TEST(utf8Columns("e\xCC\x81") == 1);
+    TEST(utf8Columns("\xE4\xB8\xAD\xE6\x96\x87") == 4);
+    TEST(utf8Columns("abc\xF0\x9F\x91\xA9\xE2\x80\x8D\xF0\x9F\x92\xBB") == 5);
+
+    /* The ASCII scan, at every alignment and length */
+    char buf[80];
+
+    memset(buf, 'a', sizeof(buf));
+    for (size_t off = 0; off < 16; off++) {
+	for (size_t n = 0; n < 40; n++) {
+	    for (size_t hi = 0; hi <= n; hi++) {
+		if (hi < n) buf[off + hi] = (char) 0xC3;
+		TEST(utf8AsciiPrefix(buf + off, n) == hi);
+		buf[off + hi] = 'a';
+	    }
+	}
+    }
+
+    printf("all test passed\n");
+    return 0;
+}
+#endif
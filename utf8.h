@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2015, Wing Eng
+ * All rights reserved.
+ */
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <string_view>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * UTF-8 for the editor: what a codepoint looks like on the terminal
+ * and where the user perceived chars (grapheme clusters) start.  The
+ * cluster rules are the ones that matter on a command line: combining
+ * marks, variation selectors and emoji modifiers stay with the char
+ * before them, a ZWJ joins the chars on either side, and regional
+ * indicators pair into flags.  Invalid bytes are a char of their own.
+ *
+ * The width tables are built at compile time.  Text that's all ASCII
+ * is found with utf8AsciiPrefix(), SIMD where there is some, and needs
+ * no decoding at all: one byte, one column.
+ */
+#define UTF8_INVALID	0xFFFD
+
+size_t utf8AsciiPrefix(const char *s, size_t n);
+int utf8CharWidth(uint32_t cp);
+bool utf8Extends(uint32_t cp);
+size_t utf8Columns(std::string_view s);
+size_t utf8SeqLen(unsigned char lead);
+
+static inline bool
+utf8IsAscii (std::string_view s)
+{
+    return utf8AsciiPrefix(s.data(), s.size()) == s.size();
+}
+
+static inline bool
+utf8IsRegional (uint32_t cp)
+{
+    return cp >= 0x1F1E6 && cp <= 0x1F1FF;
+}
+
+/*
+ * The templates below work on anything indexed with [] and n long,
+ * a string_view or the gap buffer the line is edited in.
+ */
+
+/* Decode the codepoint at i, returns its length in bytes. */
+template <class T> size_t
+utf8Decode (const T &s, size_t n, size_t i, uint32_t *cp)
+{
+    unsigned char c = s[i];
+    size_t len = utf8SeqLen(c);
+    uint32_t v;
+
+    if (len == 1) {
+	*cp = c;
+	return 1;
+    }
+    if (len == 0 || i + len > n) {
+	*cp = UTF8_INVALID;
+	return 1;
+    }
+    v = c & (0x7F >> len);
+    for (size_t k = 1; k < len; k++) {
+	unsigned char cc = s[i + k];
+
+	if ((cc & 0xC0) != 0x80) {
+	    *cp = UTF8_INVALID;
+	    return 1;
+	}
+	v = (v << 6) | (cc & 0x3F);
+    }
+    *cp = v;
+    return len;
+}
+
+/* Start of the codepoint before i. */
+template <class T> size_t
+utf8PrevChar (const T &s, size_t i)
+{
+    size_t j = i - 1;
+
+    while (j > 0 && i - j < 4 && ((unsigned char) s[j] & 0xC0) == 0x80)
+	j--;
+    /* Stray continuation bytes are chars of their own */
+    if (utf8SeqLen(s[j]) != i - j)
+	return i - 1;
+    return j;
+}
+
+/* End of the grapheme cluster starting at i. */
+template <class T> size_t
+utf8Next (const T &s, size_t n, size_t i)
+{
+    uint32_t cp, prev;
+    int regional = 0;
+
+    i += utf8Decode(s, n, i, &cp);
+    regional = utf8IsRegional(cp);
+    while (i < n) {
+	prev = cp;
+	size_t len = utf8Decode(s, n, i, &cp);
+
+	if (utf8Extends(cp) || prev == 0x200D) {
+	    i += len;
+	} else if (regional == 1 && utf8IsRegional(cp)) {
+	    i += len;
+	    regional = 2;
+	} else {
+	    break;
+	}
+    }
+    return i;
+}
+
+/* Start of the grapheme cluster that ends at i. */
+template <class T> size_t
+utf8Prev (const T &s, size_t n, size_t i)
+{
+    uint32_t cp, before;
+    size_t j = utf8PrevChar(s, i);
+
+    while (j > 0) {
+	size_t k = utf8PrevChar(s, j);
+
+	utf8Decode(s, n, j, &cp);
+	utf8Decode(s, n, k, &before);
+	if (utf8Extends(cp) || before == 0x200D) {
+	    j = k;
+	    continue;
+	}
+	if (utf8IsRegional(cp) && utf8IsRegional(before)) {
+	    /* Flags pair from the start of the run */
+	    size_t run = 1;
+
+	    for (size_t m = k; m > 0; run++) {
+		uint32_t r;
+
+		m = utf8PrevChar(s, m);
+		utf8Decode(s, n, m, &r);
+		if (!utf8IsRegional(r))
+		    break;
+	    }
+	    if (run % 2)
+		j = k;
+	}
+	break;
+    }
+    return j;
+}
+
+/*
+ * Does a cluster start at i?  Conservative where the bytes aren't
+ * valid UTF-8: a continuation byte never starts one.
+ */
+template <class T> bool
+utf8IsBoundary (const T &s, size_t n, size_t i)
+{
+    if (i == 0 || i >= n)
+	return true;
+    if (((unsigned char) s[i] & 0xC0) == 0x80)
+	return false;
+    return utf8Next(s, n, utf8Prev(s, n, i)) == i;
+}
+
+/* Columns of the cluster at i, and where it ends in *end. */
+template <class T> size_t
+utf8ClusterWidth (const T &s, size_t n, size_t i, size_t *end)
+{
+    uint32_t cp;
+
+    utf8Decode(s, n, i, &cp);
+    *end = utf8Next(s, n, i);
+    return utf8CharWidth(cp);
+}
+
+#endif